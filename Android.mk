@@ -1,19 +1,29 @@
 LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
-LOCAL_CFLAGS += -Wall -O2
+LOCAL_CFLAGS += -Wall -Werror=type-limits -O2
 LOCAL_MODULE := libplhw
 LOCAL_MODULE_TAGS := eng
 LOCAL_SRC_FILES := \
 	adc11607.c \
+	board.c \
 	cpld.c \
 	dac5820.c \
+	discover.c \
 	eeprom.c \
 	gpioex.c \
+	gpioline.c \
 	max17135.c \
 	tps65185.c \
 	i2cdev.c \
+	i2crec.c \
+	i2csim.c \
+	idcache.c \
 	pbtn.c \
+	plhw_config.c \
+	regmap.c \
 	util.c
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libplutil
 include $(BUILD_STATIC_LIBRARY)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
@@ -20,9 +20,11 @@
 */
 
 #include "adc11607.h"
+#include "board.h"
 #include "i2cdev.h"
+#include "plhw_config.h"
+#include "util.h"
 #include <libplhw.h>
-#include <plsdk/plconfig.h>
 #include <assert.h>
 
 #define LOG_TAG "adc11607"
@@ -30,16 +32,20 @@
 
 struct adc11607 {
 	struct i2cdev *i2c;
-	struct plconfig *config;
+	struct plhw_config *config;
 	union adc11607_setup_config cmd;
 	unsigned nb_channels;
 	enum adc11607_ref_id ref_id;
 	float ext_ref;
 	float ref;
 	adc11607_result_t results[ADC11607_NB_RESULTS];
+	int in_place;
+	int ready;
 };
 
-static int set_init_config(struct adc11607 *adc);
+static int check_ready(struct adc11607 *adc);
+static int setup_cb(void *ctx);
+static void set_init_config(struct adc11607 *adc);
 static void set_nb_channels(struct adc11607 *adc);
 static void set_ref(struct adc11607 *adc, struct adc11607_setup *setup,
 		    enum adc11607_ref_id ref_id);
@@ -48,54 +54,113 @@ static void set_invalid_results(struct adc11607 *adc);
 struct adc11607 *adc11607_init(const char *i2c_bus, int i2c_address)
 {
 	struct adc11607 *adc;
-	int error = 1;
 
-	adc = malloc(sizeof (struct adc11607));
+	adc = malloc(adc11607_size());
 
 	if (adc == NULL)
 		return NULL;
 
-	adc->config = plconfig_init(NULL, "libplhw");
+	if (adc11607_init_at(adc, i2c_bus, i2c_address) == NULL) {
+		free(adc);
+		return NULL;
+	}
+
+	adc->in_place = 0;
+
+	if (!plhw_config_get_int(adc->config, "lazy-init", 0)
+	    && adc11607_setup(adc)) {
+		adc11607_free(adc);
+		return NULL;
+	}
+
+	return adc;
+}
+
+size_t adc11607_size(void)
+{
+	return PLHW_ALIGN(sizeof (struct adc11607)) + i2cdev_size();
+}
+
+struct adc11607 *adc11607_init_at(void *mem, const char *i2c_bus,
+				  int i2c_address)
+{
+	struct adc11607 *adc = mem;
+	char *i2c_mem = (char *) mem + PLHW_ALIGN(sizeof (struct adc11607));
+
+	assert(mem != NULL);
+
+	adc->in_place = 1;
+	lazy_set_ready(&adc->ready, 0);
+	adc->config = plhw_config_get();
 
 	if (adc->config == NULL)
-		goto err_free_adc;
+		return NULL;
 
 	if (i2c_address == PLHW_NO_I2C_ADDR)
-		i2c_address = plconfig_get_i2c_addr(
+		i2c_address = plhw_config_get_i2c_addr(
 			adc->config, "MAX116xx-address", 0x34);
 
-	adc->i2c = i2cdev_init(i2c_bus, i2c_address);
+	adc->i2c = i2cdev_init_at(i2c_mem, i2c_bus, i2c_address);
 
-	if (adc->i2c == NULL)
+	if (adc->i2c == NULL) {
 		LOG("failed to initialise I2C");
-	else if (set_init_config(adc) < 0)
-		LOG("failed to set the initial configuration");
-	else
-		error = 0;
-
-	if (error) {
-		adc11607_free(adc);
-		adc = NULL;
+		plhw_config_put(adc->config);
+		return NULL;
 	}
 
+	set_init_config(adc);
+
 	return adc;
+}
 
-err_free_adc:
-	free(adc);
+int adc11607_add_setup(struct adc11607 *adc, struct i2cdev_txn **t)
+{
+	assert(adc != NULL);
+	assert(t != NULL);
+
+	if ((*t == NULL) && ((*t = i2cdev_txn_begin(adc->i2c)) == NULL))
+		return -1;
+
+	if (i2cdev_txn_add_write(*t, adc->i2c, adc->cmd.bytes,
+				 sizeof adc->cmd) < 0)
+		return -1;
+
+	lazy_set_ready(&adc->ready, 1);
 
-	return NULL;
+	return 0;
+}
+
+int adc11607_setup(struct adc11607 *adc)
+{
+	assert(adc != NULL);
+
+	if (i2cdev_write(adc->i2c, adc->cmd.bytes, sizeof adc->cmd) < 0) {
+		LOG("failed to set the initial configuration");
+		lazy_set_ready(&adc->ready, 0);
+		return -1;
+	}
+
+	lazy_set_ready(&adc->ready, 1);
+
+	return 0;
 }
 
 void adc11607_free(struct adc11607 *adc)
 {
 	assert(adc != NULL);
 
-	plconfig_free(adc->config);
+	plhw_config_put(adc->config);
+	i2cdev_free(adc->i2c);
+
+	if (!adc->in_place)
+		free(adc);
+}
 
-	if (adc->i2c != NULL)
-		i2cdev_free(adc->i2c);
+struct i2cdev *adc11607_get_i2c(struct adc11607 *adc)
+{
+	assert(adc != NULL);
 
-	free(adc);
+	return adc->i2c;
 }
 
 void adc11607_set_ext_ref_value(struct adc11607 *adc, float value)
@@ -108,13 +173,20 @@ void adc11607_set_ext_ref_value(struct adc11607 *adc, float value)
 int adc11607_set_ref(struct adc11607 *adc, enum adc11607_ref_id ref_id)
 {
 	struct adc11607_setup *setup;
+	int ret;
 
 	assert(adc != NULL);
 
+	if (check_ready(adc))
+		return -1;
+
 	setup = &adc->cmd.setup;
+	i2cdev_lock(adc->i2c);
 	set_ref(adc, setup, ref_id);
+	ret = i2cdev_write(adc->i2c, setup, 1);
+	i2cdev_unlock(adc->i2c);
 
-	return i2cdev_write(adc->i2c, setup, 1);
+	return ret;
 }
 
 enum adc11607_ref_id adc11607_get_ref(struct adc11607 *adc)
@@ -133,18 +205,27 @@ unsigned adc11607_get_nb_channels(struct adc11607 *adc)
 
 int adc11607_select_channel_range(struct adc11607 *adc, unsigned range)
 {
+	int ret;
+
 	assert(adc != NULL);
 
+	if (check_ready(adc))
+		return -1;
+
+	i2cdev_lock(adc->i2c);
 	set_invalid_results(adc);
 
 	if (range >= adc->nb_channels) {
 		LOG("invalid channel range number");
-		return -1;
+		ret = -1;
+	} else {
+		adc->cmd.config.cs = range;
+		ret = i2cdev_write(adc->i2c, &adc->cmd.config, 1);
 	}
 
-	adc->cmd.config.cs = range;
+	i2cdev_unlock(adc->i2c);
 
-	return i2cdev_write(adc->i2c, &adc->cmd.config, 1);
+	return ret;
 }
 
 int adc11607_read_results(struct adc11607 *adc)
@@ -157,6 +238,10 @@ int adc11607_read_results(struct adc11607 *adc)
 
 	assert(adc != NULL);
 
+	if (check_ready(adc))
+		return -1;
+
+	i2cdev_lock(adc->i2c);
 	n = adc->cmd.config.cs + 1;
 	assert(n <= ADC11607_NB_RESULTS);
 
@@ -165,6 +250,7 @@ int adc11607_read_results(struct adc11607 *adc)
 	if (i2cdev_read(adc->i2c, data, read_n) < 0) {
 		LOG("failed to read the results");
 		set_invalid_results(adc);
+		i2cdev_unlock(adc->i2c);
 		return -1;
 	}
 
@@ -174,6 +260,8 @@ int adc11607_read_results(struct adc11607 *adc)
 	for (i = n; i < ADC11607_NB_RESULTS; ++i)
 		adc->results[i] = ADC11607_INVALID_RESULT;
 
+	i2cdev_unlock(adc->i2c);
+
 	return 0;
 }
 
@@ -207,7 +295,18 @@ unsigned adc11607_get_millivolts(struct adc11607 *adc, adc11607_result_t value)
  * static functions
  */
 
-static int set_init_config(struct adc11607 *adc)
+/* With lazy-init, the initial configuration is only sent on first use */
+static int check_ready(struct adc11607 *adc)
+{
+	return lazy_setup(&adc->ready, adc->i2c, setup_cb, adc);
+}
+
+static int setup_cb(void *ctx)
+{
+	return adc11607_setup(ctx);
+}
+
+static void set_init_config(struct adc11607 *adc)
 {
 	struct adc11607_setup * const setup = &adc->cmd.setup;
 	struct adc11607_config * const config = &adc->cmd.config;
@@ -225,13 +324,8 @@ static int set_init_config(struct adc11607 *adc)
 	config->scan = 0;
 	config->config_0 = 0;
 
-	if (i2cdev_write(adc->i2c, adc->cmd.bytes, sizeof adc->cmd) < 0)
-		return -1;
-
 	set_nb_channels(adc);
 	set_invalid_results(adc);
-
-	return 0;
 }
 
 static void set_nb_channels(struct adc11607 *adc)
@@ -0,0 +1,10 @@
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+LOCAL_CFLAGS += -Wall -Werror=type-limits -O2
+LOCAL_MODULE := plhw_bench
+LOCAL_MODULE_TAGS := eng
+LOCAL_SRC_FILES := plhw_bench.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_STATIC_LIBRARIES := libplhw
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,1014 @@
+/*
+  Plastic Logic hardware library - benchmark
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Run each public libplhw operation a number of times and report the wall
+ * time, the number of system calls made on the bus device and the number of
+ * bus transfers per call, as CSV or JSON.  The bus can be a real I2C bus
+ * device, a simulated one ("sim:", the default) or a replayed one
+ * ("replay:").  The write operations write back the values read when
+ * starting, so the hardware state is left unchanged.  The other ones
+ * (BENCH_WRITE) change the hardware state: the DAC outputs and the TPS65185
+ * power mode can't be read back and the EEPROM writes wear the part.  They
+ * only run on a simulated or replayed bus, unless -w is given.  The HV cycle
+ * (BENCH_HV) turns the high voltages on, so it only ever runs on a
+ * simulated or replayed bus.  With -t, the accesses made by the parts
+ * created when starting are traced and the last ones printed at the end.  */
+
+#include <libplhw.h>
+#include "i2cdev.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEF_BUS "sim:"
+#define DEF_LOOPS 100
+#define DEF_EEPROM_MODE "24c256"
+#define DEF_EEPROM_ADDR 0x50
+#define EEPROM_MAX_BENCH_SIZE 1024
+
+enum bench_dev {
+	DEV_NONE,
+	DEV_CPLD,
+	DEV_MAX17135,
+	DEV_TPS65185,
+	DEV_EEPROM,
+	DEV_DAC,
+	DEV_ADC,
+	DEV_PBTN,
+	DEV_BOARD,
+};
+
+/* Devices and their initial state, used by the write operations */
+struct bench_ctx {
+	const char *bus;
+	const char *eeprom_mode;
+	int eeprom_addr;
+	int virtual_bus;
+	int allow_write;
+	int trace;
+	struct cpld *cpld;
+	struct max17135 *max17135;
+	struct tps65185 *tps65185;
+	struct eeprom *eeprom;
+	struct dac5820 *dac;
+	struct adc11607 *adc;
+	struct pbtn *pbtn;
+	struct plhw_board_desc board;
+	int clamp;
+	char max_vcom;
+	char max_timings[MAX17135_NB_TIMINGS];
+	int max_temp_en;
+	int max_en;
+	uint16_t tps_vcom;
+	int tps_vcom_en;
+	struct tps65185_seq tps_seq;
+	char eeprom_data[EEPROM_MAX_BENCH_SIZE];
+};
+
+enum bench_flags {
+	BENCH_WRITE = 1 << 0,        /* changes the hardware state */
+	BENCH_HV = 1 << 1,           /* turns the high voltages on */
+};
+
+struct bench {
+	const char *name;
+	enum bench_dev dev;
+	int (*run)(struct bench_ctx *ctx, size_t arg);
+	size_t arg;
+	unsigned flags;
+};
+
+struct bench_result {
+	unsigned calls;
+	unsigned errors;
+	unsigned long long wall_ns;
+	struct i2cdev_stats stats;
+};
+
+static int bench_setup(struct bench_ctx *ctx);
+static void bench_teardown(struct bench_ctx *ctx);
+static void bench_set_trace(struct bench_ctx *ctx);
+static void print_trace(void);
+static void *bench_get_dev(struct bench_ctx *ctx, enum bench_dev dev);
+static void run_bench(struct bench_ctx *ctx, struct i2cdev *bus_stats,
+		      const struct bench *b, unsigned loops,
+		      struct bench_result *res);
+static void print_result(const struct bench *b,
+			 const struct bench_result *res, int json, int first);
+static void print_usage(void);
+
+static int run_cpld_init(struct bench_ctx *ctx, size_t arg);
+static int run_cpld_get_version(struct bench_ctx *ctx, size_t arg);
+static int run_cpld_get_board_id(struct bench_ctx *ctx, size_t arg);
+static int run_cpld_dump(struct bench_ctx *ctx, size_t arg);
+static int run_cpld_get_switch(struct bench_ctx *ctx, size_t arg);
+static int run_cpld_set_switch(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_init(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_get_prod_id(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_get_prod_rev(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_get_vcom(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_set_vcom(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_get_timing(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_get_timings(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_set_timing(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_set_timings(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_get_temp_sensor_en(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_set_temp_sensor_en(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_get_temperature(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_get_temp_failure(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_get_pok(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_get_en(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_set_en(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_get_fault(struct bench_ctx *ctx, size_t arg);
+static int run_max17135_get_faults(struct bench_ctx *ctx, size_t arg);
+static int run_tps65185_init(struct bench_ctx *ctx, size_t arg);
+static int run_tps65185_get_vcom(struct bench_ctx *ctx, size_t arg);
+static int run_tps65185_set_vcom(struct bench_ctx *ctx, size_t arg);
+static int run_tps65185_get_seq(struct bench_ctx *ctx, size_t arg);
+static int run_tps65185_set_seq(struct bench_ctx *ctx, size_t arg);
+static int run_tps65185_get_en(struct bench_ctx *ctx, size_t arg);
+static int run_tps65185_set_en(struct bench_ctx *ctx, size_t arg);
+static int run_tps65185_set_power(struct bench_ctx *ctx, size_t arg);
+static int run_eeprom_init(struct bench_ctx *ctx, size_t arg);
+static int run_eeprom_read(struct bench_ctx *ctx, size_t arg);
+static int run_eeprom_write(struct bench_ctx *ctx, size_t arg);
+static int run_dac5820_init(struct bench_ctx *ctx, size_t arg);
+static int run_dac5820_set_power(struct bench_ctx *ctx, size_t arg);
+static int run_dac5820_output(struct bench_ctx *ctx, size_t arg);
+static int run_adc11607_init(struct bench_ctx *ctx, size_t arg);
+static int run_adc11607_set_ref(struct bench_ctx *ctx, size_t arg);
+static int run_adc11607_select_channel_range(struct bench_ctx *ctx,
+					     size_t arg);
+static int run_adc11607_read_results(struct bench_ctx *ctx, size_t arg);
+static int run_pbtn_init(struct bench_ctx *ctx, size_t arg);
+static int run_pbtn_probe(struct bench_ctx *ctx, size_t arg);
+static int run_plhw_board_init(struct bench_ctx *ctx, size_t arg);
+static int run_plhw_board_hv_cycle(struct bench_ctx *ctx, size_t arg);
+
+static const struct bench benches[] = {
+	{ "cpld_init",                   DEV_CPLD, run_cpld_init, 0 },
+	{ "cpld_get_version",            DEV_CPLD, run_cpld_get_version, 0 },
+	{ "cpld_get_board_id",           DEV_CPLD, run_cpld_get_board_id, 0 },
+	{ "cpld_dump",                   DEV_CPLD, run_cpld_dump, 0 },
+	{ "cpld_get_switch",             DEV_CPLD, run_cpld_get_switch, 0 },
+	{ "cpld_set_switch",             DEV_CPLD, run_cpld_set_switch, 0 },
+	{ "max17135_init",               DEV_MAX17135,
+	  run_max17135_init, 0 },
+	{ "max17135_get_prod_id",        DEV_MAX17135,
+	  run_max17135_get_prod_id, 0 },
+	{ "max17135_get_prod_rev",       DEV_MAX17135,
+	  run_max17135_get_prod_rev, 0 },
+	{ "max17135_get_vcom",           DEV_MAX17135,
+	  run_max17135_get_vcom, 0 },
+	{ "max17135_set_vcom",           DEV_MAX17135,
+	  run_max17135_set_vcom, 0 },
+	{ "max17135_get_timing",         DEV_MAX17135,
+	  run_max17135_get_timing, 0 },
+	{ "max17135_get_timings",        DEV_MAX17135,
+	  run_max17135_get_timings, 0 },
+	{ "max17135_set_timing",         DEV_MAX17135,
+	  run_max17135_set_timing, 0 },
+	{ "max17135_set_timings",        DEV_MAX17135,
+	  run_max17135_set_timings, 0 },
+	{ "max17135_get_temp_sensor_en", DEV_MAX17135,
+	  run_max17135_get_temp_sensor_en, 0 },
+	{ "max17135_set_temp_sensor_en", DEV_MAX17135,
+	  run_max17135_set_temp_sensor_en, 0 },
+	{ "max17135_get_temperature",    DEV_MAX17135,
+	  run_max17135_get_temperature, 0 },
+	{ "max17135_get_temp_failure",   DEV_MAX17135,
+	  run_max17135_get_temp_failure, 0 },
+	{ "max17135_get_pok",            DEV_MAX17135,
+	  run_max17135_get_pok, 0 },
+	{ "max17135_get_en",             DEV_MAX17135,
+	  run_max17135_get_en, 0 },
+	{ "max17135_set_en",             DEV_MAX17135,
+	  run_max17135_set_en, 0 },
+	{ "max17135_get_fault",          DEV_MAX17135,
+	  run_max17135_get_fault, 0 },
+	{ "max17135_get_faults",         DEV_MAX17135,
+	  run_max17135_get_faults, 0 },
+	{ "tps65185_init",               DEV_TPS65185,
+	  run_tps65185_init, 0 },
+	{ "tps65185_get_vcom",           DEV_TPS65185,
+	  run_tps65185_get_vcom, 0 },
+	{ "tps65185_set_vcom",           DEV_TPS65185,
+	  run_tps65185_set_vcom, 0 },
+	{ "tps65185_get_seq",            DEV_TPS65185,
+	  run_tps65185_get_seq, 0 },
+	{ "tps65185_set_seq",            DEV_TPS65185,
+	  run_tps65185_set_seq, 0 },
+	{ "tps65185_get_en",             DEV_TPS65185,
+	  run_tps65185_get_en, 0 },
+	{ "tps65185_set_en",             DEV_TPS65185,
+	  run_tps65185_set_en, 0 },
+	{ "tps65185_set_power",          DEV_TPS65185,
+	  run_tps65185_set_power, 0, BENCH_WRITE },
+	{ "eeprom_init",                 DEV_EEPROM, run_eeprom_init, 0 },
+	{ "eeprom_read_1",               DEV_EEPROM, run_eeprom_read, 1 },
+	{ "eeprom_read_16",              DEV_EEPROM, run_eeprom_read, 16 },
+	{ "eeprom_read_64",              DEV_EEPROM, run_eeprom_read, 64 },
+	{ "eeprom_read_256",             DEV_EEPROM, run_eeprom_read, 256 },
+	{ "eeprom_read_1024",            DEV_EEPROM, run_eeprom_read, 1024 },
+	{ "eeprom_write_1",              DEV_EEPROM, run_eeprom_write, 1,
+	  BENCH_WRITE },
+	{ "eeprom_write_16",             DEV_EEPROM, run_eeprom_write, 16,
+	  BENCH_WRITE },
+	{ "eeprom_write_64",             DEV_EEPROM, run_eeprom_write, 64,
+	  BENCH_WRITE },
+	{ "eeprom_write_256",            DEV_EEPROM, run_eeprom_write, 256,
+	  BENCH_WRITE },
+	{ "eeprom_write_1024",           DEV_EEPROM, run_eeprom_write, 1024,
+	  BENCH_WRITE },
+	{ "dac5820_init",                DEV_DAC, run_dac5820_init, 0 },
+	{ "dac5820_set_power",           DEV_DAC, run_dac5820_set_power, 0,
+	  BENCH_WRITE },
+	{ "dac5820_output",              DEV_DAC, run_dac5820_output, 0,
+	  BENCH_WRITE },
+	{ "adc11607_init",               DEV_ADC, run_adc11607_init, 0 },
+	{ "adc11607_set_ref",            DEV_ADC, run_adc11607_set_ref, 0 },
+	{ "adc11607_select_channel_range", DEV_ADC,
+	  run_adc11607_select_channel_range, 0 },
+	{ "adc11607_read_results",       DEV_ADC,
+	  run_adc11607_read_results, 0 },
+	{ "pbtn_init",                   DEV_PBTN, run_pbtn_init, 0 },
+	{ "pbtn_probe",                  DEV_PBTN, run_pbtn_probe, 0 },
+	{ "plhw_board_init",             DEV_BOARD, run_plhw_board_init, 0 },
+	{ "plhw_board_hv_cycle",         DEV_BOARD,
+	  run_plhw_board_hv_cycle, 0, BENCH_HV },
+	{ NULL, DEV_NONE, NULL, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	struct bench_ctx ctx;
+	struct i2cdev *bus_stats;
+	const struct bench *b;
+	const char *filter = NULL;
+	unsigned loops = DEF_LOOPS;
+	int json = 0;
+	int first = 1;
+	int c;
+
+	memset(&ctx, 0, sizeof ctx);
+	ctx.bus = DEF_BUS;
+	ctx.eeprom_mode = DEF_EEPROM_MODE;
+	ctx.eeprom_addr = DEF_EEPROM_ADDR;
+
+	while ((c = getopt(argc, argv, "b:n:e:a:f:wtjh")) != -1) {
+		switch (c) {
+		case 'b':
+			ctx.bus = optarg;
+			break;
+		case 'n':
+			loops = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			ctx.eeprom_mode = optarg;
+			break;
+		case 'a':
+			ctx.eeprom_addr = strtol(optarg, NULL, 0);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'w':
+			ctx.allow_write = 1;
+			break;
+		case 't':
+			ctx.trace = 1;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			print_usage();
+			return 1;
+		}
+	}
+
+	if (!loops) {
+		fprintf(stderr, "invalid number of iterations\n");
+		return 1;
+	}
+
+	ctx.virtual_bus = !strncmp(ctx.bus, "sim:", 4)
+		|| !strncmp(ctx.bus, "replay:", 7);
+
+	/* only used to read the statistics of the whole bus */
+	bus_stats = i2cdev_init(ctx.bus, 0x00);
+
+	if (bus_stats == NULL) {
+		fprintf(stderr, "failed to open the I2C bus: %s\n", ctx.bus);
+		return 1;
+	}
+
+	if (bench_setup(&ctx)) {
+		fprintf(stderr, "no device found on %s\n", ctx.bus);
+		i2cdev_free(bus_stats);
+		return 1;
+	}
+
+	if (json)
+		printf("{\n  \"bus\": \"%s\",\n  \"iterations\": %u,\n"
+		       "  \"results\": [\n", ctx.bus, loops);
+	else
+		printf("name,status,calls,errors,ns_per_call,"
+		       "ioctls_per_call,transfers_per_call,bytes_per_call,"
+		       "retries\n");
+
+	for (b = benches; b->name != NULL; ++b) {
+		struct bench_result res;
+
+		if ((filter != NULL) && (strstr(b->name, filter) == NULL))
+			continue;
+
+		run_bench(&ctx, bus_stats, b, loops, &res);
+		print_result(b, &res, json, first);
+		first = 0;
+	}
+
+	if (json)
+		printf("\n  ]\n}\n");
+
+	if (ctx.trace)
+		print_trace();
+
+	bench_teardown(&ctx);
+	i2cdev_free(bus_stats);
+
+	return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * static functions
+ */
+
+static int bench_setup(struct bench_ctx *ctx)
+{
+	const char *bus = ctx->bus;
+	int found = 0;
+
+	ctx->cpld = cpld_init(bus, PLHW_NO_I2C_ADDR);
+
+	if (ctx->cpld != NULL) {
+		ctx->clamp = cpld_get_switch(ctx->cpld, CPLD_BPCOM_CLAMP);
+		++found;
+	}
+
+	ctx->max17135 = max17135_init(bus, PLHW_NO_I2C_ADDR);
+
+	if (ctx->max17135 != NULL) {
+		struct max17135 * const p = ctx->max17135;
+
+		if (max17135_get_vcom(p, &ctx->max_vcom)
+		    || (max17135_get_timings(p, ctx->max_timings,
+					     MAX17135_NB_TIMINGS) < 0)
+		    || ((ctx->max_temp_en = max17135_get_temp_sensor_en(p))
+			< 0)
+		    || ((ctx->max_en = max17135_get_en(p, MAX17135_EN_EN))
+			< 0)) {
+			max17135_free(p);
+			ctx->max17135 = NULL;
+		} else {
+			++found;
+		}
+	}
+
+	ctx->tps65185 = tps65185_init(bus, PLHW_NO_I2C_ADDR);
+
+	if (ctx->tps65185 != NULL) {
+		struct tps65185 * const p = ctx->tps65185;
+
+		if (tps65185_get_vcom(p, &ctx->tps_vcom)
+		    || tps65185_get_seq(p, &ctx->tps_seq, 1)
+		    || ((ctx->tps_vcom_en =
+			 tps65185_get_en(p, TPS65185_VCOM_EN)) < 0)) {
+			tps65185_free(p);
+			ctx->tps65185 = NULL;
+		} else {
+			++found;
+		}
+	}
+
+	ctx->eeprom = eeprom_init(bus, ctx->eeprom_addr, ctx->eeprom_mode);
+
+	if (ctx->eeprom != NULL) {
+		const size_t size = min(eeprom_get_size(ctx->eeprom),
+					EEPROM_MAX_BENCH_SIZE);
+
+		eeprom_seek(ctx->eeprom, 0);
+
+		if (eeprom_read(ctx->eeprom, ctx->eeprom_data, size) < 0) {
+			eeprom_free(ctx->eeprom);
+			ctx->eeprom = NULL;
+		} else {
+			++found;
+		}
+	}
+
+	ctx->dac = dac5820_init(bus, PLHW_NO_I2C_ADDR);
+	found += (ctx->dac != NULL) ? 1 : 0;
+	ctx->adc = adc11607_init(bus, PLHW_NO_I2C_ADDR);
+	found += (ctx->adc != NULL) ? 1 : 0;
+	ctx->pbtn = pbtn_init(bus, PLHW_NO_I2C_ADDR);
+	found += (ctx->pbtn != NULL) ? 1 : 0;
+
+	/* all the parts found above, brought up together */
+	ctx->board.i2c_bus = bus;
+	ctx->board.parts =
+		((ctx->cpld != NULL) ? PLHW_PART_CPLD : 0) |
+		((ctx->max17135 != NULL) ? PLHW_PART_MAX17135 : 0) |
+		((ctx->tps65185 != NULL) ? PLHW_PART_TPS65185 : 0) |
+		((ctx->dac != NULL) ? PLHW_PART_MAX5820 : 0) |
+		((ctx->adc != NULL) ? PLHW_PART_MAX11607 : 0) |
+		((ctx->pbtn != NULL) ? PLHW_PART_PBTN : 0) |
+		((ctx->eeprom != NULL) ? PLHW_PART_EEPROM : 0);
+	ctx->board.eeprom_mode = ctx->eeprom_mode;
+	ctx->board.eeprom_i2c_address = ctx->eeprom_addr;
+
+	if (ctx->trace)
+		bench_set_trace(ctx);
+
+	return found ? 0 : -1;
+}
+
+static void bench_teardown(struct bench_ctx *ctx)
+{
+	if (ctx->cpld != NULL)
+		cpld_free(ctx->cpld);
+
+	if (ctx->max17135 != NULL)
+		max17135_free(ctx->max17135);
+
+	if (ctx->tps65185 != NULL)
+		tps65185_free(ctx->tps65185);
+
+	if (ctx->eeprom != NULL)
+		eeprom_free(ctx->eeprom);
+
+	if (ctx->dac != NULL)
+		dac5820_free(ctx->dac);
+
+	if (ctx->adc != NULL)
+		adc11607_free(ctx->adc);
+
+	if (ctx->pbtn != NULL)
+		pbtn_free(ctx->pbtn);
+}
+
+static void *bench_get_dev(struct bench_ctx *ctx, enum bench_dev dev)
+{
+	switch (dev) {
+	case DEV_CPLD:     return ctx->cpld;
+	case DEV_MAX17135: return ctx->max17135;
+	case DEV_TPS65185: return ctx->tps65185;
+	case DEV_EEPROM:   return ctx->eeprom;
+	case DEV_DAC:      return ctx->dac;
+	case DEV_ADC:      return ctx->adc;
+	case DEV_PBTN:     return ctx->pbtn;
+	case DEV_BOARD:    return ctx->board.parts ? &ctx->board : NULL;
+	default:           return NULL;
+	}
+}
+
+static void run_bench(struct bench_ctx *ctx, struct i2cdev *bus_stats,
+		      const struct bench *b, unsigned loops,
+		      struct bench_result *res)
+{
+	struct i2cdev_stats st0;
+	struct timespec t0;
+	struct timespec t1;
+	unsigned i;
+
+	memset(res, 0, sizeof *res);
+
+	if (bench_get_dev(ctx, b->dev) == NULL)
+		return;
+
+	if ((b->flags & BENCH_WRITE) && !ctx->virtual_bus
+	    && !ctx->allow_write)
+		return;
+
+	if ((b->flags & BENCH_HV) && !ctx->virtual_bus)
+		return;
+
+	if ((b->dev == DEV_EEPROM)
+	    && (b->arg > eeprom_get_size(ctx->eeprom)))
+		return;
+
+	i2cdev_get_bus_stats(bus_stats, &st0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (i = 0; i < loops; ++i)
+		if (b->run(ctx, b->arg) < 0)
+			++res->errors;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	i2cdev_get_bus_stats(bus_stats, &res->stats);
+
+	res->calls = loops;
+	res->wall_ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL
+		+ t1.tv_nsec - t0.tv_nsec;
+	res->stats.transactions -= st0.transactions;
+	res->stats.ioctls -= st0.ioctls;
+	res->stats.retries -= st0.retries;
+	res->stats.bytes_read -= st0.bytes_read;
+	res->stats.bytes_written -= st0.bytes_written;
+}
+
+static void print_result(const struct bench *b,
+			 const struct bench_result *res, int json, int first)
+{
+	const char *status;
+	double calls;
+
+	if (!res->calls) {
+		if (json)
+			printf("%s    { \"name\": \"%s\", "
+			       "\"status\": \"skipped\" }",
+			       first ? "" : ",\n", b->name);
+		else
+			printf("%s,skipped,0,0,,,,,\n", b->name);
+
+		return;
+	}
+
+	status = res->errors ? "error" : "ok";
+	calls = res->calls;
+
+	if (json)
+		printf("%s    { \"name\": \"%s\", \"status\": \"%s\", "
+		       "\"calls\": %u, \"errors\": %u, "
+		       "\"ns_per_call\": %.0f, \"ioctls_per_call\": %.2f, "
+		       "\"transfers_per_call\": %.2f, "
+		       "\"bytes_per_call\": %.1f, \"retries\": %lu }",
+		       first ? "" : ",\n", b->name, status, res->calls,
+		       res->errors, res->wall_ns / calls,
+		       res->stats.ioctls / calls,
+		       res->stats.transactions / calls,
+		       (res->stats.bytes_read + res->stats.bytes_written)
+		       / calls, res->stats.retries);
+	else
+		printf("%s,%s,%u,%u,%.0f,%.2f,%.2f,%.1f,%lu\n",
+		       b->name, status, res->calls, res->errors,
+		       res->wall_ns / calls, res->stats.ioctls / calls,
+		       res->stats.transactions / calls,
+		       (res->stats.bytes_read + res->stats.bytes_written)
+		       / calls, res->stats.retries);
+}
+
+static void bench_set_trace(struct bench_ctx *ctx)
+{
+	struct i2cdev *devs[7];
+	size_t n = 0;
+	size_t i;
+
+	if (ctx->cpld != NULL)
+		devs[n++] = cpld_get_i2c(ctx->cpld);
+
+	if (ctx->max17135 != NULL)
+		devs[n++] = max17135_get_i2c(ctx->max17135);
+
+	if (ctx->tps65185 != NULL)
+		devs[n++] = tps65185_get_i2c(ctx->tps65185);
+
+	if (ctx->eeprom != NULL)
+		devs[n++] = eeprom_get_i2c(ctx->eeprom);
+
+	if (ctx->dac != NULL)
+		devs[n++] = dac5820_get_i2c(ctx->dac);
+
+	if (ctx->adc != NULL)
+		devs[n++] = adc11607_get_i2c(ctx->adc);
+
+	if (ctx->pbtn != NULL)
+		devs[n++] = pbtn_get_i2c(ctx->pbtn);
+
+	for (i = 0; i < n; ++i)
+		i2cdev_set_flag(devs[i], I2CDEV_TRACE, 1);
+}
+
+/* The trace ring only keeps the last I2CDEV_TRACE_SIZE records */
+static void print_trace(void)
+{
+	struct i2cdev_trace_rec recs[16];
+	unsigned long cursor = 0;
+	size_t n;
+
+	fflush(stdout);
+
+	while ((n = i2cdev_trace_read(&cursor, recs, 16))) {
+		char str[I2CDEV_TRACE_STR_SIZE];
+		size_t i;
+
+		for (i = 0; i < n; ++i) {
+			i2cdev_trace_format(&recs[i], str, sizeof str);
+			fprintf(stderr, "%s\n", str);
+		}
+	}
+}
+
+static void print_usage(void)
+{
+	printf(
+"Usage: plhw_bench [OPTIONS]\n"
+"\n"
+"Run each libplhw operation and print the average cost per call as CSV.\n"
+"Write operations only write back the initial values, except the ones\n"
+"which change the hardware state (DAC outputs, TPS65185 power mode and\n"
+"EEPROM writes): they only run on \"sim:\" or \"replay:\" buses, unless\n"
+"-w is given.  The HV on/off cycle only ever runs on these buses.\n"
+"\n"
+"Options:\n"
+"  -b BUS     I2C bus device, \"sim:...\" or \"replay:...\"\n"
+"             (default: %s)\n"
+"  -n LOOPS   number of calls per operation (default: %u)\n"
+"  -e MODE    EEPROM mode (default: %s)\n"
+"  -a ADDR    EEPROM I2C address (default: 0x%02X)\n"
+"  -f NAME    only run the operations with NAME in their name\n"
+"  -w         also run the operations which change the hardware state\n"
+"  -t         trace the accesses of the parts, printed on stderr at the end\n"
+"  -j         JSON output\n"
+"  -h         show this help message\n",
+		DEF_BUS, DEF_LOOPS, DEF_EEPROM_MODE, DEF_EEPROM_ADDR);
+}
+
+/* ---- CPLD ---- */
+
+static int run_cpld_init(struct bench_ctx *ctx, size_t arg)
+{
+	struct cpld *cpld = cpld_init(ctx->bus, PLHW_NO_I2C_ADDR);
+
+	if (cpld == NULL)
+		return -1;
+
+	cpld_free(cpld);
+
+	return 0;
+}
+
+static int run_cpld_get_version(struct bench_ctx *ctx, size_t arg)
+{
+	return cpld_get_version(ctx->cpld);
+}
+
+static int run_cpld_get_board_id(struct bench_ctx *ctx, size_t arg)
+{
+	return cpld_get_board_id(ctx->cpld);
+}
+
+static int run_cpld_dump(struct bench_ctx *ctx, size_t arg)
+{
+	char data[16];
+
+	return cpld_dump(ctx->cpld, data, sizeof data);
+}
+
+static int run_cpld_get_switch(struct bench_ctx *ctx, size_t arg)
+{
+	return cpld_get_switch(ctx->cpld, CPLD_BPCOM_CLAMP);
+}
+
+static int run_cpld_set_switch(struct bench_ctx *ctx, size_t arg)
+{
+	if (ctx->clamp < 0)
+		return -1;
+
+	return cpld_set_switch(ctx->cpld, CPLD_BPCOM_CLAMP, ctx->clamp);
+}
+
+/* ---- MAX17135 ---- */
+
+static int run_max17135_init(struct bench_ctx *ctx, size_t arg)
+{
+	struct max17135 *p = max17135_init(ctx->bus, PLHW_NO_I2C_ADDR);
+
+	if (p == NULL)
+		return -1;
+
+	max17135_free(p);
+
+	return 0;
+}
+
+static int run_max17135_get_prod_id(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_get_prod_id(ctx->max17135);
+}
+
+static int run_max17135_get_prod_rev(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_get_prod_rev(ctx->max17135);
+}
+
+static int run_max17135_get_vcom(struct bench_ctx *ctx, size_t arg)
+{
+	char vcom;
+
+	return max17135_get_vcom(ctx->max17135, &vcom);
+}
+
+static int run_max17135_set_vcom(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_set_vcom(ctx->max17135, ctx->max_vcom);
+}
+
+static int run_max17135_get_timing(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_get_timing(ctx->max17135, 0);
+}
+
+static int run_max17135_get_timings(struct bench_ctx *ctx, size_t arg)
+{
+	char timings[MAX17135_NB_TIMINGS];
+
+	return max17135_get_timings(ctx->max17135, timings, sizeof timings);
+}
+
+static int run_max17135_set_timing(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_set_timing(ctx->max17135, 0, ctx->max_timings[0]);
+}
+
+static int run_max17135_set_timings(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_set_timings(ctx->max17135, ctx->max_timings,
+				    MAX17135_NB_TIMINGS);
+}
+
+static int run_max17135_get_temp_sensor_en(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_get_temp_sensor_en(ctx->max17135);
+}
+
+static int run_max17135_set_temp_sensor_en(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_set_temp_sensor_en(ctx->max17135, ctx->max_temp_en);
+}
+
+static int run_max17135_get_temperature(struct bench_ctx *ctx, size_t arg)
+{
+	short temp;
+
+	return max17135_get_temperature(ctx->max17135, &temp,
+					MAX17135_TEMP_INT);
+}
+
+static int run_max17135_get_temp_failure(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_get_temp_failure(ctx->max17135);
+}
+
+static int run_max17135_get_pok(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_get_pok(ctx->max17135);
+}
+
+static int run_max17135_get_en(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_get_en(ctx->max17135, MAX17135_EN_EN);
+}
+
+static int run_max17135_set_en(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_set_en(ctx->max17135, MAX17135_EN_EN, ctx->max_en);
+}
+
+static int run_max17135_get_fault(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_get_fault(ctx->max17135);
+}
+
+static int run_max17135_get_faults(struct bench_ctx *ctx, size_t arg)
+{
+	return max17135_get_faults(ctx->max17135);
+}
+
+/* ---- TPS65185 ---- */
+
+static int run_tps65185_init(struct bench_ctx *ctx, size_t arg)
+{
+	struct tps65185 *p = tps65185_init(ctx->bus, PLHW_NO_I2C_ADDR);
+
+	if (p == NULL)
+		return -1;
+
+	tps65185_free(p);
+
+	return 0;
+}
+
+static int run_tps65185_get_vcom(struct bench_ctx *ctx, size_t arg)
+{
+	uint16_t vcom;
+
+	return tps65185_get_vcom(ctx->tps65185, &vcom);
+}
+
+static int run_tps65185_set_vcom(struct bench_ctx *ctx, size_t arg)
+{
+	return tps65185_set_vcom(ctx->tps65185, ctx->tps_vcom);
+}
+
+static int run_tps65185_get_seq(struct bench_ctx *ctx, size_t arg)
+{
+	struct tps65185_seq seq;
+
+	return tps65185_get_seq(ctx->tps65185, &seq, 1);
+}
+
+static int run_tps65185_set_seq(struct bench_ctx *ctx, size_t arg)
+{
+	return tps65185_set_seq(ctx->tps65185, &ctx->tps_seq, 1);
+}
+
+static int run_tps65185_get_en(struct bench_ctx *ctx, size_t arg)
+{
+	return tps65185_get_en(ctx->tps65185, TPS65185_VCOM_EN);
+}
+
+static int run_tps65185_set_en(struct bench_ctx *ctx, size_t arg)
+{
+	return tps65185_set_en(ctx->tps65185, TPS65185_VCOM_EN,
+			       ctx->tps_vcom_en);
+}
+
+static int run_tps65185_set_power(struct bench_ctx *ctx, size_t arg)
+{
+	return tps65185_set_power(ctx->tps65185, TPS65185_STANDBY);
+}
+
+/* ---- EEPROM ---- */
+
+static int run_eeprom_init(struct bench_ctx *ctx, size_t arg)
+{
+	struct eeprom *e = eeprom_init(ctx->bus, ctx->eeprom_addr,
+				       ctx->eeprom_mode);
+
+	if (e == NULL)
+		return -1;
+
+	eeprom_free(e);
+
+	return 0;
+}
+
+static int run_eeprom_read(struct bench_ctx *ctx, size_t arg)
+{
+	char data[EEPROM_MAX_BENCH_SIZE];
+
+	assert(arg <= sizeof data);
+
+	eeprom_seek(ctx->eeprom, 0);
+
+	return eeprom_read(ctx->eeprom, data, arg);
+}
+
+static int run_eeprom_write(struct bench_ctx *ctx, size_t arg)
+{
+	assert(arg <= sizeof ctx->eeprom_data);
+
+	eeprom_seek(ctx->eeprom, 0);
+
+	return eeprom_write(ctx->eeprom, ctx->eeprom_data, arg);
+}
+
+/* ---- DAC ---- */
+
+static int run_dac5820_init(struct bench_ctx *ctx, size_t arg)
+{
+	struct dac5820 *dac = dac5820_init(ctx->bus, PLHW_NO_I2C_ADDR);
+
+	if (dac == NULL)
+		return -1;
+
+	dac5820_free(dac);
+
+	return 0;
+}
+
+static int run_dac5820_set_power(struct bench_ctx *ctx, size_t arg)
+{
+	return dac5820_set_power(ctx->dac, DAC5820_CH_A,
+				 DAC5820_POW_OFF_FLOAT);
+}
+
+static int run_dac5820_output(struct bench_ctx *ctx, size_t arg)
+{
+	return dac5820_output(ctx->dac, DAC5820_CH_A, 0);
+}
+
+/* ---- ADC ---- */
+
+static int run_adc11607_init(struct bench_ctx *ctx, size_t arg)
+{
+	struct adc11607 *adc = adc11607_init(ctx->bus, PLHW_NO_I2C_ADDR);
+
+	if (adc == NULL)
+		return -1;
+
+	adc11607_free(adc);
+
+	return 0;
+}
+
+static int run_adc11607_set_ref(struct bench_ctx *ctx, size_t arg)
+{
+	return adc11607_set_ref(ctx->adc, adc11607_get_ref(ctx->adc));
+}
+
+static int run_adc11607_select_channel_range(struct bench_ctx *ctx,
+					     size_t arg)
+{
+	return adc11607_select_channel_range(
+		ctx->adc, adc11607_get_nb_channels(ctx->adc) - 1);
+}
+
+static int run_adc11607_read_results(struct bench_ctx *ctx, size_t arg)
+{
+	return adc11607_read_results(ctx->adc);
+}
+
+/* ---- Push buttons ---- */
+
+static int run_pbtn_init(struct bench_ctx *ctx, size_t arg)
+{
+	struct pbtn *pbtn = pbtn_init(ctx->bus, PLHW_NO_I2C_ADDR);
+
+	if (pbtn == NULL)
+		return -1;
+
+	pbtn_free(pbtn);
+
+	return 0;
+}
+
+static int run_pbtn_probe(struct bench_ctx *ctx, size_t arg)
+{
+	return pbtn_probe(ctx->pbtn, PBTN_ALL);
+}
+
+/* ---- Board ---- */
+
+static int run_plhw_board_init(struct bench_ctx *ctx, size_t arg)
+{
+	struct plhw_board *board = plhw_board_init(&ctx->board);
+
+	if (board == NULL)
+		return -1;
+
+	plhw_board_free(board);
+
+	return 0;
+}
+
+/* board init, then HV on and off with the VCOM DAC on channel A */
+static int run_plhw_board_hv_cycle(struct bench_ctx *ctx, size_t arg)
+{
+	static const unsigned hv_parts =
+		PLHW_PART_CPLD | PLHW_PART_MAX17135 | PLHW_PART_MAX5820;
+	struct plhw_board *board;
+	int ret;
+
+	if ((ctx->board.parts & hv_parts) != hv_parts)
+		return 0;
+
+	board = plhw_board_init(&ctx->board);
+
+	if (board == NULL)
+		return -1;
+
+	ret = plhw_board_hv_on(board, DAC5820_CH_A, 100, NULL);
+
+	if (!ret)
+		ret = plhw_board_hv_off(board, NULL);
+
+	plhw_board_free(board);
+
+	return ret;
+}
@@ -0,0 +1,672 @@
+/*
+  Plastic Logic hardware library - board
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "board.h"
+#include "i2cdev.h"
+#include "idcache.h"
+#include "plhw_config.h"
+#include "util.h"
+#include <libplhw.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_TAG "board"
+#include <plsdk/log.h>
+
+#define DEF_EEPROM_MODE "24c256"
+#define DEF_CPLD_I2C_ADDR 0x70
+
+/* Parts in initialisation order */
+static const enum plhw_part board_parts[] = {
+	PLHW_PART_CPLD,
+	PLHW_PART_MAX17135,
+	PLHW_PART_TPS65185,
+	PLHW_PART_MAX5820,
+	PLHW_PART_MAX11607,
+	PLHW_PART_PBTN,
+	PLHW_PART_EEPROM,
+};
+
+#define NB_BOARD_PARTS (sizeof board_parts / sizeof board_parts[0])
+
+/* The instance is at the start of the arena, followed by the parts */
+struct plhw_board {
+	unsigned parts;
+	struct cpld *cpld;
+	struct max17135 *max17135;
+	struct tps65185 *tps65185;
+	struct dac5820 *dac5820;
+	struct adc11607 *adc11607;
+	struct pbtn *pbtn;
+	struct eeprom *eeprom;
+};
+
+/* Parts needed for the HV sequence */
+#define HV_PARTS (PLHW_PART_CPLD | PLHW_PART_MAX17135 | PLHW_PART_MAX5820)
+
+struct board_cfg {
+	const char *i2c_bus;
+	const char *eeprom_mode;
+	char eeprom_i2c_address;
+	const char *id_cache;
+	int cpld_i2c_address;
+	int lazy;
+};
+
+static size_t part_size(enum plhw_part part);
+static void *part_init_at(struct plhw_board *board, enum plhw_part part,
+			  void *mem, const struct board_cfg *cfg);
+static int part_add_setup(struct plhw_board *board, enum plhw_part part,
+			  struct i2cdev_txn **t);
+static int part_setup(struct plhw_board *board, enum plhw_part part);
+static void part_free(struct plhw_board *board, enum plhw_part part);
+static struct plhw_board *board_create(const struct board_cfg *cfg,
+				       unsigned parts);
+static int board_setup(struct plhw_board *board);
+static int board_setup_cached(struct plhw_board *board,
+			      const struct plhw_board_info *info);
+static void board_store_ids(struct plhw_board *board,
+			    const struct board_cfg *cfg);
+static int hv_commit(struct plhw_board *board, struct i2cdev_txn *t, int ret);
+static uint64_t now_us(void);
+
+struct plhw_board *plhw_board_init(const struct plhw_board_desc *desc)
+{
+	struct plhw_board_info info;
+	struct plhw_config *config;
+	struct plhw_board *board;
+	struct board_cfg cfg;
+	unsigned parts;
+
+	config = plhw_config_get();
+
+	if (config == NULL)
+		return NULL;
+
+	cfg.i2c_bus = plhw_config_get_str(config, "i2c-bus", NULL);
+	cfg.eeprom_mode = plhw_config_get_str(config, "eeprom-mode",
+					      DEF_EEPROM_MODE);
+	cfg.eeprom_i2c_address = PLHW_EEPROM_DEF_I2C_ADDR;
+	cfg.id_cache = plhw_config_get_str(config, "id-cache", NULL);
+	cfg.cpld_i2c_address = plhw_config_get_i2c_addr(
+		config, "CPLD-address", DEF_CPLD_I2C_ADDR);
+	cfg.lazy = plhw_config_get_int(config, "lazy-init", 0);
+	parts = 0;
+
+	if (desc != NULL) {
+		if (desc->i2c_bus != NULL)
+			cfg.i2c_bus = desc->i2c_bus;
+
+		if (desc->eeprom_mode != NULL)
+			cfg.eeprom_mode = desc->eeprom_mode;
+
+		if ((unsigned char) desc->eeprom_i2c_address
+		    != PLHW_NO_I2C_ADDR)
+			cfg.eeprom_i2c_address = desc->eeprom_i2c_address;
+
+		parts = desc->parts;
+	}
+
+	if (cfg.i2c_bus == NULL) {
+		LOG("no I2C bus specified");
+		goto err_put_config;
+	}
+
+	board = NULL;
+
+	/* warm start: the cached parts are created and only the CPLD is read
+	 * to check they are still the same, with lazy-init on its first use */
+	if ((cfg.id_cache != NULL) &&
+	    !idcache_load(cfg.id_cache, cfg.i2c_bus, cfg.cpld_i2c_address,
+			  &info) &&
+	    !(parts & ~info.parts) &&
+	    ((parts ? parts : info.parts) & PLHW_PART_CPLD)) {
+		board = board_create(&cfg, (parts ? parts : info.parts));
+
+		if ((board != NULL) && cfg.lazy) {
+			cpld_expect_ids(board->cpld, info.cpld_version,
+					info.cpld_board_id);
+		} else if ((board != NULL) &&
+			   board_setup_cached(board, &info)) {
+			LOG("identity cache out of date");
+			plhw_board_free(board);
+			board = NULL;
+		}
+	}
+
+	if (board == NULL) {
+		if (!parts) {
+			if (plhw_discover_bus(cfg.i2c_bus, &info)) {
+				LOG("no parts found on %s", cfg.i2c_bus);
+				goto err_put_config;
+			}
+
+			parts = info.parts;
+		}
+
+		board = board_create(&cfg, parts);
+
+		if (board == NULL)
+			goto err_put_config;
+
+		/* with lazy-init, each part gets set up on first use instead */
+		if (!cfg.lazy) {
+			if (board_setup(board))
+				goto err_free_board;
+
+			if (cfg.id_cache != NULL)
+				board_store_ids(board, &cfg);
+		}
+	}
+
+	plhw_config_put(config);
+
+	return board;
+
+err_free_board:
+	plhw_board_free(board);
+err_put_config:
+	plhw_config_put(config);
+
+	return NULL;
+}
+
+void plhw_board_free(struct plhw_board *board)
+{
+	size_t i;
+
+	assert(board != NULL);
+
+	for (i = 0; i < NB_BOARD_PARTS; ++i)
+		if (board->parts & board_parts[i])
+			part_free(board, board_parts[i]);
+
+	free(board);
+}
+
+unsigned plhw_board_get_parts(const struct plhw_board *board)
+{
+	assert(board != NULL);
+
+	return board->parts;
+}
+
+struct cpld *plhw_board_get_cpld(struct plhw_board *board)
+{
+	assert(board != NULL);
+
+	return board->cpld;
+}
+
+struct max17135 *plhw_board_get_max17135(struct plhw_board *board)
+{
+	assert(board != NULL);
+
+	return board->max17135;
+}
+
+struct tps65185 *plhw_board_get_tps65185(struct plhw_board *board)
+{
+	assert(board != NULL);
+
+	return board->tps65185;
+}
+
+struct dac5820 *plhw_board_get_dac5820(struct plhw_board *board)
+{
+	assert(board != NULL);
+
+	return board->dac5820;
+}
+
+struct adc11607 *plhw_board_get_adc11607(struct plhw_board *board)
+{
+	assert(board != NULL);
+
+	return board->adc11607;
+}
+
+struct pbtn *plhw_board_get_pbtn(struct plhw_board *board)
+{
+	assert(board != NULL);
+
+	return board->pbtn;
+}
+
+struct eeprom *plhw_board_get_eeprom(struct plhw_board *board)
+{
+	assert(board != NULL);
+
+	return board->eeprom;
+}
+
+int plhw_board_hv_on(struct plhw_board *board,
+		     enum dac5820_channel_id vcom_channel, char vcom,
+		     struct plhw_hv_stats *stats)
+{
+	struct plhw_hv_stats local_stats;
+	struct i2cdev *pmic_i2c;
+	struct i2cdev_txn *t = NULL;
+	struct timespec t_en;
+	int ret;
+
+	assert(board != NULL);
+
+	if ((board->parts & HV_PARTS) != HV_PARTS) {
+		LOG("missing parts for the HV sequence");
+		return -1;
+	}
+
+	if (stats == NULL)
+		stats = &local_stats;
+
+	memset(stats, 0, sizeof *stats);
+	stats->stage_us[PLHW_HV_START] = now_us();
+
+	/* HVEN and the PMIC enable are sent with one transfer */
+	ret = cpld_add_switch(board->cpld, &t, CPLD_HVEN, 1);
+
+	if (!ret)
+		ret = max17135_add_en(board->max17135, &t, MAX17135_EN_EN, 1);
+
+	if (hv_commit(board, t, ret))
+		goto err_hv_off;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_en);
+	stats->stage_us[PLHW_HV_ENABLE] = now_us();
+
+	/* The temperature is read while the rails ramp up, it only selects
+	 * the POK history band and is optional.  The POK wait is measured
+	 * from the enable write.  */
+	pmic_i2c = max17135_get_i2c(board->max17135);
+	i2cdev_lock_prio(pmic_i2c, I2CDEV_PRIO_HV);
+
+	if (!max17135_get_temperature(board->max17135, &stats->temperature,
+				      MAX17135_TEMP_EXT))
+		stats->temp_valid = 1;
+
+	i2cdev_unlock(pmic_i2c);
+	stats->stage_us[PLHW_HV_TEMP] = now_us();
+
+	if (max17135_wait_for_pok_from(board->max17135, &t_en))
+		goto err_hv_off;
+
+	stats->stage_us[PLHW_HV_POK] = now_us();
+
+	/* VCOM value then the VCOM switches */
+	t = NULL;
+	ret = dac5820_add_output(board->dac5820, &t, vcom_channel, vcom);
+
+	if (!ret)
+		ret = cpld_add_switch(board->cpld, &t, CPLD_COM_PSU, 1);
+
+	if (!ret)
+		ret = cpld_add_switch(board->cpld, &t, CPLD_COM_SW_EN, 1);
+
+	if (!ret)
+		ret = cpld_add_switch(board->cpld, &t, CPLD_COM_SW_CLOSE, 1);
+
+	if (hv_commit(board, t, ret))
+		goto err_hv_off;
+
+	stats->stage_us[PLHW_HV_VCOM] = now_us();
+
+	return 0;
+
+err_hv_off:
+	/* the enable transfer may have been partly done */
+	plhw_board_hv_off(board, NULL);
+
+	return -1;
+}
+
+int plhw_board_hv_off(struct plhw_board *board, struct plhw_hv_stats *stats)
+{
+	struct plhw_hv_stats local_stats;
+	struct i2cdev_txn *t = NULL;
+	int ret;
+
+	assert(board != NULL);
+
+	if ((board->parts & HV_PARTS) != HV_PARTS) {
+		LOG("missing parts for the HV sequence");
+		return -1;
+	}
+
+	if (stats == NULL)
+		stats = &local_stats;
+
+	memset(stats, 0, sizeof *stats);
+	stats->stage_us[PLHW_HV_START] = now_us();
+
+	/* the reverse sequence, all with one transfer */
+	ret = cpld_add_switch(board->cpld, &t, CPLD_COM_SW_CLOSE, 0);
+
+	if (!ret)
+		ret = cpld_add_switch(board->cpld, &t, CPLD_COM_SW_EN, 0);
+
+	if (!ret)
+		ret = cpld_add_switch(board->cpld, &t, CPLD_COM_PSU, 0);
+
+	if (!ret)
+		ret = max17135_add_en(board->max17135, &t, MAX17135_EN_EN, 0);
+
+	if (!ret)
+		ret = cpld_add_switch(board->cpld, &t, CPLD_HVEN, 0);
+
+	if (hv_commit(board, t, ret))
+		return -1;
+
+	stats->stage_us[PLHW_HV_ENABLE] = now_us();
+
+	return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * static functions
+ */
+
+static size_t part_size(enum plhw_part part)
+{
+	switch (part) {
+	case PLHW_PART_CPLD:     return cpld_size();
+	case PLHW_PART_MAX17135: return max17135_size();
+	case PLHW_PART_TPS65185: return tps65185_size();
+	case PLHW_PART_MAX5820:  return dac5820_size();
+	case PLHW_PART_MAX11607: return adc11607_size();
+	case PLHW_PART_PBTN:     return pbtn_size();
+	case PLHW_PART_EEPROM:   return eeprom_size();
+	default: assert(!"Invalid part"); return 0;
+	}
+}
+
+static void *part_init_at(struct plhw_board *board, enum plhw_part part,
+			  void *mem, const struct board_cfg *cfg)
+{
+	const char *bus = cfg->i2c_bus;
+
+	switch (part) {
+	case PLHW_PART_CPLD:
+		return board->cpld = cpld_init_at(mem, bus, PLHW_NO_I2C_ADDR);
+	case PLHW_PART_MAX17135:
+		return board->max17135 =
+			max17135_init_at(mem, bus, PLHW_NO_I2C_ADDR);
+	case PLHW_PART_TPS65185:
+		return board->tps65185 =
+			tps65185_init_at(mem, bus, PLHW_NO_I2C_ADDR);
+	case PLHW_PART_MAX5820:
+		return board->dac5820 =
+			dac5820_init_at(mem, bus, PLHW_NO_I2C_ADDR);
+	case PLHW_PART_MAX11607:
+		return board->adc11607 =
+			adc11607_init_at(mem, bus, PLHW_NO_I2C_ADDR);
+	case PLHW_PART_PBTN:
+		return board->pbtn = pbtn_init_at(mem, bus, PLHW_NO_I2C_ADDR);
+	case PLHW_PART_EEPROM:
+		return board->eeprom =
+			eeprom_init_at(mem, bus, cfg->eeprom_i2c_address,
+				       cfg->eeprom_mode);
+	default:
+		assert(!"Invalid part");
+		return NULL;
+	}
+}
+
+static int part_add_setup(struct plhw_board *board, enum plhw_part part,
+			  struct i2cdev_txn **t)
+{
+	switch (part) {
+	case PLHW_PART_CPLD:
+		return cpld_add_setup(board->cpld, t);
+	case PLHW_PART_MAX17135:
+		return max17135_add_setup(board->max17135, t);
+	case PLHW_PART_TPS65185:
+		return tps65185_add_setup(board->tps65185, t);
+	case PLHW_PART_MAX11607:
+		return adc11607_add_setup(board->adc11607, t);
+	case PLHW_PART_PBTN:
+		return pbtn_add_setup(board->pbtn, t);
+	case PLHW_PART_EEPROM:
+		return eeprom_add_setup(board->eeprom, t);
+	default:
+		return 0;
+	}
+}
+
+static int part_setup(struct plhw_board *board, enum plhw_part part)
+{
+	switch (part) {
+	case PLHW_PART_CPLD:     return cpld_setup(board->cpld);
+	case PLHW_PART_MAX17135: return max17135_setup(board->max17135);
+	case PLHW_PART_TPS65185: return tps65185_setup(board->tps65185);
+	case PLHW_PART_MAX11607: return adc11607_setup(board->adc11607);
+	case PLHW_PART_PBTN:     return pbtn_setup(board->pbtn);
+	case PLHW_PART_EEPROM:   return eeprom_setup(board->eeprom);
+	default:                 return 0;
+	}
+}
+
+static void part_free(struct plhw_board *board, enum plhw_part part)
+{
+	switch (part) {
+	case PLHW_PART_CPLD:     cpld_free(board->cpld);         break;
+	case PLHW_PART_MAX17135: max17135_free(board->max17135); break;
+	case PLHW_PART_TPS65185: tps65185_free(board->tps65185); break;
+	case PLHW_PART_MAX5820:  dac5820_free(board->dac5820);   break;
+	case PLHW_PART_MAX11607: adc11607_free(board->adc11607); break;
+	case PLHW_PART_PBTN:     pbtn_free(board->pbtn);         break;
+	case PLHW_PART_EEPROM:   eeprom_free(board->eeprom);     break;
+	default: assert(!"Invalid part"); break;
+	}
+}
+
+static struct plhw_board *board_create(const struct board_cfg *cfg,
+				       unsigned parts)
+{
+	struct plhw_board *board;
+	size_t size;
+	char *mem;
+	size_t i;
+
+	size = PLHW_ALIGN(sizeof (struct plhw_board));
+
+	for (i = 0; i < NB_BOARD_PARTS; ++i)
+		if (parts & board_parts[i])
+			size += part_size(board_parts[i]);
+
+	board = malloc(size);
+
+	if (board == NULL)
+		return NULL;
+
+	memset(board, 0, sizeof (struct plhw_board));
+	mem = (char *) board + PLHW_ALIGN(sizeof (struct plhw_board));
+
+	for (i = 0; i < NB_BOARD_PARTS; ++i) {
+		const enum plhw_part part = board_parts[i];
+
+		if (!(parts & part))
+			continue;
+
+		if (part_init_at(board, part, mem, cfg) == NULL) {
+			LOG("failed to initialise part 0x%02X", part);
+			plhw_board_free(board);
+			return NULL;
+		}
+
+		board->parts |= part;
+		mem += part_size(part);
+	}
+
+	return board;
+}
+
+/* All the parts are set up with a single transaction.  If it fails, each
+ * part is set up again on its own to find out which one is faulty.  */
+static int board_setup(struct plhw_board *board)
+{
+	struct i2cdev_txn *t = NULL;
+	size_t i;
+	int ret;
+
+	for (i = 0, ret = 0; (i < NB_BOARD_PARTS) && !ret; ++i)
+		if (board->parts & board_parts[i])
+			ret = part_add_setup(board, board_parts[i], &t);
+
+	if (!ret && (t != NULL))
+		ret = i2cdev_txn_commit(t);
+
+	if (t != NULL)
+		i2cdev_txn_free(t);
+
+	if (!ret)
+		return 0;
+
+	LOG("batched set-up failed, setting up each part");
+
+	for (i = 0; i < NB_BOARD_PARTS; ++i) {
+		const enum plhw_part part = board_parts[i];
+
+		if (!(board->parts & part))
+			continue;
+
+		if (part_setup(board, part)) {
+			LOG("failed to set up part 0x%02X", part);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Same as board_setup but with the PMIC identification values taken from
+ * the cache, valid only if the CPLD version and board ID still match.  */
+static int board_setup_cached(struct plhw_board *board,
+			      const struct plhw_board_info *info)
+{
+	struct i2cdev_txn *t = NULL;
+	size_t i;
+	int ret;
+
+	for (i = 0, ret = 0; (i < NB_BOARD_PARTS) && !ret; ++i) {
+		const enum plhw_part part = board_parts[i];
+
+		if (!(board->parts & part))
+			continue;
+
+		switch (part) {
+		case PLHW_PART_MAX17135:
+			max17135_set_ids(board->max17135,
+					 info->max17135_prod_id,
+					 info->max17135_prod_rev);
+			break;
+		case PLHW_PART_TPS65185:
+			tps65185_set_rev_id(board->tps65185,
+					    info->tps65185_rev_id);
+			break;
+		default:
+			ret = part_add_setup(board, part, &t);
+			break;
+		}
+	}
+
+	if (!ret && (t != NULL))
+		ret = i2cdev_txn_commit(t);
+
+	if (t != NULL)
+		i2cdev_txn_free(t);
+
+	if (ret)
+		return -1;
+
+	if ((cpld_get_version(board->cpld) != info->cpld_version) ||
+	    (cpld_get_board_id(board->cpld) != info->cpld_board_id))
+		return -1;
+
+	return 0;
+}
+
+static void board_store_ids(struct plhw_board *board,
+			    const struct board_cfg *cfg)
+{
+	struct plhw_board_info info;
+
+	/* entries can only be validated with the CPLD */
+	if (!(board->parts & PLHW_PART_CPLD) ||
+	    (strlen(cfg->i2c_bus) >= sizeof info.i2c_bus))
+		return;
+
+	memset(&info, 0, sizeof info);
+	strncpy(info.i2c_bus, cfg->i2c_bus, (sizeof info.i2c_bus - 1));
+	info.parts = board->parts;
+	info.cpld_version = cpld_get_version(board->cpld);
+	info.cpld_board_id = cpld_get_board_id(board->cpld);
+	info.max17135_prod_id = -1;
+	info.max17135_prod_rev = -1;
+	info.tps65185_rev_id = -1;
+
+	if (board->max17135 != NULL) {
+		struct max17135 * const p = board->max17135;
+
+		info.max17135_prod_id = max17135_get_prod_id(p);
+		info.max17135_prod_rev = max17135_get_prod_rev(p);
+	}
+
+	if (board->tps65185 != NULL)
+		info.tps65185_rev_id = tps65185_get_rev_id(board->tps65185);
+
+	idcache_store(cfg->id_cache, cfg->cpld_i2c_address, &info);
+}
+
+/* Commit an HV transaction with the HV bus priority.  The cached CPLD and
+ * PMIC states have already been updated, so they are read again if the
+ * transaction couldn't be prepared or failed.  */
+static int hv_commit(struct plhw_board *board, struct i2cdev_txn *t, int ret)
+{
+	if (t == NULL)
+		return ret;
+
+	if (!ret) {
+		i2cdev_txn_set_prio(t, I2CDEV_PRIO_HV);
+		ret = i2cdev_txn_commit(t);
+	}
+
+	i2cdev_txn_free(t);
+
+	if (!ret)
+		return 0;
+
+	LOG("HV sequence failed");
+	cpld_setup(board->cpld);
+	max17135_invalidate(board->max17135);
+
+	return -1;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (t.tv_sec * 1000000ULL) + (t.tv_nsec / 1000);
+}
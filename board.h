@@ -0,0 +1,111 @@
+/*
+  Plastic Logic hardware library - board
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INCLUDE_BOARD_H
+#define INCLUDE_BOARD_H 1
+
+#include <libplhw.h>
+
+struct i2cdev_txn;
+struct gpioex;
+struct timespec;
+
+/* In-place construction of the parts, used by plhw_board and by the
+ * regular _init functions.  Each part is built in <part>_size bytes of
+ * memory owned by the caller, which also holds its i2cdev and regmap
+ * instances, without any bus access.  <part>_add_setup then queues the
+ * identification reads and initial writes to a transaction, started with
+ * the part's I2C device if *t is NULL, and <part>_setup does the same
+ * synchronously.  The regular _free functions only release the resources
+ * of a part initialised in place, not its memory.  The _set_ functions
+ * restore identification values from the identity cache instead of
+ * reading them, which also marks the part as set up.  The _add_ functions
+ * queue the same writes as the regular ones, with the cached state updated
+ * right away: if the transaction fails, cpld_setup and max17135_invalidate
+ * get it back in sync with the hardware.  cpld_expect_ids makes cpld_setup
+ * fail if the version or board ID read are not the cached ones (-1 for any
+ * value), to check the identity cache on first use with lazy-init.
+ * max17135_wait_for_pok_from measures the POK rise time and its initial
+ * delay from t0, the time of the enable write, so the bus can be used in
+ * between.  */
+
+extern size_t cpld_size(void);
+extern struct cpld *cpld_init_at(void *mem, const char *i2c_bus,
+				 char i2c_address);
+extern int cpld_add_setup(struct cpld *cpld, struct i2cdev_txn **t);
+extern int cpld_setup(struct cpld *cpld);
+extern void cpld_expect_ids(struct cpld *cpld, int version, int board_id);
+extern int cpld_add_switch(struct cpld *cpld, struct i2cdev_txn **t,
+			   enum cpld_switch sw, int on);
+
+extern size_t max17135_size(void);
+extern struct max17135 *max17135_init_at(void *mem, const char *i2c_bus,
+					 char i2c_address);
+extern int max17135_add_setup(struct max17135 *p, struct i2cdev_txn **t);
+extern int max17135_setup(struct max17135 *p);
+extern void max17135_set_ids(struct max17135 *p, int prod_id, int prod_rev);
+extern int max17135_add_en(struct max17135 *p, struct i2cdev_txn **t,
+			   enum max17135_en_id id, int on);
+extern void max17135_invalidate(struct max17135 *p);
+extern int max17135_wait_for_pok_from(struct max17135 *p,
+				      const struct timespec *t0);
+
+extern size_t tps65185_size(void);
+extern struct tps65185 *tps65185_init_at(void *mem, const char *i2c_bus,
+					 char i2c_address);
+extern int tps65185_add_setup(struct tps65185 *p, struct i2cdev_txn **t);
+extern int tps65185_setup(struct tps65185 *p);
+extern int tps65185_get_rev_id(const struct tps65185 *p);
+extern void tps65185_set_rev_id(struct tps65185 *p, int rev_id);
+
+/* no initial bus access */
+extern size_t dac5820_size(void);
+extern struct dac5820 *dac5820_init_at(void *mem, const char *i2c_bus,
+				       int i2c_address);
+extern int dac5820_add_output(struct dac5820 *dac, struct i2cdev_txn **t,
+			      enum dac5820_channel_id channel, char value);
+
+extern size_t adc11607_size(void);
+extern struct adc11607 *adc11607_init_at(void *mem, const char *i2c_bus,
+					 int i2c_address);
+extern int adc11607_add_setup(struct adc11607 *adc, struct i2cdev_txn **t);
+extern int adc11607_setup(struct adc11607 *adc);
+
+extern size_t eeprom_size(void);
+extern struct eeprom *eeprom_init_at(void *mem, const char *i2c_bus,
+				     char i2c_address, const char *mode);
+extern int eeprom_add_setup(struct eeprom *e, struct i2cdev_txn **t);
+extern int eeprom_setup(struct eeprom *e);
+
+extern size_t gpioex_size(void);
+extern struct gpioex *gpioex_init_at(void *mem, const char *i2c_bus,
+				     int i2c_address, char i_mask,
+				     char o_mask);
+extern int gpioex_add_setup(struct gpioex *g, struct i2cdev_txn **t);
+extern int gpioex_setup(struct gpioex *g);
+
+extern size_t pbtn_size(void);
+extern struct pbtn *pbtn_init_at(void *mem, const char *i2c_bus,
+				 int i2c_address);
+extern int pbtn_add_setup(struct pbtn *b, struct i2cdev_txn **t);
+extern int pbtn_setup(struct pbtn *b);
+
+#endif /* INCLUDE_BOARD_H */
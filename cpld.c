@@ -20,9 +20,11 @@
 */
 
 #include "cpld.h"
+#include "board.h"
 #include "i2cdev.h"
+#include "plhw_config.h"
+#include "util.h"
 #include <libplhw.h>
-#include <plsdk/plconfig.h>
 #include <assert.h>
 #include <unistd.h>
 
@@ -33,7 +35,11 @@
 
 struct cpld {
 	struct i2cdev *i2c;
-	struct plconfig *config;
+	struct plhw_config *config;
+	int in_place;
+	int ready;
+	int expect_version;
+	int expect_board_id;
 	union {
 		struct {
 			struct cpld_byte_0 b0;
@@ -75,7 +81,10 @@ static const struct cpld_supported_switches CPLD_SUPPORTED_SWITCHES[] = {
 static const size_t CPLD_SWITCHES_TABLE_LEN =
 	ARRAY_SIZE(CPLD_SUPPORTED_SWITCHES, struct cpld_supported_switches);
 
+static int check_ready(const struct cpld *cpld);
+static int setup_cb(void *ctx);
 static int is_switch_supported(struct cpld *cpld, enum cpld_switch sw);
+static void set_switch_bit(struct cpld *cpld, enum cpld_switch sw, int on);
 static int read_i2c_data(struct cpld *cpld);
 static int write_i2c_data(struct cpld *cpld);
 
@@ -83,42 +92,114 @@ struct cpld *cpld_init(const char *i2c_bus, char i2c_address)
 {
 	struct cpld *cpld;
 
-	cpld = malloc(sizeof (struct cpld));
+	cpld = malloc(cpld_size());
 
 	if (cpld == NULL)
 		return cpld;
 
-	cpld->config = plconfig_init(NULL, "libplhw");
+	if (cpld_init_at(cpld, i2c_bus, i2c_address) == NULL)
+		goto err_free_cpld;
+
+	cpld->in_place = 0;
+
+	if (!plhw_config_get_int(cpld->config, "lazy-init", 0)
+	    && cpld_setup(cpld)) {
+		cpld_free(cpld);
+		return NULL;
+	}
+
+	return cpld;
+
+err_free_cpld:
+	free(cpld);
+
+	return NULL;
+}
+
+size_t cpld_size(void)
+{
+	return PLHW_ALIGN(sizeof (struct cpld)) + i2cdev_size();
+}
+
+struct cpld *cpld_init_at(void *mem, const char *i2c_bus, char i2c_address)
+{
+	struct cpld *cpld = mem;
+	char *i2c_mem = (char *) mem + PLHW_ALIGN(sizeof (struct cpld));
+
+	assert(mem != NULL);
+
+	cpld->in_place = 1;
+	lazy_set_ready(&cpld->ready, 0);
+	cpld->expect_version = -1;
+	cpld->expect_board_id = -1;
+	cpld->config = plhw_config_get();
 
 	if (cpld->config == NULL)
-		goto err_free_cpld;
+		return NULL;
 
-	if (i2c_address == PLHW_NO_I2C_ADDR)
-		i2c_address = plconfig_get_i2c_addr(
+	if ((unsigned char) i2c_address == PLHW_NO_I2C_ADDR)
+		i2c_address = plhw_config_get_i2c_addr(
 			cpld->config, "CPLD-address", 0x70);
 
-	cpld->i2c = i2cdev_init(i2c_bus, i2c_address);
+	cpld->i2c = i2cdev_init_at(i2c_mem, i2c_bus, i2c_address);
 
 	if (cpld->i2c == NULL) {
 		LOG("failed to initialise I2C");
-		goto err_free_plconfig;
+		plhw_config_put(cpld->config);
+		return NULL;
 	}
 
+	return cpld;
+}
+
+int cpld_add_setup(struct cpld *cpld, struct i2cdev_txn **t)
+{
+	assert(cpld != NULL);
+	assert(t != NULL);
+
+	if ((*t == NULL) && ((*t = i2cdev_txn_begin(cpld->i2c)) == NULL))
+		return -1;
+
+	if (i2cdev_txn_add_read(*t, cpld->i2c, cpld->data, CPLD_NB_BYTES) < 0)
+		return -1;
+
+	lazy_set_ready(&cpld->ready, 1);
+
+	return 0;
+}
+
+int cpld_setup(struct cpld *cpld)
+{
+	assert(cpld != NULL);
+
 	if (read_i2c_data(cpld) < 0) {
 		LOG("failed to read the I2C data");
-		goto err_free_i2cdev;
+		lazy_set_ready(&cpld->ready, 0);
+		return -1;
 	}
 
-	return cpld;
+	if (((cpld->expect_version >= 0)
+	     && (cpld->b0.version != cpld->expect_version))
+	    || ((cpld->expect_board_id >= 0)
+		&& (cpld->b2.board_id != cpld->expect_board_id))) {
+		LOG("version or board ID changed (%d/%d, expected %d/%d)",
+		    cpld->b0.version, cpld->b2.board_id,
+		    cpld->expect_version, cpld->expect_board_id);
+		lazy_set_ready(&cpld->ready, 0);
+		return -1;
+	}
 
-err_free_i2cdev:
-	i2cdev_free(cpld->i2c);
-err_free_plconfig:
-	plconfig_free(cpld->config);
-err_free_cpld:
-	free(cpld);
+	lazy_set_ready(&cpld->ready, 1);
 
-	return NULL;
+	return 0;
+}
+
+void cpld_expect_ids(struct cpld *cpld, int version, int board_id)
+{
+	assert(cpld != NULL);
+
+	cpld->expect_version = version;
+	cpld->expect_board_id = board_id;
 }
 
 void cpld_free(struct cpld *cpld)
@@ -126,14 +207,26 @@ void cpld_free(struct cpld *cpld)
 	assert(cpld != NULL);
 
 	i2cdev_free(cpld->i2c);
-	plconfig_free(cpld->config);
-	free(cpld);
+	plhw_config_put(cpld->config);
+
+	if (!cpld->in_place)
+		free(cpld);
+}
+
+struct i2cdev *cpld_get_i2c(struct cpld *cpld)
+{
+	assert(cpld != NULL);
+
+	return cpld->i2c;
 }
 
 int cpld_get_version(const struct cpld *cpld)
 {
 	assert(cpld != NULL);
 
+	if (check_ready(cpld))
+		return -1;
+
 	return cpld->b0.version;
 }
 
@@ -141,6 +234,9 @@ int cpld_get_board_id(const struct cpld *cpld)
 {
 	assert(cpld != NULL);
 
+	if (check_ready(cpld))
+		return -1;
+
 	return cpld->b2.board_id;
 }
 
@@ -160,6 +256,9 @@ int cpld_dump(const struct cpld *cpld, char *data, size_t size)
 	assert(cpld != NULL);
 	assert(data != NULL);
 
+	if (check_ready(cpld))
+		return -1;
+
 	for (i = 0, in = cpld->data, out = data;
 	     (i < size) && (i < CPLD_NB_BYTES);
 	     ++i, ++in, ++out) {
@@ -171,29 +270,42 @@ int cpld_dump(const struct cpld *cpld, char *data, size_t size)
 
 int cpld_set_switch(struct cpld *cpld, enum cpld_switch sw, int on)
 {
-	struct cpld_byte_0 *b0;
-	struct cpld_byte_1 *b1;
+	int ret;
 
 	assert(cpld != NULL);
 
-	if (!is_switch_supported(cpld, sw))
+	if (check_ready(cpld) || !is_switch_supported(cpld, sw))
 		return -1;
 
-	b0 = &cpld->b0;
-	b1 = &cpld->b1;
+	i2cdev_lock_prio(cpld->i2c, I2CDEV_PRIO_HV);
+	set_switch_bit(cpld, sw, on);
+	ret = write_i2c_data(cpld);
+	i2cdev_unlock(cpld->i2c);
 
-	switch (sw) {
-	case CPLD_HVEN:             b0->cpld_hven        = on ? 1 : 0;  break;
-	case CPLD_COM_SW_EN:        b1->vcom_sw_en       = on ? 1 : 0;  break;
-	case CPLD_COM_SW_CLOSE:     b1->vcom_sw_close    = on ? 1 : 0;  break;
-	case CPLD_COM_PSU:          b1->vcom_psu_en      = on ? 1 : 0;  break;
-	case CPLD_BPCOM_CLAMP:      b0->bpcom_clamp      = on ? 1 : 0;  break;
-	default:
-		assert(!"invalid switch identifier");
-		break;
-	}
+	return ret;
+}
+
+int cpld_add_switch(struct cpld *cpld, struct i2cdev_txn **t,
+		    enum cpld_switch sw, int on)
+{
+	int ret;
 
-	return write_i2c_data(cpld);
+	assert(cpld != NULL);
+	assert(t != NULL);
+
+	if (check_ready(cpld) || !is_switch_supported(cpld, sw))
+		return -1;
+
+	if ((*t == NULL) && ((*t = i2cdev_txn_begin(cpld->i2c)) == NULL))
+		return -1;
+
+	/* the data is copied, so each write has the switches set so far */
+	i2cdev_lock(cpld->i2c);
+	set_switch_bit(cpld, sw, on);
+	ret = i2cdev_txn_add_write(*t, cpld->i2c, cpld->data, CPLD_NB_BYTES);
+	i2cdev_unlock(cpld->i2c);
+
+	return (ret < 0) ? -1 : 0;
 }
 
 int cpld_get_switch(struct cpld *cpld, enum cpld_switch sw)
@@ -204,7 +316,7 @@ int cpld_get_switch(struct cpld *cpld, enum cpld_switch sw)
 
 	assert(cpld != NULL);
 
-	if (!is_switch_supported(cpld, sw))
+	if (check_ready(cpld) || !is_switch_supported(cpld, sw))
 		return -1;
 
 	b0 = &cpld->b0;
@@ -229,6 +341,20 @@ int cpld_get_switch(struct cpld *cpld, enum cpld_switch sw)
  * static functions
  */
 
+/* With lazy-init, the data is only read on first use.  It caches the state
+ * of the CPLD so it also gets read through const instances.  */
+static int check_ready(const struct cpld *cpld)
+{
+	struct cpld * const c = (struct cpld *) cpld;
+
+	return lazy_setup(&c->ready, c->i2c, setup_cb, c);
+}
+
+static int setup_cb(void *ctx)
+{
+	return cpld_setup(ctx);
+}
+
 static int is_switch_supported(struct cpld *cpld, enum cpld_switch sw)
 {
 	const struct cpld_supported_switches *it;
@@ -256,6 +382,23 @@ static int is_switch_supported(struct cpld *cpld, enum cpld_switch sw)
 	return 0;
 }
 
+static void set_switch_bit(struct cpld *cpld, enum cpld_switch sw, int on)
+{
+	struct cpld_byte_0 * const b0 = &cpld->b0;
+	struct cpld_byte_1 * const b1 = &cpld->b1;
+
+	switch (sw) {
+	case CPLD_HVEN:             b0->cpld_hven        = on ? 1 : 0;  break;
+	case CPLD_COM_SW_EN:        b1->vcom_sw_en       = on ? 1 : 0;  break;
+	case CPLD_COM_SW_CLOSE:     b1->vcom_sw_close    = on ? 1 : 0;  break;
+	case CPLD_COM_PSU:          b1->vcom_psu_en      = on ? 1 : 0;  break;
+	case CPLD_BPCOM_CLAMP:      b0->bpcom_clamp      = on ? 1 : 0;  break;
+	default:
+		assert(!"invalid switch identifier");
+		break;
+	}
+}
+
 static int read_i2c_data(struct cpld *cpld)
 {
 	return i2cdev_read(cpld->i2c, cpld->data, CPLD_NB_BYTES);
@@ -23,6 +23,7 @@
 #define INCLUDE_CPLD_H 1
 
 #define CPLD_NB_BYTES 3
+#define CPLD_API_VERSION 1
 
 /* ----------------------------------------------------------------------------
    CPLD API v1
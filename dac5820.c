@@ -20,9 +20,11 @@
 */
 
 #include "dac5820.h"
+#include "board.h"
 #include "i2cdev.h"
+#include "plhw_config.h"
+#include "util.h"
 #include <libplhw.h>
-#include <plsdk/plconfig.h>
 #include <assert.h>
 
 #define LOG_TAG "dac5820"
@@ -30,51 +32,82 @@
 
 struct dac5820 {
 	struct i2cdev *i2c;
-	struct plconfig *config;
+	struct plhw_config *config;
+	int in_place;
 };
 
+static int make_output(enum dac5820_channel_id channel, char value,
+		       union dac5820_write_payload *payload);
+
 struct dac5820 *dac5820_init(const char *i2c_bus, int i2c_address)
 {
 	struct dac5820 *dac;
 
-	dac = malloc(sizeof (struct dac5820));
+	dac = malloc(dac5820_size());
 
 	if (dac == NULL)
 		return NULL;
 
-	dac->config = plconfig_init(NULL, "libplhw");
+	if (dac5820_init_at(dac, i2c_bus, i2c_address) == NULL) {
+		free(dac);
+		return NULL;
+	}
+
+	dac->in_place = 0;
+
+	return dac;
+}
+
+size_t dac5820_size(void)
+{
+	return PLHW_ALIGN(sizeof (struct dac5820)) + i2cdev_size();
+}
+
+struct dac5820 *dac5820_init_at(void *mem, const char *i2c_bus,
+				int i2c_address)
+{
+	struct dac5820 *dac = mem;
+	char *i2c_mem = (char *) mem + PLHW_ALIGN(sizeof (struct dac5820));
+
+	assert(mem != NULL);
+
+	dac->in_place = 1;
+	dac->config = plhw_config_get();
 
 	if (dac->config == NULL)
-		goto err_free_dac;
+		return NULL;
 
 	if (i2c_address == PLHW_NO_I2C_ADDR)
-		i2c_address = plconfig_get_i2c_addr(
+		i2c_address = plhw_config_get_i2c_addr(
 			dac->config, "MAX5820-address", 0x39);
 
-	dac->i2c = i2cdev_init(i2c_bus, i2c_address);
+	dac->i2c = i2cdev_init_at(i2c_mem, i2c_bus, i2c_address);
 
 	if (dac->i2c == NULL) {
 		LOG("failed to initialise I2C");
-		goto err_free_plconfig;
+		plhw_config_put(dac->config);
+		return NULL;
 	}
 
 	return dac;
-
-err_free_plconfig:
-	plconfig_free(dac->config);
-err_free_dac:
-	free(dac);
-
-	return NULL;
 }
 
 void dac5820_free(struct dac5820 *dac)
 {
 	assert(dac != NULL);
 
-	plconfig_free(dac->config);
+	plhw_config_put(dac->config);
 	i2cdev_free(dac->i2c);
-	free(dac);
+
+	if (!dac->in_place)
+		free(dac);
+}
+
+struct i2cdev *dac5820_get_i2c(struct dac5820 *dac)
+{
+	assert(dac != NULL);
+
+	return dac->i2c;
 }
 
 int dac5820_set_power(struct dac5820 *dac, enum dac5820_channel_id channel,
@@ -138,10 +171,42 @@ int dac5820_set_power(struct dac5820 *dac, enum dac5820_channel_id channel,
 int dac5820_output(struct dac5820 *dac, enum dac5820_channel_id channel,
 		   char value)
 {
-	enum dac5820_write_cmd_id cmd;
-	int ret = 0;
+	union dac5820_write_payload payload;
+
+	assert(dac != NULL);
+
+	if (make_output(channel, value, &payload))
+		return -1;
+
+	return i2cdev_write(dac->i2c, payload.bytes, sizeof payload);
+}
+
+int dac5820_add_output(struct dac5820 *dac, struct i2cdev_txn **t,
+		       enum dac5820_channel_id channel, char value)
+{
+	union dac5820_write_payload payload;
 
 	assert(dac != NULL);
+	assert(t != NULL);
+
+	if (make_output(channel, value, &payload))
+		return -1;
+
+	if ((*t == NULL) && ((*t = i2cdev_txn_begin(dac->i2c)) == NULL))
+		return -1;
+
+	return (i2cdev_txn_add_write(*t, dac->i2c, payload.bytes,
+				     sizeof payload) < 0) ? -1 : 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * static functions
+ */
+
+static int make_output(enum dac5820_channel_id channel, char value,
+		       union dac5820_write_payload *payload)
+{
+	enum dac5820_write_cmd_id cmd;
 
 	switch (channel) {
 	case DAC5820_CH_A:
@@ -154,20 +219,13 @@ int dac5820_output(struct dac5820 *dac, enum dac5820_channel_id channel,
 
 	default:
 		assert(!"invalid channel identifier");
-		ret = -1;
-		break;
+		return -1;
 	}
 
-	if (!ret) {
-		union dac5820_write_payload payload;
-
-		payload.cmd_byte.cmd = cmd;
-		payload.cmd_byte.data_high = (value >> 4) & 0xF;
-		payload.data_byte.data_low = value & 0xF;
-		payload.data_byte.reserved = 0;
-
-		ret = i2cdev_write(dac->i2c, payload.bytes, sizeof payload);
-	}
+	payload->cmd_byte.cmd = cmd;
+	payload->cmd_byte.data_high = (value >> 4) & 0xF;
+	payload->data_byte.data_low = value & 0xF;
+	payload->data_byte.reserved = 0;
 
-	return ret;
+	return 0;
 }
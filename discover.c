@@ -0,0 +1,415 @@
+/*
+  Plastic Logic hardware library - discover
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "i2cdev.h"
+#include "cpld.h"
+#include "max17135.h"
+#include "tps65185.h"
+#include "plhw_config.h"
+#include <libplhw.h>
+#include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "discover"
+#include <plsdk/log.h>
+
+#define SYSFS_I2C_DEVICES "/sys/bus/i2c/devices"
+#define MAX_ADAPTERS 32
+
+/* Known parts, probed with the same default addresses as their _init */
+enum probe_id {
+	PROBE_CPLD,
+	PROBE_MAX17135,
+	PROBE_TPS65185,
+	PROBE_MAX5820,
+	PROBE_MAX11607,
+	PROBE_PBTN,
+	PROBE_EEPROM,
+	NB_PROBES
+};
+
+static const struct probe_def {
+	enum plhw_part part;
+	const char *addr_key;
+	int def_addr;
+	int has_id;
+} probe_defs[NB_PROBES] = {
+	[PROBE_CPLD]     = { PLHW_PART_CPLD,     "CPLD-address",     0x70, 1 },
+	[PROBE_MAX17135] = { PLHW_PART_MAX17135, "MAX17135-address", 0x48, 1 },
+	[PROBE_TPS65185] = { PLHW_PART_TPS65185, "TPS65185-address", 0x68, 1 },
+	[PROBE_MAX5820]  = { PLHW_PART_MAX5820,  "MAX5820-address",  0x39, 0 },
+	[PROBE_MAX11607] = { PLHW_PART_MAX11607, "MAX116xx-address", 0x34, 0 },
+	[PROBE_PBTN]     = { PLHW_PART_PBTN,     "pbtn-address",
+			     PBTN_DEF_I2C_ADDR, 0 },
+	[PROBE_EEPROM]   = { PLHW_PART_EEPROM,   NULL,
+			     PLHW_EEPROM_DEF_I2C_ADDR, 0 },
+};
+
+/* Parts are first probed with plain reads, which don't change the state of
+ * any device.  The ones which answered then get their identification
+ * checked, with the HVPMIC identification registers read in a second
+ * batch. */
+struct probe {
+	enum probe_id id;
+	struct i2cdev *dev;
+	int found;
+	char data[CPLD_NB_BYTES];
+};
+
+struct discover_job {
+	char i2c_bus[PLHW_I2C_BUS_SIZE];
+	struct plhw_board_info info;
+	pthread_t thread;
+	int started;
+	int ret;
+};
+
+static int probe_add(struct i2cdev_txn *t, struct probe *p, int id_regs);
+static void probe_batch(struct probe *probes, size_t n, int id_regs);
+static int probe_identify(struct probe *p);
+static int discover_config_bus(struct plhw_board_info *boards, size_t n);
+static void *discover_thread(void *arg);
+static int cmp_unsigned(const void *a, const void *b);
+
+int plhw_discover_bus(const char *i2c_bus, struct plhw_board_info *info)
+{
+	static const struct i2cdev_retry_policy no_retry = {
+		.max_retries = 0,
+		.breaker_threshold = 0,
+	};
+	struct probe probes[NB_PROBES];
+	struct plhw_config *config;
+	int identified;
+	size_t n = 0;
+	size_t i;
+
+	assert(i2c_bus != NULL);
+	assert(info != NULL);
+
+	memset(info, 0, sizeof *info);
+	strncpy(info->i2c_bus, i2c_bus, (sizeof info->i2c_bus - 1));
+	info->cpld_version = -1;
+	info->cpld_board_id = -1;
+	info->max17135_prod_id = -1;
+	info->max17135_prod_rev = -1;
+	info->tps65185_rev_id = -1;
+
+	config = plhw_config_get();
+
+	if (config == NULL)
+		return -1;
+
+	for (i = 0; i < NB_PROBES; ++i) {
+		const struct probe_def * const def = &probe_defs[i];
+		struct probe * const p = &probes[n];
+		const int addr = (def->addr_key == NULL) ? def->def_addr :
+			plhw_config_get_i2c_addr(config, def->addr_key,
+						 def->def_addr);
+
+		p->id = i;
+		p->found = 0;
+		memset(p->data, 0, sizeof p->data);
+		p->dev = i2cdev_init(i2c_bus, addr);
+
+		if (p->dev == NULL)
+			continue;
+
+		i2cdev_set_flag(p->dev, I2CDEV_QUIET, 1);
+		i2cdev_set_retry_policy(p->dev, &no_retry);
+		++n;
+	}
+
+	plhw_config_put(config);
+
+	if (n) {
+		probe_batch(probes, n, 0);
+		probe_batch(probes, n, 1);
+	}
+
+	for (i = 0, identified = 0; i < n; ++i) {
+		struct probe * const p = &probes[i];
+
+		if (p->found)
+			p->found = probe_identify(p);
+
+		if (p->found && probe_defs[p->id].has_id)
+			identified = 1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		const struct probe * const p = &probes[i];
+		const uint8_t * const data = (const uint8_t *) p->data;
+
+		i2cdev_free(p->dev);
+
+		/* parts without identification only count on a known board */
+		if (!p->found || !identified)
+			continue;
+
+		info->parts |= probe_defs[p->id].part;
+
+		switch (p->id) {
+		case PROBE_CPLD:
+			info->cpld_version = (data[0] >> 2) & 0x3F;
+			info->cpld_board_id = data[2] & 0x0F;
+			break;
+		case PROBE_MAX17135:
+			info->max17135_prod_rev = data[0];
+			info->max17135_prod_id = data[1];
+			break;
+		case PROBE_TPS65185:
+			info->tps65185_rev_id = data[0];
+			break;
+		default:
+			break;
+		}
+	}
+
+	return info->parts ? 0 : -1;
+}
+
+int plhw_discover(struct plhw_board_info *boards, size_t n, int all_buses)
+{
+	unsigned adapters[MAX_ADAPTERS];
+	struct discover_job *jobs;
+	struct dirent *entry;
+	size_t n_adapters = 0;
+	size_t n_boards = 0;
+	size_t i;
+	DIR *dir;
+
+	assert(boards != NULL);
+
+	if (!all_buses)
+		return discover_config_bus(boards, n);
+
+	dir = opendir(SYSFS_I2C_DEVICES);
+
+	if (dir == NULL) {
+		LOG("failed to open %s", SYSFS_I2C_DEVICES);
+		return -1;
+	}
+
+	/* adapters are i2c-N, the other entries are clients (N-00AA) */
+	while (((entry = readdir(dir)) != NULL)
+	       && (n_adapters < MAX_ADAPTERS)) {
+		unsigned adapter;
+		int len;
+
+		if ((sscanf(entry->d_name, "i2c-%u%n", &adapter, &len) == 1)
+		    && (entry->d_name[len] == '\0'))
+			adapters[n_adapters++] = adapter;
+	}
+
+	closedir(dir);
+
+	if (!n_adapters)
+		return 0;
+
+	qsort(adapters, n_adapters, sizeof adapters[0], cmp_unsigned);
+	jobs = malloc(n_adapters * sizeof (struct discover_job));
+
+	if (jobs == NULL)
+		return -1;
+
+	for (i = 0; i < n_adapters; ++i) {
+		struct discover_job * const job = &jobs[i];
+
+		snprintf(job->i2c_bus, sizeof job->i2c_bus, "/dev/i2c-%u",
+			 adapters[i]);
+
+		/* probe serially if a thread can't be created */
+		job->started = !pthread_create(&job->thread, NULL,
+					       discover_thread, job);
+
+		if (!job->started)
+			discover_thread(job);
+	}
+
+	for (i = 0; i < n_adapters; ++i) {
+		struct discover_job * const job = &jobs[i];
+
+		if (job->started)
+			pthread_join(job->thread, NULL);
+
+		if (job->ret || (n_boards == n))
+			continue;
+
+		memcpy(&boards[n_boards++], &job->info, sizeof job->info);
+	}
+
+	free(jobs);
+
+	return n_boards;
+}
+
+/* ----------------------------------------------------------------------------
+ * static functions
+ */
+
+/* Add the plain read of the probe or, with id_regs, the reads of its
+ * identification registers.  Return the number of reads added or -1. */
+static int probe_add(struct i2cdev_txn *t, struct probe *p, int id_regs)
+{
+	const size_t size = (p->id == PROBE_CPLD) ? CPLD_NB_BYTES : 1;
+
+	if (!id_regs)
+		return (i2cdev_txn_add_read(t, p->dev, p->data, size) < 0) ?
+			-1 : 1;
+
+	switch (p->id) {
+	case PROBE_MAX17135:
+		if ((i2cdev_txn_add_read_reg8(t, p->dev, MAX17135_REG_PROD_REV,
+					      &p->data[0], 1) < 0)
+		    || (i2cdev_txn_add_read_reg8(t, p->dev,
+						 MAX17135_REG_PROD_ID,
+						 &p->data[1], 1) < 0))
+			return -1;
+
+		return 2;
+	case PROBE_TPS65185:
+		if (i2cdev_txn_add_read_reg8(t, p->dev, TPS65185_REG_REV_ID,
+					     p->data, 1) < 0)
+			return -1;
+
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* A missing part makes the whole transfer fail, so the batch is split in
+ * two halves until the failing probes are isolated.  With id_regs, only
+ * the probes already found are used and the ones which fail are dropped. */
+static void probe_batch(struct probe *probes, size_t n, int id_regs)
+{
+	struct i2cdev_txn *t;
+	size_t n_reads;
+	size_t i;
+	int ret;
+
+	t = i2cdev_txn_begin(probes[0].dev);
+
+	if (t == NULL)
+		return;
+
+	for (i = 0, n_reads = 0, ret = 0; (i < n) && !ret; ++i) {
+		int stat;
+
+		if (id_regs && !probes[i].found)
+			continue;
+
+		stat = probe_add(t, &probes[i], id_regs);
+
+		if (stat < 0)
+			ret = -1;
+		else
+			n_reads += stat;
+	}
+
+	if (!ret && n_reads)
+		ret = i2cdev_txn_commit(t);
+
+	i2cdev_txn_free(t);
+
+	if (!ret) {
+		if (!id_regs)
+			for (i = 0; i < n; ++i)
+				probes[i].found = 1;
+	} else if (n > 1) {
+		probe_batch(probes, (n / 2), id_regs);
+		probe_batch(&probes[n / 2], (n - (n / 2)), id_regs);
+	} else if (id_regs) {
+		probes[0].found = 0;
+	}
+}
+
+/* Return 1 if the part is what it is expected to be at this address, which
+ * can't be checked without an identification register (has_id). */
+static int probe_identify(struct probe *p)
+{
+	const uint8_t * const data = (const uint8_t *) p->data;
+
+	switch (p->id) {
+	case PROBE_CPLD:
+		return ((((data[0] >> 2) & 0x3F) == CPLD_API_VERSION)
+			&& !(data[2] & 0xF0));
+	case PROBE_MAX17135:
+		return (data[1] == MAX17135_PROD_ID);
+	case PROBE_TPS65185:
+		return (((data[0] & 0x0F) == TPS65185_VERSION)
+			|| ((data[0] & 0x0F) == TPS65186_VERSION));
+	default:
+		return 1;
+	}
+}
+
+static int discover_config_bus(struct plhw_board_info *boards, size_t n)
+{
+	struct plhw_config *config;
+	char i2c_bus[PLHW_I2C_BUS_SIZE];
+	const char *path;
+
+	config = plhw_config_get();
+
+	if (config == NULL)
+		return -1;
+
+	path = plhw_config_get_str(config, "i2c-bus", NULL);
+
+	if (path != NULL) {
+		strncpy(i2c_bus, path, (sizeof i2c_bus - 1));
+		i2c_bus[sizeof i2c_bus - 1] = '\0';
+	}
+
+	plhw_config_put(config);
+
+	if (path == NULL) {
+		LOG("no I2C bus configured");
+		return -1;
+	}
+
+	if (!n || plhw_discover_bus(i2c_bus, &boards[0]))
+		return 0;
+
+	return 1;
+}
+
+static void *discover_thread(void *arg)
+{
+	struct discover_job *job = arg;
+
+	job->ret = plhw_discover_bus(job->i2c_bus, &job->info);
+
+	return NULL;
+}
+
+static int cmp_unsigned(const void *a, const void *b)
+{
+	const unsigned ua = *(const unsigned *) a;
+	const unsigned ub = *(const unsigned *) b;
+
+	return (ua > ub) - (ua < ub);
+}
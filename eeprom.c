@@ -19,9 +19,13 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "board.h"
 #include "i2cdev.h"
+#include "plhw_config.h"
+#include "util.h"
 #include <libplhw.h>
 #include <assert.h>
+#include <pthread.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -38,14 +42,20 @@ struct eeprom_config {
 	size_t offset_size;
 };
 
+/* The driver state is protected by its own lock rather than the bus lock,
+ * so each block read or page write is a separate bus operation and other
+ * devices can use the bus in between, in particular during the page write
+ * cycles.  */
 struct eeprom {
 	struct i2cdev *i2c;
+	pthread_mutex_t lock;
 	struct eeprom_config cfg;
 	size_t offset;
 	size_t block_size;
-	uint8_t *packet;
+	uint8_t addr[2];
 	struct {
 		char offset_written:1;
+		char in_place:1;
 	} flags;
 };
 
@@ -66,6 +76,9 @@ static const struct eeprom_config eeprom_config_table[] = {
 	{ NULL, 0, 0, 0 }
 };
 
+static int lazy_init(void);
+static int read_data(struct eeprom *e, char *data, size_t size);
+static int write_data(struct eeprom *e, const char *data, size_t size);
 static void set_offset(struct eeprom *e);
 static int sync_offset(struct eeprom *e);
 static int write_page(struct eeprom *e, const char *data, size_t size);
@@ -73,20 +86,48 @@ static int write_page(struct eeprom *e, const char *data, size_t size);
 struct eeprom *eeprom_init(const char *i2c_bus, char i2c_address,
 			   const char *mode)
 {
-	const struct eeprom_config *config;
 	struct eeprom *e;
 
-	assert(mode != NULL);
+	e = malloc(eeprom_size());
 
-	if (i2c_address == PLHW_NO_I2C_ADDR) {
-		LOG("no I2C address specified");
+	if (e == NULL)
+		return NULL;
+
+	if (eeprom_init_at(e, i2c_bus, i2c_address, mode) == NULL) {
+		free(e);
 		return NULL;
 	}
 
-	e = malloc(sizeof (struct eeprom));
+	e->flags.in_place = 0;
 
-	if (e == NULL)
+	/* the offset is otherwise written on first access */
+	if (!lazy_init() && eeprom_setup(e)) {
+		eeprom_free(e);
+		return NULL;
+	}
+
+	return e;
+}
+
+size_t eeprom_size(void)
+{
+	return PLHW_ALIGN(sizeof (struct eeprom)) + i2cdev_size();
+}
+
+struct eeprom *eeprom_init_at(void *mem, const char *i2c_bus,
+			      char i2c_address, const char *mode)
+{
+	const struct eeprom_config *config;
+	struct eeprom *e = mem;
+	char *i2c_mem = (char *) mem + PLHW_ALIGN(sizeof (struct eeprom));
+
+	assert(mem != NULL);
+	assert(mode != NULL);
+
+	if ((unsigned char) i2c_address == PLHW_NO_I2C_ADDR) {
+		LOG("no I2C address specified");
 		return NULL;
+	}
 
 	for (config = eeprom_config_table; config->mode != NULL; ++config) {
 		if (!strcmp(mode, config->mode)) {
@@ -97,7 +138,7 @@ struct eeprom *eeprom_init(const char *i2c_bus, char i2c_address,
 
 	if (config->mode == NULL) {
 		LOG("unsupported mode: %s", mode);
-		goto err_free_e;
+		return NULL;
 	}
 
 	LOG("mode: %s, data_size: %zu, page_size: %zu, offset_size: %zu",
@@ -106,38 +147,78 @@ struct eeprom *eeprom_init(const char *i2c_bus, char i2c_address,
 
 	e->offset = 0;
 	e->block_size = DEFAULT_I2C_BLOCK_SIZE;
-	e->packet = malloc(e->cfg.page_size + e->cfg.offset_size);
-	assert(e->packet != NULL);
+	e->flags.offset_written = 0;
+	e->flags.in_place = 1;
 
-	e->i2c = i2cdev_init(i2c_bus, i2c_address);
+	e->i2c = i2cdev_init_at(i2c_mem, i2c_bus, i2c_address);
 
 	if (e->i2c == NULL)
-		goto err_free_packet;
+		return NULL;
 
-	if (sync_offset(e) < 0) {
-		LOG("failed to set the initial offset");
-		goto err_free_i2c;
+	i2cdev_set_prio(e->i2c, I2CDEV_PRIO_BULK);
+
+	/* so that page writes never need to allocate */
+	if (i2cdev_reserve(e->i2c, e->cfg.page_size + e->cfg.offset_size)) {
+		LOG("failed to reserve the page buffer");
+		i2cdev_free(e->i2c);
+		return NULL;
 	}
 
+	pthread_mutex_init(&e->lock, NULL);
+
 	return e;
+}
 
-err_free_i2c:
-	i2cdev_free(e->i2c);
-err_free_packet:
-	free(e->packet);
-err_free_e:
-	free(e);
+/* The offset is assumed to be written by the transaction, eeprom_setup
+ * writes it again if the transaction failed.  */
+int eeprom_add_setup(struct eeprom *e, struct i2cdev_txn **t)
+{
+	assert(e != NULL);
+	assert(t != NULL);
+
+	if ((*t == NULL) && ((*t = i2cdev_txn_begin(e->i2c)) == NULL))
+		return -1;
+
+	set_offset(e);
+
+	if (i2cdev_txn_add_write(*t, e->i2c, e->addr, e->cfg.offset_size) < 0)
+		return -1;
+
+	e->flags.offset_written = 1;
+
+	return 0;
+}
+
+int eeprom_setup(struct eeprom *e)
+{
+	assert(e != NULL);
+
+	e->flags.offset_written = 0;
 
-	return NULL;
+	if (sync_offset(e) < 0) {
+		LOG("failed to set the initial offset");
+		return -1;
+	}
+
+	return 0;
 }
 
 void eeprom_free(struct eeprom *e)
 {
 	assert(e != NULL);
 
+	pthread_mutex_destroy(&e->lock);
 	i2cdev_free(e->i2c);
-	free(e->packet);
-	free(e);
+
+	if (!e->flags.in_place)
+		free(e);
+}
+
+struct i2cdev *eeprom_get_i2c(struct eeprom *e)
+{
+	assert(e != NULL);
+
+	return e->i2c;
 }
 
 const char *eeprom_get_mode(struct eeprom *e)
@@ -158,6 +239,12 @@ void eeprom_set_page_size(struct eeprom *e, size_t page_size)
 {
 	assert(e != NULL);
 
+	/* the write buffer must hold a whole page, keep the old size if not */
+	if (i2cdev_reserve(e->i2c, page_size + e->cfg.offset_size)) {
+		LOG("failed to set the page size to %zu", page_size);
+		return;
+	}
+
 	e->cfg.page_size = page_size;
 }
 
@@ -188,8 +275,10 @@ void eeprom_seek(struct eeprom *e, size_t offset)
 	assert(e != NULL);
 	assert(offset < e->cfg.data_size);
 
+	pthread_mutex_lock(&e->lock);
 	e->offset = offset;
 	e->flags.offset_written = 0;
+	pthread_mutex_unlock(&e->lock);
 }
 
 size_t eeprom_get_offset(struct eeprom *e)
@@ -200,6 +289,51 @@ size_t eeprom_get_offset(struct eeprom *e)
 }
 
 int eeprom_read(struct eeprom *e, char *data, size_t size)
+{
+	int ret;
+
+	assert(e != NULL);
+
+	pthread_mutex_lock(&e->lock);
+	ret = read_data(e, data, size);
+	pthread_mutex_unlock(&e->lock);
+
+	return ret;
+}
+
+int eeprom_write(struct eeprom *e, const char *data, size_t size)
+{
+	int ret;
+
+	assert(e != NULL);
+	assert(data != NULL);
+
+	pthread_mutex_lock(&e->lock);
+	ret = write_data(e, data, size);
+	pthread_mutex_unlock(&e->lock);
+
+	return ret;
+}
+
+/* ----------------------------------------------------------------------------
+ * static functions
+ */
+
+static int lazy_init(void)
+{
+	struct plhw_config *config = plhw_config_get();
+	int lazy;
+
+	if (config == NULL)
+		return 0;
+
+	lazy = plhw_config_get_int(config, "lazy-init", 0) ? 1 : 0;
+	plhw_config_put(config);
+
+	return lazy;
+}
+
+static int read_data(struct eeprom *e, char *data, size_t size)
 {
 	size_t read_size;
 	int blocks;
@@ -207,8 +341,6 @@ int eeprom_read(struct eeprom *e, char *data, size_t size)
 	int block;
 	char *p;
 
-	assert(e != NULL);
-
 	if (e->offset == INVALID_OFFSET)
 		return -1;
 
@@ -249,7 +381,7 @@ int eeprom_read(struct eeprom *e, char *data, size_t size)
 	return 0;
 }
 
-int eeprom_write(struct eeprom *e, const char *data, size_t size)
+static int write_data(struct eeprom *e, const char *data, size_t size)
 {
 	unsigned page_offset;
 	unsigned first_len;
@@ -258,9 +390,6 @@ int eeprom_write(struct eeprom *e, const char *data, size_t size)
 	unsigned last_len;
 	const char *p;
 
-	assert(e != NULL);
-	assert(data != NULL);
-
 	page_offset = e->offset % e->cfg.page_size;
 
 	if ((page_offset + size) < e->cfg.page_size) {
@@ -301,17 +430,13 @@ int eeprom_write(struct eeprom *e, const char *data, size_t size)
 	return 0;
 }
 
-/* ----------------------------------------------------------------------------
- * static functions
- */
-
 static void set_offset(struct eeprom *e)
 {
 	if (e->cfg.offset_size == 1) {
-		e->packet[0] = e->offset;
+		e->addr[0] = e->offset;
 	} else {
-		e->packet[0] = (e->offset >> 8) & 0x7F;
-		e->packet[1] = e->offset & 0xFF;
+		e->addr[0] = (e->offset >> 8) & 0x7F;
+		e->addr[1] = e->offset & 0xFF;
 	}
 }
 
@@ -322,7 +447,7 @@ static int sync_offset(struct eeprom *e)
 
 	set_offset(e);
 
-	if (i2cdev_write(e->i2c, e->packet, e->cfg.offset_size) < 0) {
+	if (i2cdev_write(e->i2c, e->addr, e->cfg.offset_size) < 0) {
 		e->offset = INVALID_OFFSET;
 		return -1;
 	}
@@ -337,9 +462,8 @@ static int write_page(struct eeprom *e, const char *data, size_t size)
 	assert(size <= e->cfg.page_size);
 
 	set_offset(e);
-	memcpy(&e->packet[e->cfg.offset_size], data, size);
 
-	if (i2cdev_write(e->i2c, e->packet, (size + e->cfg.offset_size)) < 0)
+	if (i2cdev_write_reg(e->i2c, e->addr, e->cfg.offset_size, data, size))
 		return -1;
 
 	usleep(WRITE_TIME_US);
@@ -20,7 +20,9 @@
 */
 
 #include "gpioex.h"
+#include "board.h"
 #include "i2cdev.h"
+#include "util.h"
 #include "libplhw.h"
 #include <assert.h>
 
@@ -35,9 +37,13 @@ struct gpioex {
 	char o_mask;
 	struct {
 		int auto_write:1;
+		int in_place:1;
 	} flags;
+	int ready;
 };
 
+static int check_ready(struct gpioex *g);
+static int setup_cb(void *ctx);
 static int read_value(struct gpioex *g);
 static int write_value(struct gpioex *g);
 
@@ -45,18 +51,82 @@ struct gpioex *gpioex_init(const char *i2c_bus, int i2c_address,
                            char i_mask, char o_mask)
 {
 	struct gpioex *g;
-	int error = 1;
 
+	g = malloc(gpioex_size());
+	assert(g != NULL);
+
+	if (gpioex_init_at(g, i2c_bus, i2c_address, i_mask, o_mask) == NULL) {
+		free(g);
+		return NULL;
+	}
+
+	g->flags.in_place = 0;
+
+	if (gpioex_setup(g)) {
+		gpioex_free(g);
+		return NULL;
+	}
+
+	return g;
+}
+
+size_t gpioex_size(void)
+{
+	return PLHW_ALIGN(sizeof (struct gpioex)) + i2cdev_size();
+}
+
+struct gpioex *gpioex_init_at(void *mem, const char *i2c_bus,
+			      int i2c_address, char i_mask, char o_mask)
+{
+	struct gpioex *g = mem;
+	char *i2c_mem = (char *) mem + PLHW_ALIGN(sizeof (struct gpioex));
+
+	assert(mem != NULL);
 	assert(!(i_mask & o_mask));
 
-	g = malloc(sizeof (struct gpioex));
+	g->i2c = i2cdev_init_at(i2c_mem, i2c_bus, i2c_address);
+
+	if (g->i2c == NULL) {
+		LOG("failed to initialise I2C");
+		return NULL;
+	}
+
+	g->i_mask = i_mask;
+	g->o_mask = o_mask;
+	g->o_value = 0;
+	g->flags.auto_write = 1;
+	g->flags.in_place = 1;
+	lazy_set_ready(&g->ready, 0);
+
+	return g;
+}
+
+/* The initial value read is only used to check the device is there, it
+ * gets read again by gpioex_get.  */
+int gpioex_add_setup(struct gpioex *g, struct i2cdev_txn **t)
+{
 	assert(g != NULL);
+	assert(t != NULL);
 
-	g->i2c = i2cdev_init(i2c_bus, i2c_address);
+	if ((*t == NULL) && ((*t = i2cdev_txn_begin(g->i2c)) == NULL))
+		return -1;
 
-	if (g->i2c == NULL)
-		LOG("failed to initialise I2C");
-	else if (i2cdev_write(g->i2c, &i_mask, 1) < 0)
+	if ((i2cdev_txn_add_write(*t, g->i2c, &g->i_mask, 1) < 0) ||
+	    (i2cdev_txn_add_read(*t, g->i2c, &g->i_value, 1) < 0))
+		return -1;
+
+	lazy_set_ready(&g->ready, 1);
+
+	return 0;
+}
+
+int gpioex_setup(struct gpioex *g)
+{
+	int error = 1;
+
+	assert(g != NULL);
+
+	if (i2cdev_write(g->i2c, &g->i_mask, 1) < 0)
 		LOG("failed to intialise inputs");
 	else if (read_value(g) < 0)
 		LOG("failed to read initial value");
@@ -65,59 +135,75 @@ struct gpioex *gpioex_init(const char *i2c_bus, int i2c_address,
 
 	if (error) {
 		LOG("GPIO init failed (in: 0x%02X, out: 0x%02X)",
-		    i_mask, o_mask);
-		gpioex_free(g);
-		g = NULL;
-	} else {
-		g->i_mask = i_mask;
-		g->o_mask = o_mask;
-		g->o_value = 0;
-		g->flags.auto_write = 1;
+		    g->i_mask, g->o_mask);
+		lazy_set_ready(&g->ready, 0);
+		return -1;
 	}
 
+	lazy_set_ready(&g->ready, 1);
 
-	return g;
+	return 0;
 }
 
 void gpioex_free(struct gpioex *g)
 {
 	assert(g != NULL);
 
-	if (g->i2c != NULL)
-		i2cdev_free(g->i2c);
+	i2cdev_free(g->i2c);
+
+	if (!g->flags.in_place)
+		free(g);
+}
+
+struct i2cdev *gpioex_get_i2c(struct gpioex *g)
+{
+	assert(g != NULL);
 
-	free(g);
+	return g->i2c;
 }
 
 int gpioex_get(struct gpioex *g, char *value)
 {
+	int ret;
+
 	assert(g != NULL);
 
-	if (read_value(g) < 0)
+	if (check_ready(g))
 		return -1;
 
-	*value = (g->i_value | g->o_value);
+	i2cdev_lock(g->i2c);
+	ret = read_value(g);
 
-	return 0;
+	if (!ret)
+		*value = (g->i_value | g->o_value);
+
+	i2cdev_unlock(g->i2c);
+
+	return ret;
 }
 
 int gpioex_set(struct gpioex *g, char value, int set_clear)
 {
 	char masked;
+	int ret;
 
 	assert(g != NULL);
 
+	if (check_ready(g))
+		return -1;
+
 	masked = value & g->o_mask;
+	i2cdev_lock(g->i2c);
 
 	if (set_clear)
 		g->o_value |= masked;
 	else
 		g->o_value &= ~masked;
 
-	if (g->flags.auto_write)
-		return write_value(g);
+	ret = g->flags.auto_write ? write_value(g) : 0;
+	i2cdev_unlock(g->i2c);
 
-	return 0;
+	return ret;
 }
 
 void gpioex_set_auto_write(struct gpioex *g, int enable)
@@ -131,6 +217,17 @@ void gpioex_set_auto_write(struct gpioex *g, int enable)
  * static functions
  */
 
+/* The inputs are only initialised on first use when created lazily */
+static int check_ready(struct gpioex *g)
+{
+	return lazy_setup(&g->ready, g->i2c, setup_cb, g);
+}
+
+static int setup_cb(void *ctx)
+{
+	return gpioex_setup(ctx);
+}
+
 static int read_value(struct gpioex *g)
 {
 	char value;
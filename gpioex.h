@@ -23,10 +23,12 @@
 #define INCLUDE_GPIOEX_H 1
 
 struct gpioex;
+struct i2cdev;
 
 extern struct gpioex *gpioex_init(const char *i2c_bus, int i2c_address,
                                   char i_mask, char o_mask);
 extern void gpioex_free(struct gpioex *gpioex);
+extern struct i2cdev *gpioex_get_i2c(struct gpioex *gpioex);
 
 extern int gpioex_get(struct gpioex *gpioex, char *value);
 extern int gpioex_set(struct gpioex *gpioex, char value, int set_clear);
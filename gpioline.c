@@ -0,0 +1,202 @@
+/*
+  Plastic Logic hardware library - gpioline
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "gpioline.h"
+#include <linux/gpio.h>
+#include <sys/ioctl.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_TAG "gpioline"
+#include <plsdk/log.h>
+
+struct gpioline {
+	int fd;
+	unsigned offset;
+};
+
+static int open_chip(const char *spec, unsigned *offset);
+static long elapsed_ms(const struct timespec *t0);
+
+struct gpioline *gpioline_init(const char *spec, const char *label)
+{
+	struct gpioevent_request req;
+	struct gpioline *l;
+	int chip_fd;
+
+	assert(spec != NULL);
+	assert(label != NULL);
+
+	l = malloc(sizeof (struct gpioline));
+
+	if (l == NULL)
+		return NULL;
+
+	chip_fd = open_chip(spec, &l->offset);
+
+	if (chip_fd < 0)
+		goto err_free_line;
+
+	/* events are queued from now on, so none can be missed between
+	 * reading the line value and polling */
+	memset(&req, 0, sizeof req);
+	req.lineoffset = l->offset;
+	req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+	req.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+	strncpy(req.consumer_label, label, (sizeof req.consumer_label - 1));
+
+	if (ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req) < 0) {
+		LOG("failed to request line events (%s, %s)", spec,
+		    strerror(errno));
+		close(chip_fd);
+		goto err_free_line;
+	}
+
+	close(chip_fd);
+	l->fd = req.fd;
+
+	return l;
+
+err_free_line:
+	free(l);
+
+	return NULL;
+}
+
+void gpioline_free(struct gpioline *l)
+{
+	assert(l != NULL);
+
+	close(l->fd);
+	free(l);
+}
+
+int gpioline_get(struct gpioline *l)
+{
+	struct gpiohandle_data data;
+
+	assert(l != NULL);
+
+	if (ioctl(l->fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) < 0) {
+		LOG("failed to read line %u (%s)", l->offset, strerror(errno));
+		return -1;
+	}
+
+	return data.values[0] ? 1 : 0;
+}
+
+int gpioline_wait(struct gpioline *l, unsigned timeout_ms)
+{
+	struct gpioevent_data event;
+	struct pollfd pfd;
+	struct timespec t0;
+	long remaining;
+	int value;
+
+	assert(l != NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pfd.fd = l->fd;
+	pfd.events = POLLIN;
+
+	/* The level is checked after each event, so stale events queued by
+	 * earlier edges only cause an extra read of the line value.  */
+	while ((value = gpioline_get(l)) == 0) {
+		int ret;
+
+		remaining = timeout_ms - elapsed_ms(&t0);
+
+		if (remaining <= 0)
+			return 0;
+
+		ret = poll(&pfd, 1, remaining);
+
+		if ((ret < 0) && (errno != EINTR)) {
+			LOG("failed to poll line %u (%s)", l->offset,
+			    strerror(errno));
+			return -1;
+		}
+
+		if ((ret > 0) && (read(l->fd, &event, sizeof event) < 0)) {
+			LOG("failed to read line %u event", l->offset);
+			return -1;
+		}
+	}
+
+	return value;
+}
+
+/* ----------------------------------------------------------------------------
+ * static functions
+ */
+
+static int open_chip(const char *spec, unsigned *offset)
+{
+	char path[64];
+	const char *sep;
+	char *end;
+	int fd;
+
+	sep = strrchr(spec, ':');
+
+	if ((sep == NULL) || (sep == spec)) {
+		LOG("invalid GPIO line: %s", spec);
+		return -1;
+	}
+
+	*offset = strtoul((sep + 1), &end, 0);
+
+	if ((end == (sep + 1)) || (*end != '\0')) {
+		LOG("invalid GPIO line offset: %s", spec);
+		return -1;
+	}
+
+	if (snprintf(path, sizeof path, "%s%.*s",
+		     ((spec[0] == '/') ? "" : "/dev/"),
+		     (int) (sep - spec), spec) >= sizeof path) {
+		LOG("GPIO chip path too long: %s", spec);
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		LOG("failed to open %s (%s)", path, strerror(errno));
+
+	return fd;
+}
+
+static long elapsed_ms(const struct timespec *t0)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return ((t.tv_sec - t0->tv_sec) * 1000)
+		+ ((t.tv_nsec - t0->tv_nsec) / 1000000);
+}
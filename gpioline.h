@@ -0,0 +1,37 @@
+/*
+  Plastic Logic hardware library - gpioline
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INCLUDE_GPIOLINE_H
+#define INCLUDE_GPIOLINE_H 1
+
+/* Input line of a GPIO character device, to wait for a signal with edge
+ * events instead of polling it over I2C.  The line is given as
+ * "<chip>:<offset>", with the chip either a /dev/gpiochipN path or just its
+ * name.  gpioline_wait returns 1 as soon as the line is active, 0 after
+ * timeout_ms or -1 if error.  */
+struct gpioline;
+
+extern struct gpioline *gpioline_init(const char *spec, const char *label);
+extern void gpioline_free(struct gpioline *l);
+extern int gpioline_get(struct gpioline *l);
+extern int gpioline_wait(struct gpioline *l, unsigned timeout_ms);
+
+#endif /* INCLUDE_GPIOLINE_H */
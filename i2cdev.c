@@ -20,54 +20,314 @@
 */
 
 #include "i2cdev.h"
+#include "i2crec.h"
+#include "i2csim.h"
+#include "plhw_config.h"
+#include "util.h"
 #include <libplhw.h>
-#include <plsdk/plconfig.h>
 #include <linux/i2c.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef ANDROID /* Bionic libc */
 struct i2c_rdwr_ioctl_data {
 	struct i2c_msg *msgs;
 	__u32 nmsgs;
 };
+
+struct i2c_smbus_ioctl_data {
+	__u8 read_write;
+	__u8 command;
+	__u32 size;
+	union i2c_smbus_data *data;
+};
 #else /* GNU libc */
 # include <linux/i2c-dev.h>
 #endif
 
+#ifndef I2C_RDWR_IOCTL_MAX_MSGS
+# define I2C_RDWR_IOCTL_MAX_MSGS 42
+#endif
+
+#ifndef I2C_FUNCS
+# define I2C_FUNCS 0x0705
+#endif
+
+#ifndef I2C_SMBUS
+# define I2C_SMBUS 0x0720
+#endif
+
+#ifndef I2C_RETRIES
+# define I2C_RETRIES 0x0701
+#endif
+
+#ifndef I2C_TIMEOUT
+# define I2C_TIMEOUT 0x0702
+#endif
+
 #define LOG_TAG "i2cdev"
 #include <plsdk/log.h>
 
 #define BLOCK_SIZE_STEP 64
+#define TXN_SIZE_STEP 16
+#define ASYNC_RING_SIZE 64 /* must be a power of 2 */
+#define ADDR_MAP_SIZE (128 / 8)
+
+/* Priority-aware recursive bus lock.  A thread only gets the lock when no
+ * thread with a higher priority is waiting for it, so a long sequence of
+ * low-priority operations gets preempted between operations.  The owner
+ * parks the lock while waiting before a retry: threads which don't use any
+ * of the devices in its held address map can then take the lock, until the
+ * owner resumes.  If such a thread then needs one of these devices, it
+ * yields the lock back to the parked owner until it is done with them.
+ * The bulk token bucket counts bytes, it can go negative to
+ * make the next bulk operation wait.  */
+struct bus_sched {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t owner;
+	unsigned depth;
+	unsigned waiting[I2CDEV_NB_PRIOS];
+	uint8_t held[ADDR_MAP_SIZE];
+	int parked;
+	int resuming;
+	int yielding;
+	pthread_t parked_owner;
+	unsigned parked_depth;
+	uint8_t parked_held[ADDR_MAP_SIZE];
+	long bulk_rate;
+	long bulk_burst;
+	long long bulk_tokens;
+	long long bulk_time_us;
+};
 
-struct i2cdev {
+/* All the i2cdev instances on a given bus share the same file descriptor and
+ * scratch buffer.  I2C_RDWR transfers have an explicit address, the slave
+ * address is only set on the descriptor for SMBus transfers and cached to
+ * avoid redundant I2C_SLAVE calls (-1 when not known).  The scratch
+ * buffer never shrinks, it is only used when the adapter can't send the
+ * register and the data from separate buffers (I2C_FUNC_NOSTART).  The bus
+ * lock can't be parked while a transfer uses it (block_busy).  */
+struct i2cdev_bus {
+	struct i2cdev_bus *next;
+	char *path;
+	dev_t rdev;
 	int fd;
+	const struct i2cdev_bus_ops *ops;
+	void *priv;
+	unsigned long funcs;
+	int slave;
+	unsigned refcount;
+	struct bus_sched sched;
+	uint8_t *block;
+	size_t block_size;
+	int block_busy;
+	struct i2cdev_async *async;
+	struct i2cdev_stats stats;
+};
+
+/* Write-combining buffer: pending values of single-byte registers, sent
+ * as runs of adjacent dirty registers on flush.  */
+#define WC_NB_REGS 256
+
+struct i2cdev_wc {
+	unsigned depth;
+	uint8_t data[WC_NB_REGS];
+	uint8_t dirty[WC_NB_REGS / 8];
+};
+
+/* Bounded multi-producer, single-consumer ring of submitted transactions.
+ * Each slot has a sequence number to tell whether it is free (seq == pos),
+ * or holds a transaction ready to be consumed (seq == pos + 1).  The bus
+ * async pointer and refs are protected by the bus scheduler mutex: the bus
+ * has one reference until the worker is stopped and each thread in
+ * i2cdev_txn_wait has one, the last one frees it.  */
+struct async_slot {
+	unsigned seq;
+	struct i2cdev_txn *txn;
+};
+
+struct i2cdev_async {
+	pthread_t thread;
+	sem_t sem;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int efd;
+	unsigned users;
+	unsigned refs;
+	int stop;
+	unsigned head;
+	unsigned tail;
+	struct async_slot ring[ASYNC_RING_SIZE];
+};
+
+struct i2cdev {
+	struct i2cdev_bus *bus;
 	char addr;
 	struct {
 		uint8_t verbose_log:1;
 		uint8_t ignore_read_nak:1;
 		uint8_t ignore_write_nak:1;
+		uint8_t async:1;
+		uint8_t force_rdwr:1;
+		uint8_t no_smbus:1;
+		uint8_t trace:1;
+		uint8_t quiet:1;
+		uint8_t in_place:1;
 	} flags;
-	uint8_t *block;
-	size_t block_size;
-	struct plconfig *config;
+	struct plhw_config *config;
+	struct i2cdev_stats stats;
+	struct i2cdev_reg_stats *reg_stats;
+	enum i2cdev_prio prio;
+	struct i2cdev_retry_policy retry;
+	unsigned n_failures;      /* consecutive NAKs or timeouts */
+	long long breaker_until;  /* open until this time in us, or 0 */
+	struct i2cdev_wc *wc;
+};
+
+static struct i2cdev_bus *bus_list = NULL;
+static pthread_mutex_t bus_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct i2cdev_bus_ops * const bus_transports[] = {
+	&i2creplay_ops,
+	&i2csim_ops,
+	NULL
+};
+
+/* Records the transfers on all the buses when i2c-record is set, opened
+ * with the first bus and closed with the last one. */
+static struct i2crec *recorder = NULL;
+
+/* Process-wide trace ring, written by all the buses without locking.  The
+ * slot sequence number is pos + 1 once the record at position pos has been
+ * written, and 0 while it is being written.  */
+struct trace_slot {
+	unsigned long seq;
+	struct i2cdev_trace_rec rec;
+};
+
+static struct trace_slot trace_ring[I2CDEV_TRACE_SIZE];
+static unsigned long trace_head = 0;
+
+/* One I2C message queued in a transaction.  The buffer is either owned by
+ * the caller (reads) or stored in the transaction data area (writes), in
+ * which case only the offset is kept as the data area may be reallocated. */
+struct txn_msg {
+	struct i2cdev *dev;
+	__u16 flags;
+	__u16 len;
+	void *buf;
+	size_t offset;
+};
+
+/* One operation, i.e. a group of messages which must stay together in the
+ * same I2C_RDWR call to use repeated start conditions. */
+struct txn_op {
+	unsigned first_msg;
+	unsigned n_msgs;
+	int result;
+};
+
+struct i2cdev_txn {
+	struct i2cdev *dev;
+	enum i2cdev_prio prio;
+	struct txn_msg *msgs;
+	size_t n_msgs;
+	size_t msgs_size;
+	struct txn_op *ops;
+	size_t n_ops;
+	size_t ops_size;
+	uint8_t *data;
+	size_t data_len;
+	size_t data_size;
+	i2cdev_txn_cb_t cb;
+	void *cb_ctx;
+	struct i2cdev_async *async;
+	int async_state;
+	int async_result;
 };
 
+enum txn_async_state {
+	TXN_IDLE = 0,
+	TXN_PENDING,
+	TXN_DONE,
+};
+
+static int dev_init(struct i2cdev *d, const char *bus_device, char address);
+static struct i2cdev_bus *get_bus(const char *path,
+				  struct plhw_config *config);
+static void put_bus(struct i2cdev_bus *bus);
+static void bus_lock_prio(struct i2cdev_bus *bus, enum i2cdev_prio prio,
+			  const uint8_t *addrs);
+static void bus_yield(struct bus_sched *s, const uint8_t *addrs);
+static int higher_prio_waiting(const struct bus_sched *s,
+			       enum i2cdev_prio prio);
+static void dev_lock_prio(struct i2cdev *d, enum i2cdev_prio prio);
+static void bus_lock(struct i2cdev *d);
+static void bus_unlock(struct i2cdev_bus *bus);
+static int bus_park(struct i2cdev_bus *bus);
+static void bus_resume(struct i2cdev_bus *bus);
+static void addr_map_set(uint8_t *map, char addr);
+static int addr_map_overlap(const uint8_t *a, const uint8_t *b);
+static void bus_throttle(struct i2cdev_bus *bus, enum i2cdev_prio prio,
+			 size_t size);
+static void set_adapter_tuning(int fd, struct plhw_config *config);
+static int transfer(struct i2cdev *d, int reg, struct i2c_msg *msgs,
+		    unsigned n);
+static int can_retry(const struct i2c_msg *msgs, unsigned n, int ret);
+static unsigned long stats_update(struct i2cdev *d, int reg, size_t rd,
+				  size_t wr, int ret,
+				  const struct timespec *t0);
+static void stats_count_ioctl(struct i2cdev *d);
+static void trace_io(struct i2cdev *d, uint8_t flags, int reg,
+		     const void *data, size_t len, int ret,
+		     const struct timespec *t0, unsigned long us);
+static void set_reg_stats(struct i2cdev *d, int enable);
+static enum i2cdev_error error_class(int ret);
+static long long now_us(void);
+static int breaker_check(struct i2cdev *d);
+static void breaker_update(struct i2cdev *d, int ret);
+static int retry_wait(struct i2cdev *d, int ret, unsigned attempt);
+static int wc_is_active(const struct i2cdev *d, const uint8_t *reg,
+			size_t reg_sz, size_t size);
+static void wc_store(struct i2cdev_wc *wc, uint8_t reg,
+		     const struct iovec *iov, unsigned iovcnt);
+static void wc_overlay(const struct i2cdev_wc *wc, uint8_t reg, uint8_t *data,
+		       size_t size);
+static int wc_send(struct i2cdev *d);
+static int wc_send_pending(struct i2cdev *d);
 static int rdwr_data(struct i2cdev *d, __u16 flags, void *data, size_t size);
 static int read_reg_data(struct i2cdev *d, uint8_t *reg, size_t reg_sz,
 			 void *buffer, size_t buffer_sz);
-static int write_reg_data(struct i2cdev *d, uint8_t *reg, size_t reg_sz,
-			  const void *buf, size_t buf_sz);
-static void print_data(const void *data, size_t size);
-static void print_reg_io(const char *label, uint8_t addr, const uint8_t *reg,
-			 size_t reg_sz, const void *buf, size_t buf_sz,
-			 int local_errno);
+static int write_reg_iov(struct i2cdev *d, const uint8_t *reg, size_t reg_sz,
+			 const struct iovec *iov, unsigned iovcnt);
+static int grow_block(struct i2cdev_bus *bus, size_t size);
+static int smbus_size(const struct i2cdev *d, size_t reg_sz, size_t size,
+		      char rw);
+static int smbus_reg_io(struct i2cdev *d, char rw, uint8_t reg, int size,
+			void *buf, size_t buf_sz);
+static int txn_add_op(struct i2cdev_txn *t, unsigned n_msgs);
+static int txn_add_msg(struct i2cdev_txn *t, struct i2cdev *d, __u16 flags,
+		       void *buf, const void *data, size_t size);
+static void txn_rollback(struct i2cdev_txn *t, size_t n_msgs);
+static int txn_commit_chunk(struct i2cdev_txn *t, size_t first_op,
+			    size_t n_ops);
+static int async_push(struct i2cdev_async *async, struct i2cdev_txn *t);
+static struct i2cdev_txn *async_pop(struct i2cdev_async *async);
+static void *async_worker(void *arg);
+static void async_put(struct i2cdev_bus *bus, struct i2cdev_async *async);
 
 struct i2cdev *i2cdev_init(const char *bus_device, char address)
 {
@@ -80,61 +340,52 @@ struct i2cdev *i2cdev_init(const char *bus_device, char address)
 	if (d == NULL)
 		return NULL;
 
-	d->config = plconfig_init(NULL, "libplhw");
+	if (dev_init(d, bus_device, address)) {
+		free(d);
+		return NULL;
+	}
 
-	if (d->config == NULL)
-		goto err_free_i2cdev;
+	d->flags.in_place = 0;
 
-	if (bus_device == NULL)
-		bus_device = plconfig_get_str(d->config, "i2c-bus", NULL);
+	return d;
+}
 
-	if (bus_device == NULL) {
-		LOG("no I2C bus specified");
-		goto err_free_plconfig;
-	}
+size_t i2cdev_size(void)
+{
+	return PLHW_ALIGN(sizeof (struct i2cdev));
+}
 
-	d->addr = address;
-	d->fd = open(bus_device, O_RDWR);
+struct i2cdev *i2cdev_init_at(void *mem, const char *bus_device,
+			      char address)
+{
+	struct i2cdev *d = mem;
 
-	if (d->fd < 0) {
-		LOG("failed to open I2C bus device (%s)", bus_device);
-		goto err_free_plconfig;
-	}
+	assert(mem != NULL);
+	assert(!(address & 0x80));
 
-	if (ioctl(d->fd, I2C_SLAVE, d->addr) < 0) {
-		LOG("failed to set I2C address (0x%02X)", d->addr);
-		goto err_close_fd;
-	}
+	if (dev_init(d, bus_device, address))
+		return NULL;
 
-	d->flags.verbose_log = 0;
-	d->flags.ignore_read_nak = 0;
-	d->flags.ignore_write_nak = 0;
-	d->block = NULL;
-	d->block_size = 0;
+	d->flags.in_place = 1;
 
 	return d;
-
-err_close_fd:
-	close(d->fd);
-err_free_plconfig:
-	plconfig_free(d->config);
-err_free_i2cdev:
-	free(d);
-
-	return NULL;
 }
 
 void i2cdev_free(struct i2cdev *d)
 {
 	assert(d != NULL);
+	assert((d->wc == NULL) || !d->wc->depth);
 
-	close(d->fd);
-	plconfig_free(d->config);
+	if (d->flags.async)
+		i2cdev_async_stop(d);
 
-	if (d->block != NULL)
-		free(d->block);
+	put_bus(d->bus);
+	plhw_config_put(d->config);
+	free(d->reg_stats);
+	free(d->wc);
 
-	free(d);
+	if (!d->flags.in_place)
+		free(d);
 }
 
 void i2cdev_set_flag(struct i2cdev *d, enum i2cdev_flag f, int enable)
@@ -147,10 +398,44 @@ void i2cdev_set_flag(struct i2cdev *d, enum i2cdev_flag f, int enable)
 	case I2CDEV_IGNORE_READ_NAK:   d->flags.ignore_read_nak = on;   break;
 	case I2CDEV_IGNORE_WRITE_NAK:  d->flags.ignore_write_nak = on;  break;
 	case I2CDEV_VERBOSE_LOG:       d->flags.verbose_log = on;       break;
+	case I2CDEV_FORCE_RDWR:        d->flags.force_rdwr = on;        break;
+	case I2CDEV_REG_STATS:         set_reg_stats(d, on);            break;
+	case I2CDEV_TRACE:             d->flags.trace = on;             break;
+	case I2CDEV_QUIET:             d->flags.quiet = on;             break;
 	default: assert(!"Invalid flag id"); break;
 	}
 }
 
+void i2cdev_set_prio(struct i2cdev *d, enum i2cdev_prio prio)
+{
+	assert(d != NULL);
+	assert(prio < I2CDEV_NB_PRIOS);
+
+	d->prio = prio;
+}
+
+void i2cdev_lock(struct i2cdev *d)
+{
+	assert(d != NULL);
+
+	bus_lock(d);
+}
+
+void i2cdev_lock_prio(struct i2cdev *d, enum i2cdev_prio prio)
+{
+	assert(d != NULL);
+	assert(prio < I2CDEV_NB_PRIOS);
+
+	dev_lock_prio(d, prio);
+}
+
+void i2cdev_unlock(struct i2cdev *d)
+{
+	assert(d != NULL);
+
+	bus_unlock(d->bus);
+}
+
 int i2cdev_read(struct i2cdev *d, void *data, size_t size)
 {
         __u16 i2c_flags = I2C_M_RD;
@@ -198,166 +483,2238 @@ int i2cdev_read_reg8(struct i2cdev *d, char reg, void *data, size_t sz)
 int i2cdev_write_reg(struct i2cdev *d, const void *reg, size_t reg_sz,
 		     const void *data, size_t data_sz)
 {
+	const struct iovec iov = { (void *) data, data_sz };
+
 	assert(d != NULL);
 	assert(reg != NULL);
 	assert(data != NULL);
 
-	return write_reg_data(d, (uint8_t *) reg, reg_sz, data, data_sz);
+	return write_reg_iov(d, reg, reg_sz, &iov, 1);
 }
 
 int i2cdev_write_reg8(struct i2cdev *d, char reg, const void *data, size_t sz)
 {
+	const struct iovec iov = { (void *) data, sz };
+
 	assert(d != NULL);
 	assert(data != NULL);
 
-	return write_reg_data(d, (uint8_t *) &reg, 1, data, sz);
+	return write_reg_iov(d, (uint8_t *) &reg, 1, &iov, 1);
 }
 
-/* ----------------------------------------------------------------------------
- * static functions
- */
+int i2cdev_write_regv(struct i2cdev *d, const void *reg, size_t reg_sz,
+		      const struct iovec *iov, unsigned iovcnt)
+{
+	assert(d != NULL);
+	assert(reg != NULL);
+	assert(iov != NULL);
+	assert(iovcnt <= I2CDEV_MAX_IOV);
 
-static int rdwr_data(struct i2cdev *d, __u16 flags, void *data, size_t size)
+	return write_reg_iov(d, reg, reg_sz, iov, iovcnt);
+}
+
+int i2cdev_write_reg_hr(struct i2cdev *d, const void *reg, size_t reg_sz,
+			void *frame, size_t data_sz)
 {
-	struct i2c_msg msgs[1] = {
-		{
-			.addr = d->addr,
-			.flags = flags,
-			.len = size,
-			.buf = (__u8 *) data
-		}
-	};
+	uint8_t * const buf = frame;
+	const struct iovec iov = { buf + reg_sz, data_sz };
+	struct i2c_msg msg;
+	int ret;
 
-	struct i2c_rdwr_ioctl_data i2c_data = {
-		.msgs = msgs,
-		.nmsgs = 1
-	};
+	assert(d != NULL);
+	assert(reg != NULL);
+	assert(frame != NULL);
+
+	memcpy(buf, reg, reg_sz);
+	msg.addr = d->addr;
+	msg.flags = d->flags.ignore_write_nak ? I2C_M_IGNORE_NAK : 0;
+	msg.len = reg_sz + data_sz;
+	msg.buf = buf;
+
+	bus_throttle(d->bus, d->prio, msg.len);
+	bus_lock(d);
+
+	/* Combined and SMBus writes go through the common path, which keeps
+	 * them in order with the pending combined writes */
+	if (wc_is_active(d, buf, reg_sz, data_sz)
+	    || (smbus_size(d, reg_sz, data_sz, I2C_SMBUS_WRITE) >= 0)) {
+		ret = write_reg_iov(d, buf, reg_sz, &iov, 1);
+		goto exit_unlock;
+	}
 
-	int ret = (ioctl(d->fd, I2C_RDWR, &i2c_data) < 0) ? -1 : 0;
+	ret = wc_send_pending(d);
 
-	if (ret || d->flags.verbose_log) {
-		if (ret)
-			ret = -errno;
+	if (!ret)
+		ret = transfer(d, (reg_sz == 1) ? buf[0] : -1, &msg, 1);
 
-		LOG_N("%s (addr: 0x%02X, size: %zu:",
-		      flags & I2C_M_RD ? "read" : "write", d->addr, size);
-		print_data(data, size);
-		LOG_PRINT(") -> %s\n", ret ? strerror(-ret) : "OK");
-	}
+exit_unlock:
+	bus_unlock(d->bus);
 
 	return ret;
 }
 
-static int read_reg_data(struct i2cdev *d, uint8_t *reg, size_t reg_sz,
-			 void *buf, size_t buf_sz)
+int i2cdev_wc_begin(struct i2cdev *d)
 {
-	struct i2c_msg msgs[2] = {
-		{
-			.addr = d->addr,
-			.flags = 0,
-			.len = reg_sz,
-			.buf = reg
-		},
-		{
-			.addr = d->addr,
-			.flags = I2C_M_RD
-			 | (d->flags.ignore_read_nak ? I2C_M_IGNORE_NAK : 0),
-			.len = buf_sz,
-			.buf = (__u8 *) buf
+	assert(d != NULL);
+
+	bus_lock(d);
+
+	if (d->wc == NULL) {
+		d->wc = malloc(sizeof (struct i2cdev_wc));
+
+		if (d->wc == NULL) {
+			bus_unlock(d->bus);
+			return -1;
 		}
-	};
 
-	struct i2c_rdwr_ioctl_data i2c_data = {
-		.msgs = msgs,
-		.nmsgs = 2
-	};
+		d->wc->depth = 0;
+		memset(d->wc->dirty, 0, sizeof d->wc->dirty);
+	}
 
-	int ret = (ioctl(d->fd, I2C_RDWR, &i2c_data) < 0) ? -1 : 0;
+	++d->wc->depth;
 
-	if (ret || d->flags.verbose_log) {
-		if (ret)
-			ret = -errno;
+	return 0;
+}
+
+int i2cdev_wc_flush(struct i2cdev *d)
+{
+	int ret = 0;
+
+	assert(d != NULL);
+	assert(d->wc != NULL);
+	assert(d->wc->depth);
+
+	if (!--d->wc->depth)
+		ret = wc_send(d);
+
+	bus_unlock(d->bus);
+
+	return ret;
+}
+
+int i2cdev_reserve(struct i2cdev *d, size_t size)
+{
+	int ret;
+
+	assert(d != NULL);
+
+	bus_lock(d);
+	ret = grow_block(d->bus, size);
+	bus_unlock(d->bus);
+
+	return ret;
+}
+
+int i2cdev_can_scatter(struct i2cdev *d)
+{
+	assert(d != NULL);
+
+	return (d->bus->funcs & I2C_FUNC_NOSTART) ? 1 : 0;
+}
+
+unsigned long i2cdev_get_funcs(struct i2cdev *d)
+{
+	assert(d != NULL);
+
+	return d->bus->funcs;
+}
+
+enum i2cdev_transport i2cdev_get_transport(struct i2cdev *d, size_t reg_sz,
+					   size_t data_sz, int write)
+{
+	const char rw = write ? I2C_SMBUS_WRITE : I2C_SMBUS_READ;
+
+	assert(d != NULL);
+
+	if (smbus_size(d, reg_sz, data_sz, rw) < 0)
+		return I2CDEV_TRANSPORT_RDWR;
+
+	return I2CDEV_TRANSPORT_SMBUS;
+}
 
-		print_reg_io("read reg data", d->addr, reg, reg_sz, buf,
-			     buf_sz, -ret);
+void i2cdev_get_stats(struct i2cdev *d, struct i2cdev_stats *stats)
+{
+	assert(d != NULL);
+	assert(stats != NULL);
+
+	bus_lock(d);
+	memcpy(stats, &d->stats, sizeof *stats);
+	bus_unlock(d->bus);
+}
+
+int i2cdev_get_reg_stats(struct i2cdev *d, uint8_t reg,
+			 struct i2cdev_reg_stats *stats)
+{
+	int ret;
+
+	assert(d != NULL);
+	assert(stats != NULL);
+
+	bus_lock(d);
+
+	if (d->reg_stats == NULL) {
+		ret = -1;
+	} else {
+		memcpy(stats, &d->reg_stats[reg], sizeof *stats);
+		ret = 0;
 	}
 
+	bus_unlock(d->bus);
+
 	return ret;
 }
 
-static int write_reg_data(struct i2cdev *d, uint8_t *reg, size_t reg_sz,
-			  const void *buf, size_t buf_sz)
+void i2cdev_reset_stats(struct i2cdev *d)
 {
-	const size_t w_size = buf_sz + reg_sz;
+	assert(d != NULL);
 
-	struct i2c_msg msg = {
-		.addr = d->addr,
-		.flags = d->flags.ignore_write_nak ? I2C_M_IGNORE_NAK : 0,
-		.len = w_size,
-	};
+	bus_lock(d);
+	memset(&d->stats, 0, sizeof d->stats);
 
-	struct i2c_rdwr_ioctl_data i2c_data = {
-		.msgs = &msg,
-		.nmsgs = 1
-	};
+	if (d->reg_stats != NULL)
+		memset(d->reg_stats, 0, 256 * sizeof (*d->reg_stats));
 
-	size_t block_size;
+	bus_unlock(d->bus);
+}
+
+void i2cdev_get_retry_policy(struct i2cdev *d,
+			     struct i2cdev_retry_policy *policy)
+{
+	assert(d != NULL);
+	assert(policy != NULL);
+
+	bus_lock(d);
+	memcpy(policy, &d->retry, sizeof *policy);
+	bus_unlock(d->bus);
+}
+
+void i2cdev_set_retry_policy(struct i2cdev *d,
+			     const struct i2cdev_retry_policy *policy)
+{
+	assert(d != NULL);
+	assert(policy != NULL);
+
+	bus_lock(d);
+	memcpy(&d->retry, policy, sizeof d->retry);
+	bus_unlock(d->bus);
+}
+
+int i2cdev_breaker_is_open(struct i2cdev *d)
+{
 	int ret;
 
-	block_size = w_size;
+	assert(d != NULL);
+
+	bus_lock(d);
+	ret = (d->breaker_until && (now_us() < d->breaker_until)) ? 1 : 0;
+	bus_unlock(d->bus);
 
-	if (!(block_size % BLOCK_SIZE_STEP))
-		--block_size;
+	return ret;
+}
 
-	block_size /= BLOCK_SIZE_STEP;
-	++block_size;
-	block_size *= BLOCK_SIZE_STEP;
+void i2cdev_breaker_reset(struct i2cdev *d)
+{
+	assert(d != NULL);
 
-	if (d->block == NULL)
-		d->block = malloc(block_size);
-	else if (d->block_size < block_size)
-		d->block = realloc(d->block, block_size);
+	bus_lock(d);
+	d->n_failures = 0;
+	d->breaker_until = 0;
+	bus_unlock(d->bus);
+}
 
-	if (d->block == NULL)
-		return -1;
+void i2cdev_get_bus_stats(struct i2cdev *d, struct i2cdev_stats *stats)
+{
+	assert(d != NULL);
+	assert(stats != NULL);
 
-	d->block_size = block_size;
-	memcpy(d->block, reg, reg_sz);
-	memcpy(d->block + reg_sz, buf, buf_sz);
-	msg.buf = (__u8 *) d->block;
+	bus_lock(d);
+	memcpy(stats, &d->bus->stats, sizeof *stats);
+	bus_unlock(d->bus);
+}
 
-	ret = (ioctl(d->fd, I2C_RDWR, &i2c_data) < 0) ? -1 : 0;
+size_t i2cdev_trace_read(unsigned long *cursor, struct i2cdev_trace_rec *recs,
+			size_t n)
+{
+	const unsigned long head = __atomic_load_n(&trace_head,
+						   __ATOMIC_ACQUIRE);
+	unsigned long pos;
+	size_t count = 0;
 
-	if (ret || d->flags.verbose_log) {
-		if (ret)
-			ret = -errno;
+	assert(cursor != NULL);
+	assert(recs != NULL);
+
+	pos = *cursor;
+
+	if ((head - pos) > I2CDEV_TRACE_SIZE)
+		pos = head - I2CDEV_TRACE_SIZE;
+
+	for (; (pos != head) && (count < n); ++pos) {
+		const struct trace_slot *slot =
+			&trace_ring[pos & (I2CDEV_TRACE_SIZE - 1)];
+		unsigned long seq;
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
 
-		print_reg_io("write reg data", d->addr, reg, reg_sz, buf,
-			     buf_sz, -ret);
+		if ((long) (seq - (pos + 1)) < 0)
+			break; /* still being written */
+
+		if (seq != (pos + 1))
+			continue; /* already overwritten */
+
+		memcpy(&recs[count], &slot->rec, sizeof recs[count]);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			++count;
 	}
 
-	return ret;
+	*cursor = pos;
+
+	return count;
+}
+
+int i2cdev_trace_format(const struct i2cdev_trace_rec *rec, char *str,
+			size_t size)
+{
+	size_t len;
+	unsigned n;
+	unsigned i;
+
+	assert(rec != NULL);
+	assert(str != NULL);
+
+	n = (rec->len < I2CDEV_TRACE_DATA_SIZE) ?
+		rec->len : I2CDEV_TRACE_DATA_SIZE;
+
+	len = snprintf(str, size, "%5lu.%06lu %s%s (addr: 0x%02X",
+		       (unsigned long) (rec->timestamp / 1000000000ULL),
+		       (unsigned long) (rec->timestamp % 1000000000ULL) / 1000,
+		       (rec->flags & I2CDEV_TRACE_SMBUS) ? "smbus " :
+		       (rec->flags & I2CDEV_TRACE_TXN) ? "txn " : "",
+		       (rec->flags & I2CDEV_TRACE_READ) ? "read" : "write",
+		       rec->addr);
+
+	if ((len < size) && (rec->flags & I2CDEV_TRACE_REG))
+		len += snprintf(&str[len], size - len, ", reg: %02X",
+				rec->reg);
+
+	if (len < size)
+		len += snprintf(&str[len], size - len, ", size: %u:",
+				rec->len);
+
+	for (i = 0; (i < n) && (len < size); ++i)
+		len += snprintf(&str[len], size - len, " %02X",
+				rec->data[i]);
+
+	if (len < size)
+		len += snprintf(&str[len], size - len, ") -> %s, %u us",
+				rec->result ? strerror(-rec->result) : "OK",
+				rec->duration_us);
+
+	return (len < size) ? 0 : -1;
+}
+
+void i2cdev_trace_dump(void)
+{
+	struct i2cdev_trace_rec recs[16];
+	unsigned long cursor = 0;
+	size_t n;
+
+	while ((n = i2cdev_trace_read(&cursor, recs, 16))) {
+		char str[I2CDEV_TRACE_STR_SIZE];
+		size_t i;
+
+		for (i = 0; i < n; ++i) {
+			i2cdev_trace_format(&recs[i], str, sizeof str);
+			LOG("%s", str);
+		}
+	}
+}
+
+const char *i2cdev_transport_str(enum i2cdev_transport transport)
+{
+	switch (transport) {
+	case I2CDEV_TRANSPORT_RDWR:  return "rdwr";
+	case I2CDEV_TRANSPORT_SMBUS: return "smbus";
+	}
+
+	return "unknown";
+}
+
+/* ----------------------------------------------------------------------------
+ * transactions
+ */
+
+struct i2cdev_txn *i2cdev_txn_begin(struct i2cdev *d)
+{
+	struct i2cdev_txn *t;
+
+	assert(d != NULL);
+
+	t = malloc(sizeof (struct i2cdev_txn));
+
+	if (t == NULL)
+		return NULL;
+
+	t->dev = d;
+	t->prio = d->prio;
+	t->msgs = NULL;
+	t->n_msgs = 0;
+	t->msgs_size = 0;
+	t->ops = NULL;
+	t->n_ops = 0;
+	t->ops_size = 0;
+	t->data = NULL;
+	t->data_len = 0;
+	t->data_size = 0;
+	t->cb = NULL;
+	t->cb_ctx = NULL;
+	t->async = NULL;
+	t->async_state = TXN_IDLE;
+	t->async_result = 0;
+
+	return t;
 }
 
-static void print_data(const void *data, size_t size)
+void i2cdev_txn_set_prio(struct i2cdev_txn *t, enum i2cdev_prio prio)
 {
-	static const size_t MAX_DUMP = 8;
-	const unsigned n = (size < MAX_DUMP) ? size : MAX_DUMP;
-	const uint8_t * const data8 = (const uint8_t *) data;
-	const uint8_t * const end = &data8[n];
-	const uint8_t *it = &data8[0];
+	assert(t != NULL);
+	assert(prio < I2CDEV_NB_PRIOS);
 
-	while (it != end)
-		LOG_PRINT(" %02X", *it++);
+	t->prio = prio;
 }
 
-static void print_reg_io(const char *label, uint8_t addr, const uint8_t *reg,
-			 size_t reg_sz, const void *buf, size_t buf_sz,
-			 int local_errno)
+void i2cdev_txn_reset(struct i2cdev_txn *t)
 {
-	LOG_N("%s (addr: 0x%02X, reg:", label, addr);
-	print_data(reg, reg_sz);
-	LOG_PRINT(", size: %zu:", buf_sz);
-	print_data(buf, buf_sz);
-	LOG_PRINT(") -> %s\n", local_errno ? strerror(local_errno) : "OK");
+	assert(t != NULL);
+	assert(!i2cdev_txn_is_pending(t));
+
+	t->n_msgs = 0;
+	t->n_ops = 0;
+	t->data_len = 0;
+}
+
+void i2cdev_txn_free(struct i2cdev_txn *t)
+{
+	assert(t != NULL);
+	assert(!i2cdev_txn_is_pending(t));
+
+	free(t->msgs);
+	free(t->ops);
+	free(t->data);
+	free(t);
+}
+
+size_t i2cdev_txn_get_nb_ops(const struct i2cdev_txn *t)
+{
+	assert(t != NULL);
+
+	return t->n_ops;
+}
+
+int i2cdev_txn_add_read(struct i2cdev_txn *t, struct i2cdev *d, void *data,
+			size_t size)
+{
+	__u16 flags;
+
+	assert(t != NULL);
+	assert(d != NULL);
+	assert(data != NULL);
+
+	flags = I2C_M_RD | (d->flags.ignore_read_nak ? I2C_M_IGNORE_NAK : 0);
+
+	if (txn_add_msg(t, d, flags, data, NULL, size))
+		return -1;
+
+	return txn_add_op(t, 1);
+}
+
+int i2cdev_txn_add_write(struct i2cdev_txn *t, struct i2cdev *d,
+			 const void *data, size_t size)
+{
+	__u16 flags;
+
+	assert(t != NULL);
+	assert(d != NULL);
+	assert(data != NULL);
+
+	flags = d->flags.ignore_write_nak ? I2C_M_IGNORE_NAK : 0;
+
+	if (txn_add_msg(t, d, flags, NULL, data, size))
+		return -1;
+
+	return txn_add_op(t, 1);
+}
+
+int i2cdev_txn_add_read_reg(struct i2cdev_txn *t, struct i2cdev *d,
+			    const void *reg, size_t reg_sz,
+			    void *data, size_t data_sz)
+{
+	__u16 flags;
+	size_t n_msgs;
+
+	assert(t != NULL);
+	assert(d != NULL);
+	assert(reg != NULL);
+	assert(data != NULL);
+
+	flags = I2C_M_RD | (d->flags.ignore_read_nak ? I2C_M_IGNORE_NAK : 0);
+	n_msgs = t->n_msgs;
+
+	if (txn_add_msg(t, d, 0, NULL, reg, reg_sz) ||
+	    txn_add_msg(t, d, flags, data, NULL, data_sz)) {
+		txn_rollback(t, n_msgs);
+		return -1;
+	}
+
+	return txn_add_op(t, 2);
+}
+
+int i2cdev_txn_add_read_reg8(struct i2cdev_txn *t, struct i2cdev *d,
+			     char reg, void *data, size_t sz)
+{
+	return i2cdev_txn_add_read_reg(t, d, &reg, 1, data, sz);
+}
+
+int i2cdev_txn_add_write_reg(struct i2cdev_txn *t, struct i2cdev *d,
+			     const void *reg, size_t reg_sz,
+			     const void *data, size_t data_sz)
+{
+	__u16 flags;
+	size_t n_msgs;
+
+	assert(t != NULL);
+	assert(d != NULL);
+	assert(reg != NULL);
+	assert(data != NULL);
+
+	/* both are sent as one message, which has a 16-bit length */
+	if ((reg_sz + data_sz) > UINT16_MAX) {
+		LOG("write too long for one message (%zu)", reg_sz + data_sz);
+		return -1;
+	}
+
+	flags = d->flags.ignore_write_nak ? I2C_M_IGNORE_NAK : 0;
+	n_msgs = t->n_msgs;
+
+	if (txn_add_msg(t, d, flags, NULL, reg, reg_sz) ||
+	    txn_add_msg(t, d, flags, NULL, data, data_sz)) {
+		txn_rollback(t, n_msgs);
+		return -1;
+	}
+
+	/* The data is stored right after the register bytes in the
+	 * transaction data area, so both can be sent as a single message. */
+	t->msgs[n_msgs].len += data_sz;
+	--t->n_msgs;
+
+	return txn_add_op(t, 1);
+}
+
+int i2cdev_txn_add_write_reg8(struct i2cdev_txn *t, struct i2cdev *d,
+			      char reg, const void *data, size_t sz)
+{
+	return i2cdev_txn_add_write_reg(t, d, &reg, 1, data, sz);
+}
+
+int i2cdev_txn_commit(struct i2cdev_txn *t)
+{
+	uint8_t addrs[ADDR_MAP_SIZE];
+	size_t first_op;
+	size_t op;
+	size_t chunk_msgs;
+	size_t size = 0;
+	size_t i;
+	int ret = 0;
+
+	assert(t != NULL);
+
+	memset(addrs, 0, sizeof addrs);
+	addr_map_set(addrs, t->dev->addr);
+
+	for (i = 0; i < t->n_msgs; ++i) {
+		size += t->msgs[i].len;
+		addr_map_set(addrs, t->msgs[i].dev->addr);
+	}
+
+	bus_throttle(t->dev->bus, t->prio, size);
+	bus_lock_prio(t->dev->bus, t->prio, addrs);
+	first_op = 0;
+	chunk_msgs = 0;
+
+	for (op = 0; op < t->n_ops; ++op) {
+		const unsigned n_msgs = t->ops[op].n_msgs;
+
+		if ((chunk_msgs + n_msgs) > I2C_RDWR_IOCTL_MAX_MSGS) {
+			const int stat =
+				txn_commit_chunk(t, first_op, (op - first_op));
+
+			if (stat && !ret)
+				ret = stat;
+
+			first_op = op;
+			chunk_msgs = 0;
+		}
+
+		chunk_msgs += n_msgs;
+	}
+
+	if (op != first_op) {
+		const int stat = txn_commit_chunk(t, first_op, (op - first_op));
+
+		if (stat && !ret)
+			ret = stat;
+	}
+
+	bus_unlock(t->dev->bus);
+
+	return ret;
+}
+
+int i2cdev_txn_get_result(const struct i2cdev_txn *t, unsigned op)
+{
+	assert(t != NULL);
+	assert(op < t->n_ops);
+
+	return t->ops[op].result;
+}
+
+/* ----------------------------------------------------------------------------
+ * asynchronous transactions
+ */
+
+int i2cdev_async_start(struct i2cdev *d)
+{
+	struct i2cdev_bus *bus;
+	struct i2cdev_async *async;
+	unsigned i;
+	int ret = -1;
+
+	assert(d != NULL);
+
+	bus = d->bus;
+	bus_lock(d);
+
+	if (d->flags.async) {
+		ret = 0;
+		goto exit_unlock;
+	}
+
+	if (bus->async != NULL) {
+		++bus->async->users;
+		d->flags.async = 1;
+		ret = 0;
+		goto exit_unlock;
+	}
+
+	async = malloc(sizeof (struct i2cdev_async));
+
+	if (async == NULL)
+		goto exit_unlock;
+
+	memset(async, 0, sizeof (struct i2cdev_async));
+	async->efd = eventfd(0, EFD_NONBLOCK);
+
+	if (async->efd < 0) {
+		LOG("failed to create eventfd");
+		goto err_free_async;
+	}
+
+	if (sem_init(&async->sem, 0, 0))
+		goto err_close_efd;
+
+	pthread_mutex_init(&async->mutex, NULL);
+	pthread_cond_init(&async->cond, NULL);
+
+	for (i = 0; i < ASYNC_RING_SIZE; ++i)
+		async->ring[i].seq = i;
+
+	async->users = 1;
+	async->refs = 1;
+
+	if (pthread_create(&async->thread, NULL, async_worker, async)) {
+		LOG("failed to create worker thread");
+		goto err_destroy;
+	}
+
+	pthread_mutex_lock(&bus->sched.mutex);
+	bus->async = async;
+	pthread_mutex_unlock(&bus->sched.mutex);
+	d->flags.async = 1;
+	bus_unlock(bus);
+
+	return 0;
+
+err_destroy:
+	pthread_cond_destroy(&async->cond);
+	pthread_mutex_destroy(&async->mutex);
+	sem_destroy(&async->sem);
+err_close_efd:
+	close(async->efd);
+err_free_async:
+	free(async);
+exit_unlock:
+	bus_unlock(bus);
+
+	return ret;
+}
+
+void i2cdev_async_stop(struct i2cdev *d)
+{
+	struct i2cdev_async *async;
+
+	assert(d != NULL);
+
+	bus_lock(d);
+
+	if (!d->flags.async) {
+		bus_unlock(d->bus);
+		return;
+	}
+
+	d->flags.async = 0;
+	async = d->bus->async;
+
+	if (--async->users) {
+		bus_unlock(d->bus);
+		return;
+	}
+
+	/* No more transactions can be submitted after this */
+	pthread_mutex_lock(&d->bus->sched.mutex);
+	d->bus->async = NULL;
+	pthread_mutex_unlock(&d->bus->sched.mutex);
+	bus_unlock(d->bus);
+
+	/* All the transactions already submitted are processed first, the
+	 * worker needs the bus lock to do this. */
+	__atomic_store_n(&async->stop, 1, __ATOMIC_RELEASE);
+	sem_post(&async->sem);
+	pthread_join(async->thread, NULL);
+	async_put(d->bus, async);
+}
+
+int i2cdev_async_get_fd(struct i2cdev *d)
+{
+	assert(d != NULL);
+
+	if (!d->flags.async)
+		return -1;
+
+	return d->bus->async->efd;
+}
+
+int i2cdev_txn_submit(struct i2cdev_txn *t, i2cdev_txn_cb_t cb, void *ctx)
+{
+	struct bus_sched *s;
+	struct i2cdev_async *async;
+	int ret = -1;
+
+	assert(t != NULL);
+	assert(!i2cdev_txn_is_pending(t));
+
+	/* the worker can't be stopped until the transaction is queued */
+	s = &t->dev->bus->sched;
+	pthread_mutex_lock(&s->mutex);
+	async = t->dev->bus->async;
+
+	if (async == NULL) {
+		LOG("asynchronous mode not started");
+		goto exit_unlock;
+	}
+
+	t->cb = cb;
+	t->cb_ctx = ctx;
+	t->async = async;
+	t->async_result = 0;
+	__atomic_store_n(&t->async_state, TXN_PENDING, __ATOMIC_RELAXED);
+
+	if (async_push(async, t)) {
+		LOG("submission queue full");
+		__atomic_store_n(&t->async_state, TXN_IDLE, __ATOMIC_RELAXED);
+		goto exit_unlock;
+	}
+
+	sem_post(&async->sem);
+	ret = 0;
+
+exit_unlock:
+	pthread_mutex_unlock(&s->mutex);
+
+	return ret;
+}
+
+int i2cdev_txn_is_pending(const struct i2cdev_txn *t)
+{
+	assert(t != NULL);
+
+	return (__atomic_load_n(&t->async_state, __ATOMIC_ACQUIRE)
+		== TXN_PENDING) ? 1 : 0;
+}
+
+int i2cdev_txn_wait(struct i2cdev_txn *t)
+{
+	struct bus_sched *s;
+	struct i2cdev_async *async;
+
+	assert(t != NULL);
+
+	if (!i2cdev_txn_is_pending(t))
+		return t->async_result;
+
+	/* While the transaction is pending, the worker it was submitted to
+	 * is still running so it can't have been freed yet. */
+	s = &t->dev->bus->sched;
+	pthread_mutex_lock(&s->mutex);
+
+	if (!i2cdev_txn_is_pending(t)) {
+		pthread_mutex_unlock(&s->mutex);
+		return t->async_result;
+	}
+
+	async = t->async;
+	++async->refs;
+	pthread_mutex_unlock(&s->mutex);
+
+	pthread_mutex_lock(&async->mutex);
+
+	while (i2cdev_txn_is_pending(t))
+		pthread_cond_wait(&async->cond, &async->mutex);
+
+	pthread_mutex_unlock(&async->mutex);
+	async_put(t->dev->bus, async);
+
+	return t->async_result;
+}
+
+/* ----------------------------------------------------------------------------
+ * static functions
+ */
+
+static int dev_init(struct i2cdev *d, const char *bus_device, char address)
+{
+	d->config = plhw_config_get();
+
+	if (d->config == NULL)
+		return -1;
+
+	if (bus_device == NULL)
+		bus_device = plhw_config_get_str(d->config, "i2c-bus", NULL);
+
+	if (bus_device == NULL) {
+		LOG("no I2C bus specified");
+		goto err_put_config;
+	}
+
+	d->addr = address;
+	d->bus = get_bus(bus_device, d->config);
+
+	if (d->bus == NULL)
+		goto err_put_config;
+
+	d->flags.verbose_log = 0;
+	d->flags.ignore_read_nak = 0;
+	d->flags.ignore_write_nak = 0;
+	d->flags.async = 0;
+	d->flags.force_rdwr = 0;
+	d->flags.no_smbus = 0;
+	d->flags.trace =
+		plhw_config_get_int(d->config, "i2c-trace", 0) ? 1 : 0;
+	d->flags.quiet = 0;
+	d->prio = I2CDEV_PRIO_STATUS;
+	d->reg_stats = NULL;
+	memset(&d->stats, 0, sizeof d->stats);
+
+	d->retry.max_retries =
+		plhw_config_get_int(d->config, "i2c-retries", 2);
+	d->retry.backoff_us =
+		plhw_config_get_int(d->config, "i2c-retry-backoff-us", 500);
+	d->retry.max_backoff_us =
+		plhw_config_get_int(d->config, "i2c-retry-max-backoff-us",
+				    8000);
+	d->retry.retry_mask = I2CDEV_RETRY_DEFAULT_MASK;
+	d->retry.breaker_threshold =
+		plhw_config_get_int(d->config, "i2c-breaker-threshold", 8);
+	d->retry.breaker_cooldown_ms =
+		plhw_config_get_int(d->config, "i2c-breaker-cooldown-ms",
+				    1000);
+	d->n_failures = 0;
+	d->breaker_until = 0;
+	d->wc = NULL;
+
+	/* so the accesses made when creating a part are counted too */
+	if (plhw_config_get_int(d->config, "i2c-reg-stats", 0))
+		set_reg_stats(d, 1);
+
+	return 0;
+
+err_put_config:
+	plhw_config_put(d->config);
+
+	return -1;
+}
+
+static struct i2cdev_bus *get_bus(const char *path,
+				  struct plhw_config *config)
+{
+	const struct i2cdev_bus_ops * const *ops;
+	struct i2cdev_bus *bus;
+	struct stat st;
+	dev_t rdev;
+
+	if (!stat(path, &st) && S_ISCHR(st.st_mode))
+		rdev = st.st_rdev;
+	else
+		rdev = 0;
+
+	pthread_mutex_lock(&bus_list_lock);
+
+	for (bus = bus_list; bus != NULL; bus = bus->next) {
+		if (rdev ? (rdev == bus->rdev) : !strcmp(path, bus->path)) {
+			++bus->refcount;
+			goto exit_unlock;
+		}
+	}
+
+	bus = malloc(sizeof (struct i2cdev_bus));
+
+	if (bus == NULL)
+		goto exit_unlock;
+
+	bus->path = strdup(path);
+
+	if (bus->path == NULL)
+		goto err_free_bus;
+
+	for (ops = bus_transports; *ops != NULL; ++ops)
+		if (!strncmp(path, (*ops)->prefix, strlen((*ops)->prefix)))
+			break;
+
+	bus->ops = *ops;
+
+	if (bus->ops != NULL) {
+		bus->fd = -1;
+		bus->funcs = bus->ops->funcs;
+		bus->priv = bus->ops->open(&path[strlen(bus->ops->prefix)],
+					   config);
+
+		if (bus->priv == NULL) {
+			LOG("failed to open I2C bus (%s)", path);
+			goto err_free_path;
+		}
+	} else {
+		bus->priv = NULL;
+		bus->fd = open(path, O_RDWR);
+
+		if (bus->fd < 0) {
+			LOG("failed to open I2C bus device (%s)", path);
+			goto err_free_path;
+		}
+
+		if (ioctl(bus->fd, I2C_FUNCS, &bus->funcs) < 0)
+			bus->funcs = I2C_FUNC_I2C;
+
+		set_adapter_tuning(bus->fd, config);
+	}
+
+	if (bus_list == NULL) {
+		const char *rec_path =
+			plhw_config_get_str(config, "i2c-record", NULL);
+
+		if (rec_path != NULL)
+			recorder = i2crec_open(rec_path);
+	}
+
+	bus->slave = -1;
+
+	memset(&bus->sched, 0, sizeof bus->sched);
+	pthread_mutex_init(&bus->sched.mutex, NULL);
+	pthread_cond_init(&bus->sched.cond, NULL);
+	bus->sched.bulk_rate =
+		plhw_config_get_int(config, "i2c-bulk-rate", 0);
+	bus->sched.bulk_burst =
+		plhw_config_get_int(config, "i2c-bulk-burst", 256);
+	bus->sched.bulk_tokens = bus->sched.bulk_burst;
+
+	bus->rdev = rdev;
+	bus->refcount = 1;
+	bus->block = NULL;
+	bus->block_size = 0;
+	bus->block_busy = 0;
+	bus->async = NULL;
+	memset(&bus->stats, 0, sizeof bus->stats);
+	bus->next = bus_list;
+	bus_list = bus;
+
+exit_unlock:
+	pthread_mutex_unlock(&bus_list_lock);
+
+	return bus;
+
+err_free_path:
+	free(bus->path);
+err_free_bus:
+	free(bus);
+	pthread_mutex_unlock(&bus_list_lock);
+
+	return NULL;
+}
+
+static void put_bus(struct i2cdev_bus *bus)
+{
+	struct i2cdev_bus **it;
+
+	pthread_mutex_lock(&bus_list_lock);
+	assert(bus->refcount);
+
+	if (--bus->refcount) {
+		pthread_mutex_unlock(&bus_list_lock);
+		return;
+	}
+
+	for (it = &bus_list; *it != bus; it = &(*it)->next)
+		assert(*it != NULL);
+
+	*it = bus->next;
+
+	if ((bus_list == NULL) && (recorder != NULL)) {
+		i2crec_close(recorder);
+		recorder = NULL;
+	}
+
+	pthread_mutex_unlock(&bus_list_lock);
+
+	assert(bus->async == NULL);
+	assert(!bus->sched.depth);
+	pthread_cond_destroy(&bus->sched.cond);
+	pthread_mutex_destroy(&bus->sched.mutex);
+
+	if (bus->ops != NULL)
+		bus->ops->close(bus->priv);
+	else
+		close(bus->fd);
+
+	free(bus->block);
+	free(bus->path);
+	free(bus);
+}
+
+/* The addrs map has the addresses of the devices to be used */
+static void bus_lock_prio(struct i2cdev_bus *bus, enum i2cdev_prio prio,
+			  const uint8_t *addrs)
+{
+	struct bus_sched * const s = &bus->sched;
+	const pthread_t self = pthread_self();
+	unsigned i;
+
+	pthread_mutex_lock(&s->mutex);
+
+	if (s->depth && pthread_equal(s->owner, self)) {
+		if (s->parked && addr_map_overlap(s->parked_held, addrs))
+			bus_yield(s, addrs);
+
+		++s->depth;
+
+		for (i = 0; i < ADDR_MAP_SIZE; ++i)
+			s->held[i] |= addrs[i];
+
+		pthread_mutex_unlock(&s->mutex);
+		return;
+	}
+
+	++s->waiting[prio];
+
+	while (s->depth || s->resuming || s->yielding
+	       || higher_prio_waiting(s, prio)
+	       || (s->parked && addr_map_overlap(s->parked_held, addrs)))
+		pthread_cond_wait(&s->cond, &s->mutex);
+
+	--s->waiting[prio];
+	s->owner = self;
+	s->depth = 1;
+	memcpy(s->held, addrs, sizeof s->held);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+/* To be called with the scheduler mutex held by the owner, when it needs a
+ * device used by the parked owner: waiting for it to resume would deadlock
+ * as it waits for the lock to be released.  Give it the lock back until it
+ * releases it or parks it again without being in the way, with the other
+ * threads kept waiting, then take it back.  */
+static void bus_yield(struct bus_sched *s, const uint8_t *addrs)
+{
+	const pthread_t owner = s->owner;
+	const unsigned depth = s->depth;
+	uint8_t held[ADDR_MAP_SIZE];
+
+	memcpy(held, s->held, sizeof held);
+	s->yielding = 1;
+	s->depth = 0;
+	pthread_cond_broadcast(&s->cond);
+
+	while (s->depth || s->resuming
+	       || (s->parked && addr_map_overlap(s->parked_held, addrs)))
+		pthread_cond_wait(&s->cond, &s->mutex);
+
+	s->yielding = 0;
+	s->owner = owner;
+	s->depth = depth;
+	memcpy(s->held, held, sizeof s->held);
+}
+
+static int higher_prio_waiting(const struct bus_sched *s,
+			       enum i2cdev_prio prio)
+{
+	unsigned p;
+
+	for (p = 0; p < prio; ++p)
+		if (s->waiting[p])
+			return 1;
+
+	return 0;
+}
+
+static void dev_lock_prio(struct i2cdev *d, enum i2cdev_prio prio)
+{
+	uint8_t addrs[ADDR_MAP_SIZE];
+
+	memset(addrs, 0, sizeof addrs);
+	addr_map_set(addrs, d->addr);
+	bus_lock_prio(d->bus, prio, addrs);
+}
+
+static void bus_lock(struct i2cdev *d)
+{
+	dev_lock_prio(d, d->prio);
+}
+
+static void bus_unlock(struct i2cdev_bus *bus)
+{
+	struct bus_sched * const s = &bus->sched;
+
+	pthread_mutex_lock(&s->mutex);
+	assert(s->depth && pthread_equal(s->owner, pthread_self()));
+
+	if (!--s->depth)
+		pthread_cond_broadcast(&s->cond);
+
+	pthread_mutex_unlock(&s->mutex);
+}
+
+/* To be called with the bus lock held.  Release it for the threads which
+ * don't use any of the devices used so far by the owner, return 1 if the
+ * lock was parked and bus_resume needs to be called. */
+static int bus_park(struct i2cdev_bus *bus)
+{
+	struct bus_sched * const s = &bus->sched;
+
+	pthread_mutex_lock(&s->mutex);
+
+	if (s->parked || bus->block_busy) {
+		pthread_mutex_unlock(&s->mutex);
+		return 0;
+	}
+
+	s->parked = 1;
+	s->parked_owner = s->owner;
+	s->parked_depth = s->depth;
+	memcpy(s->parked_held, s->held, sizeof s->parked_held);
+	s->depth = 0;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->mutex);
+
+	return 1;
+}
+
+/* Get the parked lock back, before any other waiting thread */
+static void bus_resume(struct i2cdev_bus *bus)
+{
+	struct bus_sched * const s = &bus->sched;
+
+	pthread_mutex_lock(&s->mutex);
+	assert(s->parked && pthread_equal(s->parked_owner, pthread_self()));
+	s->resuming = 1;
+
+	while (s->depth)
+		pthread_cond_wait(&s->cond, &s->mutex);
+
+	s->resuming = 0;
+	s->parked = 0;
+	s->owner = s->parked_owner;
+	s->depth = s->parked_depth;
+	memcpy(s->held, s->parked_held, sizeof s->held);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+static void addr_map_set(uint8_t *map, char addr)
+{
+	const unsigned a = addr & 0x7F;
+
+	map[a / 8] |= 1 << (a % 8);
+}
+
+static int addr_map_overlap(const uint8_t *a, const uint8_t *b)
+{
+	unsigned i;
+
+	for (i = 0; i < ADDR_MAP_SIZE; ++i)
+		if (a[i] & b[i])
+			return 1;
+
+	return 0;
+}
+
+/* To be called before taking the bus lock with the same priority.  Bulk
+ * operations wait for the token bucket to cover their size, unless the
+ * caller already holds the bus lock as this would stall the bus.  */
+static void bus_throttle(struct i2cdev_bus *bus, enum i2cdev_prio prio,
+			 size_t size)
+{
+	struct bus_sched * const s = &bus->sched;
+	long long now;
+	long long wait_us = 0;
+
+	if ((prio != I2CDEV_PRIO_BULK) || !s->bulk_rate)
+		return;
+
+	pthread_mutex_lock(&s->mutex);
+
+	if (s->depth && pthread_equal(s->owner, pthread_self())) {
+		pthread_mutex_unlock(&s->mutex);
+		return;
+	}
+
+	now = now_us();
+	s->bulk_tokens += (now - s->bulk_time_us) * s->bulk_rate / 1000000;
+	s->bulk_time_us = now;
+
+	if (s->bulk_tokens > s->bulk_burst)
+		s->bulk_tokens = s->bulk_burst;
+
+	s->bulk_tokens -= size;
+
+	if (s->bulk_tokens < 0)
+		wait_us = -s->bulk_tokens * 1000000 / s->bulk_rate;
+
+	pthread_mutex_unlock(&s->mutex);
+
+	if (wait_us)
+		usleep(wait_us);
+}
+
+/* The kernel timeout is in units of 10ms, negative values keep the adapter
+ * defaults */
+static void set_adapter_tuning(int fd, struct plhw_config *config)
+{
+	const long timeout_ms =
+		plhw_config_get_int(config, "i2c-timeout-ms", -1);
+	const long retries =
+		plhw_config_get_int(config, "i2c-adapter-retries", -1);
+
+	if ((timeout_ms >= 0)
+	    && (ioctl(fd, I2C_TIMEOUT, (timeout_ms + 9) / 10) < 0))
+		LOG("failed to set the adapter timeout");
+
+	if ((retries >= 0) && (ioctl(fd, I2C_RETRIES, retries) < 0))
+		LOG("failed to set the adapter retries");
+}
+
+/* The register is only used for the statistics, -1 if unknown */
+static int transfer(struct i2cdev *d, int reg, struct i2c_msg *msgs,
+		    unsigned n)
+{
+	struct i2c_rdwr_ioctl_data i2c_data = {
+		.msgs = msgs,
+		.nmsgs = n
+	};
+
+	struct timespec t0;
+	unsigned long us;
+	unsigned attempt = 0;
+	size_t rd = 0;
+	size_t wr = 0;
+	unsigned i;
+	int ret;
+
+	ret = breaker_check(d);
+
+	if (ret)
+		return ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	do {
+		if (d->bus->ops != NULL) {
+			ret = d->bus->ops->rdwr(d->bus->priv, msgs, n);
+		} else {
+			stats_count_ioctl(d);
+
+			if (ioctl(d->bus->fd, I2C_RDWR, &i2c_data) < 0)
+				ret = -errno;
+			else
+				ret = 0;
+		}
+	} while (ret && can_retry(msgs, n, ret)
+		 && retry_wait(d, ret, attempt++));
+
+	breaker_update(d, ret);
+
+	for (i = 0; i < n; ++i) {
+		if (msgs[i].flags & I2C_M_RD)
+			rd += msgs[i].len;
+		else
+			wr += msgs[i].len;
+	}
+
+	us = stats_update(d, reg, rd, wr, ret, &t0);
+
+	if (recorder != NULL)
+		i2crec_add(recorder, &t0, us, msgs, n, ret);
+
+	if (!(ret || d->flags.trace || d->flags.verbose_log))
+		return ret;
+
+	if (reg < 0) {
+		const uint8_t txn = (n > 1) ? I2CDEV_TRACE_TXN : 0;
+
+		for (i = 0; i < n; ++i) {
+			const struct i2c_msg * const m = &msgs[i];
+
+			trace_io(d, txn | ((m->flags & I2C_M_RD) ?
+					   I2CDEV_TRACE_READ : 0),
+				 -1, m->buf, m->len, ret, &t0, us);
+		}
+	} else if (n == 1) {
+		/* register and data merged in a single write message */
+		trace_io(d, I2CDEV_TRACE_REG, reg, &msgs[0].buf[1],
+			 msgs[0].len - 1, ret, &t0, us);
+	} else {
+		const uint8_t rd_flag = (msgs[1].flags & I2C_M_RD) ?
+			I2CDEV_TRACE_READ : 0;
+
+		trace_io(d, I2CDEV_TRACE_REG | rd_flag, reg, msgs[1].buf,
+			 rd ? rd : (wr - msgs[0].len), ret, &t0, us);
+	}
+
+	return ret;
+}
+
+/* A failed transfer is only sent again if none of its writes can have been
+ * done already: when it has a single message, or when it only has reads
+ * with their register address.  A read without its register address
+ * continues from the device's address pointer (e.g. EEPROM sequential
+ * reads), which a partial transfer has already moved, so it is only sent
+ * again on its own and when the device didn't acknowledge its address
+ * (ENXIO). */
+static int can_retry(const struct i2c_msg *msgs, unsigned n, int ret)
+{
+	unsigned n_writes = 0;
+	unsigned n_starts = 0;
+	int ptr_read = 0;
+	unsigned i;
+
+	for (i = 0; i < n; ++i) {
+		const struct i2c_msg * const m = &msgs[i];
+
+		if (m->flags & I2C_M_NOSTART)
+			continue;
+
+		++n_starts;
+
+		if (m->flags & I2C_M_RD) {
+			if (!i || (msgs[i - 1].flags & I2C_M_RD))
+				ptr_read = 1;
+
+			continue;
+		}
+
+		if (((i + 1) < n) && (msgs[i + 1].flags & I2C_M_RD)
+		    && !(msgs[i + 1].flags & I2C_M_NOSTART))
+			continue;
+
+		++n_writes;
+	}
+
+	if (ptr_read)
+		return ((n_starts == 1) && (ret == -ENXIO));
+
+	return (!n_writes || (n_starts == 1));
+}
+
+/* To be called with the bus lock held, return the duration in us */
+static unsigned long stats_update(struct i2cdev *d, int reg, size_t rd,
+				  size_t wr, int ret,
+				  const struct timespec *t0)
+{
+	struct i2cdev_stats * const sts[2] = { &d->stats, &d->bus->stats };
+	struct timespec t1;
+	unsigned long us;
+	unsigned bucket;
+	unsigned i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	us = (t1.tv_sec - t0->tv_sec) * 1000000L
+		+ (t1.tv_nsec - t0->tv_nsec) / 1000L;
+
+	/* bucket n > 0 is for [2^(n-1), 2^n) us, the last one has no limit */
+	bucket = us ? ((8 * sizeof us) - __builtin_clzl(us)) : 0;
+
+	if (bucket >= I2CDEV_STATS_NB_BUCKETS)
+		bucket = I2CDEV_STATS_NB_BUCKETS - 1;
+
+	for (i = 0; i < 2; ++i) {
+		struct i2cdev_stats * const st = sts[i];
+
+		++st->transactions;
+		++st->latency[bucket];
+		st->busy_us += us;
+
+		if (ret) {
+			++st->errors[error_class(ret)];
+		} else {
+			st->bytes_read += rd;
+			st->bytes_written += wr;
+		}
+	}
+
+	if ((reg >= 0) && (d->reg_stats != NULL)) {
+		struct i2cdev_reg_stats * const rst = &d->reg_stats[reg];
+
+		++rst->transactions;
+		++rst->latency[bucket];
+
+		if (ret)
+			++rst->errors;
+	}
+
+	return us;
+}
+
+/* To be called with the bus lock held */
+static void stats_count_ioctl(struct i2cdev *d)
+{
+	++d->stats.ioctls;
+	++d->bus->stats.ioctls;
+}
+
+/* Add a record to the trace ring if enabled, and format it in the log if
+ * verbose or in case of error. */
+static void trace_io(struct i2cdev *d, uint8_t flags, int reg,
+		     const void *data, size_t len, int ret,
+		     const struct timespec *t0, unsigned long us)
+{
+	struct i2cdev_trace_rec rec;
+	const size_t n = (len < I2CDEV_TRACE_DATA_SIZE) ?
+		len : I2CDEV_TRACE_DATA_SIZE;
+
+	rec.timestamp = t0->tv_sec * 1000000000ULL + t0->tv_nsec;
+	rec.duration_us = us;
+	rec.len = len;
+	rec.result = ret;
+	rec.addr = d->addr;
+	rec.reg = (reg < 0) ? 0 : reg;
+	rec.flags = flags;
+	memcpy(rec.data, data, n);
+	memset(&rec.data[n], 0, I2CDEV_TRACE_DATA_SIZE - n);
+
+	if (d->flags.trace) {
+		const unsigned long pos =
+			__atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+		struct trace_slot * const slot =
+			&trace_ring[pos & (I2CDEV_TRACE_SIZE - 1)];
+
+		__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memcpy(&slot->rec, &rec, sizeof rec);
+		__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	}
+
+	if ((ret && !d->flags.quiet) || d->flags.verbose_log) {
+		char str[I2CDEV_TRACE_STR_SIZE];
+
+		i2cdev_trace_format(&rec, str, sizeof str);
+		LOG("%s", str);
+	}
+}
+
+static void set_reg_stats(struct i2cdev *d, int enable)
+{
+	bus_lock(d);
+
+	if (enable && (d->reg_stats == NULL)) {
+		d->reg_stats = calloc(256, sizeof (*d->reg_stats));
+
+		if (d->reg_stats == NULL)
+			LOG("failed to allocate register statistics");
+	} else if (!enable) {
+		free(d->reg_stats);
+		d->reg_stats = NULL;
+	}
+
+	bus_unlock(d->bus);
+}
+
+static enum i2cdev_error error_class(int ret)
+{
+	switch (-ret) {
+	case ENXIO:
+	case EREMOTEIO: return I2CDEV_ERR_NAK;
+	case ETIMEDOUT: return I2CDEV_ERR_TIMEOUT;
+	case EAGAIN:    return I2CDEV_ERR_ARB;
+	case EIO:       return I2CDEV_ERR_IO;
+	default:        return I2CDEV_ERR_OTHER;
+	}
+}
+
+static long long now_us(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (t.tv_sec * 1000000LL) + (t.tv_nsec / 1000);
+}
+
+/* To be called with the bus lock held.  Once the cooldown has elapsed, the
+ * breaker stays half-open until the next operation completes. */
+static int breaker_check(struct i2cdev *d)
+{
+	if (d->breaker_until && (now_us() < d->breaker_until))
+		return -EHOSTDOWN;
+
+	return 0;
+}
+
+/* To be called with the bus lock held, with the final operation result */
+static void breaker_update(struct i2cdev *d, int ret)
+{
+	enum i2cdev_error err;
+
+	if (!ret) {
+		if (d->breaker_until)
+			LOG("0x%02X: responding again", d->addr);
+
+		d->n_failures = 0;
+		d->breaker_until = 0;
+		return;
+	}
+
+	err = error_class(ret);
+
+	if ((err != I2CDEV_ERR_NAK) && (err != I2CDEV_ERR_TIMEOUT))
+		return;
+
+	++d->n_failures;
+
+	if (!d->retry.breaker_threshold
+	    || (d->n_failures < d->retry.breaker_threshold))
+		return;
+
+	if (!d->breaker_until)
+		LOG("0x%02X: not responding after %u failures, suspended",
+		    d->addr, d->n_failures);
+
+	d->breaker_until = now_us()
+		+ (d->retry.breaker_cooldown_ms * 1000LL);
+}
+
+/* To be called with the bus lock held.  Return 1 after waiting if the
+ * failed attempt number attempt (starting with 0) should be retried.  The
+ * lock is parked during the backoff so the other devices can use the bus,
+ * which means the slave address may have changed when this returns. */
+static int retry_wait(struct i2cdev *d, int ret, unsigned attempt)
+{
+	const enum i2cdev_error err = error_class(ret);
+	unsigned long delay;
+
+	if ((attempt >= d->retry.max_retries)
+	    || !(d->retry.retry_mask & (1 << err)))
+		return 0;
+
+	/* A device which is not responding would only be retried once the
+	 * breaker closes again */
+	if (d->retry.breaker_threshold
+	    && ((d->n_failures + 1) >= d->retry.breaker_threshold))
+		return 0;
+
+	++d->stats.retries;
+	++d->bus->stats.retries;
+
+	if (err == I2CDEV_ERR_ARB)
+		return 1;
+
+	delay = d->retry.backoff_us;
+
+	while (attempt-- && (delay < d->retry.max_backoff_us))
+		delay <<= 1;
+
+	if (delay > d->retry.max_backoff_us)
+		delay = d->retry.max_backoff_us;
+
+	if (delay) {
+		const int parked = bus_park(d->bus);
+
+		usleep(delay);
+
+		if (parked)
+			bus_resume(d->bus);
+	}
+
+	return 1;
+}
+
+/* Only called with the bus lock held, so the depth can only be non-zero
+ * here in the thread which began write combining.  */
+static int wc_is_active(const struct i2cdev *d, const uint8_t *reg,
+			size_t reg_sz, size_t size)
+{
+	return ((d->wc != NULL) && d->wc->depth && (reg_sz == 1)
+		&& ((reg[0] + size) <= WC_NB_REGS));
+}
+
+static void wc_store(struct i2cdev_wc *wc, uint8_t reg,
+		     const struct iovec *iov, unsigned iovcnt)
+{
+	unsigned n;
+	size_t i;
+
+	for (n = 0; n < iovcnt; ++n) {
+		const uint8_t *data = iov[n].iov_base;
+
+		for (i = 0; i < iov[n].iov_len; ++i, ++reg) {
+			wc->data[reg] = data[i];
+			wc->dirty[reg / 8] |= (1 << (reg % 8));
+		}
+	}
+}
+
+static void wc_overlay(const struct i2cdev_wc *wc, uint8_t reg, uint8_t *data,
+		       size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; ++i, ++reg)
+		if (wc->dirty[reg / 8] & (1 << (reg % 8)))
+			data[i] = wc->data[reg];
+}
+
+/* Send each run of dirty registers as one auto-increment burst.  The
+ * buffer is always emptied, the first error is returned.  */
+static int wc_send(struct i2cdev *d)
+{
+	struct i2cdev_wc * const wc = d->wc;
+	unsigned reg = 0;
+	int ret = 0;
+
+	while (reg < WC_NB_REGS) {
+		struct iovec iov;
+		uint8_t first;
+		int stat;
+
+		if (!(wc->dirty[reg / 8] & (1 << (reg % 8)))) {
+			++reg;
+			continue;
+		}
+
+		first = reg;
+
+		while ((reg < WC_NB_REGS)
+		       && (wc->dirty[reg / 8] & (1 << (reg % 8))))
+			++reg;
+
+		iov.iov_base = &wc->data[first];
+		iov.iov_len = reg - first;
+		stat = write_reg_iov(d, &first, 1, &iov, 1);
+
+		if (stat && !ret)
+			ret = stat;
+	}
+
+	memset(wc->dirty, 0, sizeof wc->dirty);
+
+	return ret;
+}
+
+/* Send the pending combined writes ahead of a write which can't be combined
+ * so that the device sees them in order.  Write combining carries on
+ * afterwards.  Only called with the bus lock held.  */
+static int wc_send_pending(struct i2cdev *d)
+{
+	unsigned depth;
+	int ret;
+
+	if ((d->wc == NULL) || !d->wc->depth)
+		return 0;
+
+	depth = d->wc->depth;
+	d->wc->depth = 0;
+	ret = wc_send(d);
+	d->wc->depth = depth;
+
+	return ret;
+}
+
+static int rdwr_data(struct i2cdev *d, __u16 flags, void *data, size_t size)
+{
+	struct i2c_msg msgs[1] = {
+		{
+			.addr = d->addr,
+			.flags = flags,
+			.len = size,
+			.buf = (__u8 *) data
+		}
+	};
+
+	int ret;
+
+	bus_throttle(d->bus, d->prio, size);
+	bus_lock(d);
+	ret = transfer(d, -1, msgs, 1);
+	bus_unlock(d->bus);
+
+	return ret;
+}
+
+static int read_reg_data(struct i2cdev *d, uint8_t *reg, size_t reg_sz,
+			 void *buf, size_t buf_sz)
+{
+	struct i2c_msg msgs[2] = {
+		{
+			.addr = d->addr,
+			.flags = 0,
+			.len = reg_sz,
+			.buf = reg
+		},
+		{
+			.addr = d->addr,
+			.flags = I2C_M_RD
+			 | (d->flags.ignore_read_nak ? I2C_M_IGNORE_NAK : 0),
+			.len = buf_sz,
+			.buf = (__u8 *) buf
+		}
+	};
+
+	const int size = smbus_size(d, reg_sz, buf_sz, I2C_SMBUS_READ);
+	int ret;
+
+	bus_throttle(d->bus, d->prio, reg_sz + buf_sz);
+	bus_lock(d);
+
+	if (size >= 0)
+		ret = smbus_reg_io(d, I2C_SMBUS_READ, reg[0], size, buf,
+				   buf_sz);
+
+	if (size < 0 || ret == -EOPNOTSUPP)
+		ret = transfer(d, (reg_sz == 1) ? reg[0] : -1, msgs, 2);
+
+	if (!ret && wc_is_active(d, reg, reg_sz, buf_sz))
+		wc_overlay(d->wc, reg[0], buf, buf_sz);
+
+	bus_unlock(d->bus);
+
+	return ret;
+}
+
+static int write_reg_iov(struct i2cdev *d, const uint8_t *reg, size_t reg_sz,
+			 const struct iovec *iov, unsigned iovcnt)
+{
+	struct i2cdev_bus * const bus = d->bus;
+	const __u16 flags = d->flags.ignore_write_nak ? I2C_M_IGNORE_NAK : 0;
+	struct i2c_msg msgs[I2CDEV_MAX_IOV + 1];
+	size_t len;
+	unsigned n;
+	int size;
+	int ret;
+
+	msgs[0].addr = d->addr;
+	msgs[0].flags = flags;
+	msgs[0].len = reg_sz;
+	msgs[0].buf = (__u8 *) reg;
+
+	for (len = 0, n = 0; n < iovcnt; ++n)
+		len += iov[n].iov_len;
+
+	size = smbus_size(d, reg_sz, len, I2C_SMBUS_WRITE);
+
+	bus_throttle(d->bus, d->prio, reg_sz + len);
+	bus_lock(d);
+
+	if (wc_is_active(d, reg, reg_sz, len)) {
+		wc_store(d->wc, reg[0], iov, iovcnt);
+		ret = 0;
+		goto exit_unlock;
+	}
+
+	ret = wc_send_pending(d);
+
+	if (ret)
+		goto exit_unlock;
+
+	if (size >= 0) {
+		uint8_t data[I2C_SMBUS_BLOCK_MAX];
+
+		for (len = 0, n = 0; n < iovcnt; ++n) {
+			memcpy(&data[len], iov[n].iov_base, iov[n].iov_len);
+			len += iov[n].iov_len;
+		}
+
+		ret = smbus_reg_io(d, I2C_SMBUS_WRITE, reg[0], size, data,
+				   len);
+
+		if (ret != -EOPNOTSUPP)
+			goto exit_unlock;
+	}
+
+	if (bus->funcs & I2C_FUNC_NOSTART) {
+		/* Send the payload directly from the caller's buffers */
+		for (n = 0; n < iovcnt; ++n) {
+			struct i2c_msg * const msg = &msgs[n + 1];
+
+			msg->addr = d->addr;
+			msg->flags = flags | I2C_M_NOSTART;
+			msg->len = iov[n].iov_len;
+			msg->buf = iov[n].iov_base;
+		}
+
+		ret = transfer(d, (reg_sz == 1) ? reg[0] : -1, msgs,
+			       iovcnt + 1);
+	} else {
+		if (grow_block(bus, reg_sz + len) < 0) {
+			bus_unlock(bus);
+			return -1;
+		}
+
+		memcpy(bus->block, reg, reg_sz);
+		len = reg_sz;
+
+		for (n = 0; n < iovcnt; ++n) {
+			memcpy(bus->block + len, iov[n].iov_base,
+			       iov[n].iov_len);
+			len += iov[n].iov_len;
+		}
+
+		msgs[0].len = len;
+		msgs[0].buf = bus->block;
+		bus->block_busy = 1;
+		ret = transfer(d, (reg_sz == 1) ? reg[0] : -1, msgs, 1);
+		bus->block_busy = 0;
+	}
+
+exit_unlock:
+	bus_unlock(bus);
+
+	return ret;
+}
+
+/* Return the SMBus transfer size to use for a register access or -1 to use
+ * I2C_RDWR.  The SMBus transfers can't ignore NAKs. */
+static int smbus_size(const struct i2cdev *d, size_t reg_sz, size_t size,
+		      char rw)
+{
+	const unsigned long funcs = d->bus->funcs;
+	const int wr = (rw == I2C_SMBUS_WRITE);
+
+	if (d->flags.force_rdwr || d->flags.no_smbus || (reg_sz != 1))
+		return -1;
+
+	if (wr ? d->flags.ignore_write_nak : d->flags.ignore_read_nak)
+		return -1;
+
+	if ((size == 1) && (funcs & (wr ? I2C_FUNC_SMBUS_WRITE_BYTE_DATA :
+				    I2C_FUNC_SMBUS_READ_BYTE_DATA)))
+		return I2C_SMBUS_BYTE_DATA;
+
+	if ((size == 2) && (funcs & (wr ? I2C_FUNC_SMBUS_WRITE_WORD_DATA :
+				    I2C_FUNC_SMBUS_READ_WORD_DATA)))
+		return I2C_SMBUS_WORD_DATA;
+
+	if (size && (size <= I2C_SMBUS_BLOCK_MAX)
+	    && (funcs & (wr ? I2C_FUNC_SMBUS_WRITE_I2C_BLOCK :
+			 I2C_FUNC_SMBUS_READ_I2C_BLOCK)))
+		return I2C_SMBUS_I2C_BLOCK_DATA;
+
+	return -1;
+}
+
+/* To be called with the bus lock held.  Return -EOPNOTSUPP if SMBus can't
+ * be used: when the slave address can't be set, typically because a kernel
+ * driver uses the device, or when the adapter rejects the access.  SMBus
+ * then gets disabled for this device and I2C_RDWR should be used.  Any
+ * other error comes from the device or the bus, and the access must not be
+ * sent again. */
+static int smbus_reg_io(struct i2cdev *d, char rw, uint8_t reg, int size,
+			void *buf, size_t buf_sz)
+{
+	struct i2cdev_bus * const bus = d->bus;
+	uint8_t * const data = buf;
+	union i2c_smbus_data smbus_data;
+	struct i2c_smbus_ioctl_data args = {
+		.read_write = rw,
+		.command = reg,
+		.size = size,
+		.data = &smbus_data,
+	};
+
+	struct timespec t0;
+	unsigned long us;
+	unsigned attempt = 0;
+	size_t rd;
+	size_t wr;
+	int ret;
+
+	ret = breaker_check(d);
+
+	if (ret)
+		return ret;
+
+	if (rw == I2C_SMBUS_WRITE) {
+		switch (size) {
+		case I2C_SMBUS_BYTE_DATA:
+			smbus_data.byte = data[0];
+			break;
+		case I2C_SMBUS_WORD_DATA:
+			smbus_data.word = data[0] | (data[1] << 8);
+			break;
+		default:
+			smbus_data.block[0] = buf_sz;
+			memcpy(&smbus_data.block[1], data, buf_sz);
+			break;
+		}
+	} else if (size == I2C_SMBUS_I2C_BLOCK_DATA) {
+		smbus_data.block[0] = buf_sz;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	do {
+		/* set again after a retry as the bus may have been used */
+		if (bus->slave != d->addr) {
+			stats_count_ioctl(d);
+
+			if (ioctl(bus->fd, I2C_SLAVE, d->addr) < 0) {
+				bus->slave = -1;
+				ret = -EOPNOTSUPP;
+				break;
+			}
+
+			bus->slave = d->addr;
+		}
+
+		stats_count_ioctl(d);
+
+		if (ioctl(bus->fd, I2C_SMBUS, &args) < 0)
+			ret = -errno;
+		else
+			ret = 0;
+	} while (ret && (ret != -EOPNOTSUPP) && (ret != -ENOTTY)
+		 && retry_wait(d, ret, attempt++));
+
+	if ((ret == -EOPNOTSUPP) || (ret == -ENOTTY)) {
+		d->flags.no_smbus = 1;
+		return -EOPNOTSUPP;
+	}
+
+	breaker_update(d, ret);
+
+	if (rw == I2C_SMBUS_WRITE) {
+		rd = 0;
+		wr = 1 + buf_sz;
+	} else {
+		rd = buf_sz;
+		wr = 1;
+	}
+
+	us = stats_update(d, reg, rd, wr, ret, &t0);
+
+	if (!ret && (rw == I2C_SMBUS_READ)) {
+		switch (size) {
+		case I2C_SMBUS_BYTE_DATA:
+			data[0] = smbus_data.byte;
+			break;
+		case I2C_SMBUS_WORD_DATA:
+			data[0] = smbus_data.word & 0xFF;
+			data[1] = (smbus_data.word >> 8) & 0xFF;
+			break;
+		default:
+			memcpy(data, &smbus_data.block[1], buf_sz);
+			break;
+		}
+	}
+
+	if (recorder != NULL) {
+		uint8_t reg8 = reg;
+		struct i2c_msg msgs[2] = {
+			{ d->addr, 0, 1, &reg8 },
+			{ d->addr, (rw == I2C_SMBUS_READ) ?
+			  I2C_M_RD : I2C_M_NOSTART, buf_sz, data },
+		};
+
+		i2crec_add(recorder, &t0, us, msgs, 2, ret);
+	}
+
+	if (ret || d->flags.trace || d->flags.verbose_log) {
+		trace_io(d, I2CDEV_TRACE_SMBUS | I2CDEV_TRACE_REG
+			 | ((rw == I2C_SMBUS_READ) ? I2CDEV_TRACE_READ : 0),
+			 reg, data, buf_sz, ret, &t0, us);
+	}
+
+	return ret;
+}
+
+/* To be called with the bus lock held */
+static int grow_block(struct i2cdev_bus *bus, size_t size)
+{
+	uint8_t *block;
+
+	if (bus->block_size >= size)
+		return 0;
+
+	if (size % BLOCK_SIZE_STEP)
+		size += BLOCK_SIZE_STEP - (size % BLOCK_SIZE_STEP);
+
+	block = realloc(bus->block, size);
+
+	if (block == NULL)
+		return -1;
+
+	bus->block = block;
+	bus->block_size = size;
+
+	return 0;
+}
+
+static int txn_add_op(struct i2cdev_txn *t, unsigned n_msgs)
+{
+	struct txn_op *op;
+
+	assert(n_msgs <= I2C_RDWR_IOCTL_MAX_MSGS);
+
+	if (t->n_ops == t->ops_size) {
+		const size_t ops_size = t->ops_size + TXN_SIZE_STEP;
+		struct txn_op *ops;
+
+		ops = realloc(t->ops, ops_size * sizeof (struct txn_op));
+
+		if (ops == NULL) {
+			txn_rollback(t, (t->n_msgs - n_msgs));
+			return -1;
+		}
+
+		t->ops = ops;
+		t->ops_size = ops_size;
+	}
+
+	op = &t->ops[t->n_ops];
+	op->first_msg = t->n_msgs - n_msgs;
+	op->n_msgs = n_msgs;
+	op->result = 0;
+
+	return t->n_ops++;
+}
+
+static int txn_add_msg(struct i2cdev_txn *t, struct i2cdev *d, __u16 flags,
+		       void *buf, const void *data, size_t size)
+{
+	struct txn_msg *msg;
+
+	assert(d->bus == t->dev->bus);
+
+	if (size > UINT16_MAX) {
+		LOG("message too long (%zu)", size);
+		return -1;
+	}
+
+	if (t->n_msgs == t->msgs_size) {
+		const size_t msgs_size = t->msgs_size + TXN_SIZE_STEP;
+		struct txn_msg *msgs;
+
+		msgs = realloc(t->msgs, msgs_size * sizeof (struct txn_msg));
+
+		if (msgs == NULL)
+			return -1;
+
+		t->msgs = msgs;
+		t->msgs_size = msgs_size;
+	}
+
+	msg = &t->msgs[t->n_msgs];
+	msg->dev = d;
+	msg->flags = flags;
+	msg->len = size;
+	msg->buf = buf;
+	msg->offset = t->data_len;
+
+	if (data != NULL) {
+		const size_t data_len = t->data_len + size;
+
+		if (data_len > t->data_size) {
+			size_t data_size = data_len + BLOCK_SIZE_STEP;
+			uint8_t *tdata;
+
+			data_size -= data_size % BLOCK_SIZE_STEP;
+			tdata = realloc(t->data, data_size);
+
+			if (tdata == NULL)
+				return -1;
+
+			t->data = tdata;
+			t->data_size = data_size;
+		}
+
+		memcpy(&t->data[t->data_len], data, size);
+		t->data_len = data_len;
+	}
+
+	++t->n_msgs;
+
+	return 0;
+}
+
+static void txn_rollback(struct i2cdev_txn *t, size_t n_msgs)
+{
+	if (n_msgs < t->n_msgs)
+		t->data_len = t->msgs[n_msgs].offset;
+
+	t->n_msgs = n_msgs;
+}
+
+static int txn_commit_chunk(struct i2cdev_txn *t, size_t first_op,
+			    size_t n_ops)
+{
+	struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	const struct txn_msg *it;
+	const struct txn_msg *end;
+	struct i2c_msg *msg;
+	unsigned n_msgs;
+	size_t op;
+	int ret;
+
+	it = &t->msgs[t->ops[first_op].first_msg];
+	end = &t->msgs[t->ops[first_op + n_ops - 1].first_msg
+		       + t->ops[first_op + n_ops - 1].n_msgs];
+
+	for (msg = msgs; it != end; ++it, ++msg) {
+		msg->addr = it->dev->addr;
+		msg->flags = it->flags;
+		msg->len = it->len;
+		msg->buf = (it->buf != NULL) ?
+			(__u8 *) it->buf : &t->data[it->offset];
+	}
+
+	/* The kernel does not report which message failed, so all the
+	 * operations in this chunk get the same result. */
+	n_msgs = msg - msgs;
+	ret = transfer(t->dev, -1, msgs, n_msgs);
+
+	for (op = first_op; op < (first_op + n_ops); ++op)
+		t->ops[op].result = ret;
+
+	return ret;
+}
+
+static int async_push(struct i2cdev_async *async, struct i2cdev_txn *t)
+{
+	struct async_slot *slot;
+	unsigned pos;
+
+	pos = __atomic_load_n(&async->head, __ATOMIC_RELAXED);
+
+	for (;;) {
+		unsigned seq;
+		int diff;
+
+		slot = &async->ring[pos & (ASYNC_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (int) (seq - pos);
+
+		if (diff < 0)
+			return -1;
+
+		if (diff > 0)
+			pos = __atomic_load_n(&async->head, __ATOMIC_RELAXED);
+		else if (__atomic_compare_exchange_n(
+				 &async->head, &pos, (pos + 1), 1,
+				 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	slot->txn = t;
+	__atomic_store_n(&slot->seq, (pos + 1), __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static struct i2cdev_txn *async_pop(struct i2cdev_async *async)
+{
+	struct async_slot *slot;
+	struct i2cdev_txn *t;
+
+	slot = &async->ring[async->tail & (ASYNC_RING_SIZE - 1)];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != (async->tail + 1))
+		return NULL;
+
+	t = slot->txn;
+	__atomic_store_n(&slot->seq, (async->tail + ASYNC_RING_SIZE),
+			 __ATOMIC_RELEASE);
+	++async->tail;
+
+	return t;
+}
+
+static void *async_worker(void *arg)
+{
+	struct i2cdev_async *async = arg;
+	const uint64_t one = 1;
+
+	for (;;) {
+		struct i2cdev_txn *t;
+
+		if (sem_wait(&async->sem) && (errno == EINTR))
+			continue;
+
+		/* A producer may have posted before the slot of another one
+		 * was ready, so always drain the ring. */
+		while ((t = async_pop(async)) != NULL) {
+			t->async_result = i2cdev_txn_commit(t);
+
+			/* The callback must not free or submit the transaction
+			 * again, this can only be done once it is done. */
+			if (t->cb != NULL)
+				t->cb(t, t->async_result, t->cb_ctx);
+
+			pthread_mutex_lock(&async->mutex);
+			__atomic_store_n(&t->async_state, TXN_DONE,
+					 __ATOMIC_RELEASE);
+			pthread_cond_broadcast(&async->cond);
+			pthread_mutex_unlock(&async->mutex);
+
+			if (write(async->efd, &one, sizeof one) != sizeof one)
+				LOG("failed to signal completion");
+		}
+
+		if (__atomic_load_n(&async->stop, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	return NULL;
+}
+
+/* Drop a reference to a worker which has been stopped */
+static void async_put(struct i2cdev_bus *bus, struct i2cdev_async *async)
+{
+	unsigned refs;
+
+	pthread_mutex_lock(&bus->sched.mutex);
+	refs = --async->refs;
+	pthread_mutex_unlock(&bus->sched.mutex);
+
+	if (refs)
+		return;
+
+	pthread_cond_destroy(&async->cond);
+	pthread_mutex_destroy(&async->mutex);
+	sem_destroy(&async->sem);
+	close(async->efd);
+	free(async);
 }
@@ -22,7 +22,9 @@
 #ifndef INCLUDE_I2C_DEV_H
 #define INCLUDE_I2C_DEV_H 1
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 struct i2cdev;
 
@@ -30,12 +32,46 @@ enum i2cdev_flag {
 	I2CDEV_VERBOSE_LOG,
 	I2CDEV_IGNORE_WRITE_NAK,
 	I2CDEV_IGNORE_READ_NAK,
+	I2CDEV_FORCE_RDWR,
+	I2CDEV_REG_STATS,
+	I2CDEV_TRACE,
+	I2CDEV_QUIET,       /* no error log, to probe devices */
+};
+
+/* Bus scheduling priority classes, highest first.  The bus lock is always
+ * given to the thread with the highest priority waiting for it, so long
+ * sequences should be split in several operations to be preempted.  Bulk
+ * operations are also rate-limited with a token bucket when i2c-bulk-rate
+ * is set (bytes per second, with a burst of i2c-bulk-burst bytes).  */
+enum i2cdev_prio {
+	I2CDEV_PRIO_HV,      /* HV power sequencing */
+	I2CDEV_PRIO_STATUS,  /* status polling and configuration (default) */
+	I2CDEV_PRIO_BULK,    /* bulk data transfers */
+	I2CDEV_NB_PRIOS
 };
 
 extern struct i2cdev *i2cdev_init(const char *bus_device, char address);
 extern void i2cdev_free(struct i2cdev *i2cdev);
 
+/* In-place initialisation in i2cdev_size bytes of memory owned by the
+ * caller, i2cdev_free then only releases the resources used by the
+ * device.  */
+extern size_t i2cdev_size(void);
+extern struct i2cdev *i2cdev_init_at(void *mem, const char *bus_device,
+				     char address);
+
 extern void i2cdev_set_flag(struct i2cdev *d, enum i2cdev_flag f, int enable);
+
+extern void i2cdev_set_prio(struct i2cdev *d, enum i2cdev_prio prio);
+
+/* Each operation is atomic on the bus, use the (recursive) bus lock to keep
+ * a sequence of operations or the state of a driver consistent.  The lock
+ * is taken with the device priority, or with an explicit one to raise the
+ * priority of a given sequence.  */
+extern void i2cdev_lock(struct i2cdev *d);
+extern void i2cdev_lock_prio(struct i2cdev *d, enum i2cdev_prio prio);
+extern void i2cdev_unlock(struct i2cdev *d);
+
 extern int i2cdev_read(struct i2cdev *d, void *data, size_t size);
 extern int i2cdev_write(struct i2cdev *d, const void *data, size_t size);
 extern int i2cdev_read_reg(struct i2cdev *d, const void *reg, size_t reg_sz,
@@ -46,4 +82,228 @@ extern int i2cdev_write_reg(struct i2cdev *d, const void *reg, size_t reg_sz,
 extern int i2cdev_write_reg8(struct i2cdev *d, char reg, const void *data,
 			     size_t sz);
 
+/* Zero-copy register writes.  The frame passed to i2cdev_write_reg_hr starts
+ * with reg_sz bytes of headroom, overwritten with the register address, and
+ * is then sent as-is.  The segments passed to i2cdev_write_regv are sent
+ * directly with I2C_M_NOSTART if the adapter supports it (see
+ * i2cdev_can_scatter), otherwise they are gathered in the bus scratch buffer
+ * like with i2cdev_write_reg.  This buffer never shrinks, so reserving the
+ * largest write size up front guarantees that writes never allocate.  */
+#define I2CDEV_MAX_IOV 8
+
+extern int i2cdev_write_reg_hr(struct i2cdev *d, const void *reg,
+			       size_t reg_sz, void *frame, size_t data_sz);
+extern int i2cdev_write_regv(struct i2cdev *d, const void *reg, size_t reg_sz,
+			     const struct iovec *iov, unsigned iovcnt);
+extern int i2cdev_reserve(struct i2cdev *d, size_t size);
+extern int i2cdev_can_scatter(struct i2cdev *d);
+
+/* Write combining: between i2cdev_wc_begin and i2cdev_wc_flush, the
+ * single-byte register writes to the device are only stored, then the flush
+ * sends each run of adjacent pending registers as one auto-increment burst
+ * in ascending register order.  Only the last value written to a register
+ * is sent, and reads return the pending values of the registers they
+ * cover.  The bus lock is held from begin to flush, both can be nested.
+ * This is only for devices with register address auto-increment and
+ * registers without side effects on write.  The flush always empties the
+ * buffer and returns the first error, callers caching register values
+ * should invalidate them when it fails.  A contiguous range of registers is
+ * read in one burst with a multi-byte i2cdev_read_reg8.  */
+extern int i2cdev_wc_begin(struct i2cdev *d);
+extern int i2cdev_wc_flush(struct i2cdev *d);
+
+/* Transport selection.  The adapter functionality is read once per bus with
+ * I2C_FUNCS.  Single-byte register accesses of up to 32 data bytes use the
+ * SMBus byte, word or I2C block transfers when the adapter supports them and
+ * no NAK is to be ignored, everything else uses I2C_RDWR.  Transactions
+ * always use I2C_RDWR.  Setting I2CDEV_FORCE_RDWR disables SMBus.  */
+enum i2cdev_transport {
+	I2CDEV_TRANSPORT_RDWR,
+	I2CDEV_TRANSPORT_SMBUS,
+};
+
+extern unsigned long i2cdev_get_funcs(struct i2cdev *d);
+extern enum i2cdev_transport i2cdev_get_transport(struct i2cdev *d,
+						  size_t reg_sz,
+						  size_t data_sz, int write);
+extern const char *i2cdev_transport_str(enum i2cdev_transport transport);
+
+/* Statistics, always updated for each transfer with the bus lock held.
+ * Latency bucket n > 0 counts the transfers which took [2^(n-1), 2^n) us,
+ * bucket 0 is for less than 1 us and the last bucket has no upper limit.
+ * Transactions are accounted to the device used to create them.  The
+ * per-register statistics only cover single-byte register accesses, they
+ * are allocated when setting I2CDEV_REG_STATS (or for all the devices with
+ * the i2c-reg-stats configuration key) and i2cdev_get_reg_stats returns -1
+ * if they are not enabled.  The ioctls counter is the number of
+ * system calls made on the bus device, it stays at 0 with the replay and
+ * simulated transports.  i2cdev_get_bus_stats returns the totals for all
+ * the devices on the same bus since it was opened.  */
+#define I2CDEV_STATS_NB_BUCKETS 16
+
+enum i2cdev_error {
+	I2CDEV_ERR_NAK,     /* ENXIO, EREMOTEIO */
+	I2CDEV_ERR_TIMEOUT, /* ETIMEDOUT */
+	I2CDEV_ERR_ARB,     /* EAGAIN, arbitration lost */
+	I2CDEV_ERR_IO,      /* EIO */
+	I2CDEV_ERR_OTHER,
+	I2CDEV_NB_ERRORS
+};
+
+struct i2cdev_stats {
+	unsigned long transactions;
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;
+	unsigned long long busy_us;
+	unsigned long errors[I2CDEV_NB_ERRORS];
+	unsigned long retries;
+	unsigned long ioctls;
+	unsigned long latency[I2CDEV_STATS_NB_BUCKETS];
+};
+
+struct i2cdev_reg_stats {
+	unsigned long transactions;
+	unsigned long errors;
+	unsigned long latency[I2CDEV_STATS_NB_BUCKETS];
+};
+
+extern void i2cdev_get_stats(struct i2cdev *d, struct i2cdev_stats *stats);
+extern int i2cdev_get_reg_stats(struct i2cdev *d, uint8_t reg,
+				struct i2cdev_reg_stats *stats);
+extern void i2cdev_reset_stats(struct i2cdev *d);
+extern void i2cdev_get_bus_stats(struct i2cdev *d,
+				 struct i2cdev_stats *stats);
+
+/* Retry policy and circuit breaker.  Failed transfers are retried up to
+ * max_retries times when their error class is in retry_mask, after waiting
+ * backoff_us doubled on each attempt up to max_backoff_us (except after a
+ * lost arbitration, retried immediately).  Transfers with several messages
+ * are not retried if they have any write other than the register address of
+ * a read, as some of the writes may already have been done.  During the
+ * backoff, the bus lock is parked: it can be taken by threads which only
+ * use devices the owner hasn't used since it took the lock.  After
+ * breaker_threshold consecutive operations failed with a NAK or a timeout,
+ * the breaker opens and all operations fail with -EHOSTDOWN without any
+ * bus access.  After breaker_cooldown_ms, one operation is let through: the
+ * breaker closes if it succeeds and opens again otherwise.  A threshold of
+ * 0 disables the breaker.  The defaults are read from the configuration:
+ * i2c-retries (2), i2c-retry-backoff-us (500), i2c-retry-max-backoff-us
+ * (8000), i2c-breaker-threshold (8) and i2c-breaker-cooldown-ms (1000).
+ * The i2c-timeout-ms and i2c-adapter-retries values are passed to the
+ * kernel with I2C_TIMEOUT and I2C_RETRIES when opening a bus device.  */
+#define I2CDEV_RETRY_DEFAULT_MASK \
+	((1 << I2CDEV_ERR_NAK) | (1 << I2CDEV_ERR_TIMEOUT) | \
+	 (1 << I2CDEV_ERR_ARB))
+
+struct i2cdev_retry_policy {
+	unsigned max_retries;
+	unsigned backoff_us;
+	unsigned max_backoff_us;
+	unsigned retry_mask;        /* 1 << enum i2cdev_error */
+	unsigned breaker_threshold;
+	unsigned breaker_cooldown_ms;
+};
+
+extern void i2cdev_get_retry_policy(struct i2cdev *d,
+				    struct i2cdev_retry_policy *policy);
+extern void i2cdev_set_retry_policy(struct i2cdev *d,
+				    const struct i2cdev_retry_policy *policy);
+extern int i2cdev_breaker_is_open(struct i2cdev *d);
+extern void i2cdev_breaker_reset(struct i2cdev *d);
+
+/* Trace: with I2CDEV_TRACE set (or the i2c-trace configuration key), each
+ * transfer adds a binary record to a process-wide lock-free ring, the oldest
+ * records get overwritten.  The records are only formatted by the decoder,
+ * which is also used to log the transfers with I2CDEV_VERBOSE_LOG or when
+ * they fail.  i2cdev_trace_read copies the records from the position in the
+ * cursor (0 to start with the oldest one) and updates it.  */
+#define I2CDEV_TRACE_SIZE 1024 /* must be a power of 2 */
+#define I2CDEV_TRACE_DATA_SIZE 8
+#define I2CDEV_TRACE_STR_SIZE 128
+
+enum i2cdev_trace_flag {
+	I2CDEV_TRACE_READ  = 0x01,
+	I2CDEV_TRACE_REG   = 0x02,
+	I2CDEV_TRACE_SMBUS = 0x04,
+	I2CDEV_TRACE_TXN   = 0x08,
+};
+
+struct i2cdev_trace_rec {
+	uint64_t timestamp;         /* CLOCK_MONOTONIC in ns */
+	uint32_t duration_us;
+	uint16_t len;               /* total data length */
+	int16_t result;             /* 0 or -errno */
+	uint8_t addr;
+	uint8_t reg;
+	uint8_t flags;
+	uint8_t data[I2CDEV_TRACE_DATA_SIZE]; /* first data bytes */
+};
+
+extern size_t i2cdev_trace_read(unsigned long *cursor,
+				struct i2cdev_trace_rec *recs, size_t n);
+extern int i2cdev_trace_format(const struct i2cdev_trace_rec *rec,
+			       char *str, size_t size);
+extern void i2cdev_trace_dump(void);
+
+/* Transactions: queue several operations and send them with as few I2C_RDWR
+ * calls as possible (split at the kernel limit of 42 messages per call).
+ * All the devices used in a transaction must be on the same bus.
+ * The add functions return the operation index or -1 if error, the data
+ * buffers of read operations must remain valid until the commit and the
+ * commit returns 0 if all operations succeeded or the first -errno code.
+ * The bus is locked with the priority of the first device unless another
+ * one is set with i2cdev_txn_set_prio.  */
+struct i2cdev_txn;
+
+extern struct i2cdev_txn *i2cdev_txn_begin(struct i2cdev *d);
+extern void i2cdev_txn_set_prio(struct i2cdev_txn *t, enum i2cdev_prio prio);
+extern void i2cdev_txn_reset(struct i2cdev_txn *t);
+extern void i2cdev_txn_free(struct i2cdev_txn *t);
+extern size_t i2cdev_txn_get_nb_ops(const struct i2cdev_txn *t);
+extern int i2cdev_txn_add_read(struct i2cdev_txn *t, struct i2cdev *d,
+			       void *data, size_t size);
+extern int i2cdev_txn_add_write(struct i2cdev_txn *t, struct i2cdev *d,
+				const void *data, size_t size);
+extern int i2cdev_txn_add_read_reg(struct i2cdev_txn *t, struct i2cdev *d,
+				   const void *reg, size_t reg_sz,
+				   void *data, size_t data_sz);
+extern int i2cdev_txn_add_read_reg8(struct i2cdev_txn *t, struct i2cdev *d,
+				    char reg, void *data, size_t sz);
+extern int i2cdev_txn_add_write_reg(struct i2cdev_txn *t, struct i2cdev *d,
+				    const void *reg, size_t reg_sz,
+				    const void *data, size_t data_sz);
+extern int i2cdev_txn_add_write_reg8(struct i2cdev_txn *t, struct i2cdev *d,
+				     char reg, const void *data, size_t sz);
+extern int i2cdev_txn_commit(struct i2cdev_txn *t);
+extern int i2cdev_txn_get_result(const struct i2cdev_txn *t, unsigned op);
+
+/* Asynchronous mode: a worker thread per bus commits the submitted
+ * transactions in order.  Completion is notified by calling the optional
+ * callback from the worker thread, and by incrementing the bus eventfd
+ * counter which can be used with poll/select.  */
+typedef void (*i2cdev_txn_cb_t)(struct i2cdev_txn *t, int result, void *ctx);
+
+extern int i2cdev_async_start(struct i2cdev *d);
+extern void i2cdev_async_stop(struct i2cdev *d);
+extern int i2cdev_async_get_fd(struct i2cdev *d);
+extern int i2cdev_txn_submit(struct i2cdev_txn *t, i2cdev_txn_cb_t cb,
+			     void *ctx);
+extern int i2cdev_txn_is_pending(const struct i2cdev_txn *t);
+extern int i2cdev_txn_wait(struct i2cdev_txn *t);
+
+/* Bus transports other than i2c-dev, selected when the bus path starts with
+ * their prefix.  They only need to implement I2C_RDWR-like transfers with
+ * the given I2C_FUNC_ flags, the rdwr function returns 0 or -errno and is
+ * called with the bus lock held.  */
+struct i2c_msg;
+struct plhw_config;
+
+struct i2cdev_bus_ops {
+	const char *prefix;
+	unsigned long funcs;
+	void *(*open)(const char *arg, struct plhw_config *config);
+	int (*rdwr)(void *priv, struct i2c_msg *msgs, unsigned n);
+	void (*close)(void *priv);
+};
+
 #endif /* INCLUDE_I2C_DEV_H */
@@ -0,0 +1,472 @@
+/*
+  Plastic Logic hardware library - i2crec
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "i2crec.h"
+#include "plhw_config.h"
+#include <linux/i2c.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "i2crec"
+#include <plsdk/log.h>
+
+#define CAPTURE_MAGIC "PLI2"
+#define CAPTURE_VERSION 1
+#define REPLAY_WINDOW 16
+
+struct capture_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t reserved;
+};
+
+struct capture_xfer {
+	uint64_t timestamp;          /* CLOCK_MONOTONIC in ns */
+	uint32_t duration_us;
+	int16_t result;
+	uint8_t n_msgs;
+	uint8_t reserved;
+};
+
+struct capture_msg {
+	uint16_t addr;
+	uint16_t flags;
+	uint16_t len;                /* followed by the data */
+};
+
+struct i2crec {
+	FILE *f;
+	pthread_mutex_t mutex;
+};
+
+/* The records are copied as they may not be aligned in the capture */
+struct replay_xfer {
+	struct capture_xfer xfer;
+	const uint8_t *msgs;
+};
+
+struct i2creplay {
+	uint8_t *capture;
+	struct replay_xfer *xfers;
+	size_t n_xfers;
+	size_t pos;
+	long last;
+	double speed;
+	uint64_t base;
+	struct timespec start;
+};
+
+static void *replay_open(const char *path, struct plhw_config *config);
+static int replay_rdwr(void *priv, struct i2c_msg *msgs, unsigned n);
+static void replay_close(void *priv);
+static int replay_load(struct i2creplay *p, const char *path);
+static int replay_match(const struct replay_xfer *x,
+			const struct i2c_msg *msgs, unsigned n);
+static int replay_serve(const struct replay_xfer *x, struct i2c_msg *msgs,
+			unsigned n);
+static void replay_wait(struct i2creplay *p, const struct replay_xfer *x);
+static uint64_t ts_to_ns(const struct timespec *ts);
+
+const struct i2cdev_bus_ops i2creplay_ops = {
+	.prefix = "replay:",
+	.funcs = I2C_FUNC_I2C,
+	.open = replay_open,
+	.rdwr = replay_rdwr,
+	.close = replay_close,
+};
+
+struct i2crec *i2crec_open(const char *path)
+{
+	struct capture_header header;
+	struct i2crec *rec;
+
+	assert(path != NULL);
+
+	rec = malloc(sizeof (struct i2crec));
+
+	if (rec == NULL)
+		return NULL;
+
+	rec->f = fopen(path, "wb");
+
+	if (rec->f == NULL) {
+		LOG("failed to open capture file: %s", path);
+		goto err_free_rec;
+	}
+
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof header.magic);
+	header.version = CAPTURE_VERSION;
+	header.reserved = 0;
+
+	if (fwrite(&header, sizeof header, 1, rec->f) != 1) {
+		LOG("failed to write capture header");
+		goto err_close_f;
+	}
+
+	pthread_mutex_init(&rec->mutex, NULL);
+	LOG("recording to %s", path);
+
+	return rec;
+
+err_close_f:
+	fclose(rec->f);
+err_free_rec:
+	free(rec);
+
+	return NULL;
+}
+
+void i2crec_close(struct i2crec *rec)
+{
+	assert(rec != NULL);
+
+	fclose(rec->f);
+	pthread_mutex_destroy(&rec->mutex);
+	free(rec);
+}
+
+void i2crec_add(struct i2crec *rec, const struct timespec *t0,
+		unsigned long duration_us, const struct i2c_msg *msgs,
+		unsigned n, int result)
+{
+	struct capture_xfer xfer;
+	unsigned i;
+
+	assert(rec != NULL);
+	assert(t0 != NULL);
+	assert(msgs != NULL);
+
+	xfer.timestamp = ts_to_ns(t0);
+	xfer.duration_us = duration_us;
+	xfer.result = result;
+	xfer.n_msgs = 0;
+	xfer.reserved = 0;
+
+	for (i = 0; i < n; ++i)
+		if (!i || !(msgs[i].flags & I2C_M_NOSTART))
+			++xfer.n_msgs;
+
+	pthread_mutex_lock(&rec->mutex);
+	fwrite(&xfer, sizeof xfer, 1, rec->f);
+
+	for (i = 0; i < n;) {
+		struct capture_msg msg;
+		unsigned j;
+
+		msg.addr = msgs[i].addr;
+		msg.flags = msgs[i].flags & ~I2C_M_NOSTART;
+		msg.len = msgs[i].len;
+
+		for (j = i + 1; (j < n) && (msgs[j].flags & I2C_M_NOSTART);
+		     ++j)
+			msg.len += msgs[j].len;
+
+		fwrite(&msg, sizeof msg, 1, rec->f);
+
+		for (; i < j; ++i)
+			fwrite(msgs[i].buf, 1, msgs[i].len, rec->f);
+	}
+
+	pthread_mutex_unlock(&rec->mutex);
+}
+
+/* ----------------------------------------------------------------------------
+ * static functions
+ */
+
+static void *replay_open(const char *path, struct plhw_config *config)
+{
+	struct i2creplay *p;
+	const char *speed;
+
+	p = malloc(sizeof (struct i2creplay));
+
+	if (p == NULL)
+		return NULL;
+
+	if (replay_load(p, path) < 0)
+		goto err_free_p;
+
+	speed = plhw_config_get_str(config, "i2c-replay-speed", NULL);
+	p->speed = (speed == NULL) ? 1.0 : strtod(speed, NULL);
+	p->pos = 0;
+	p->last = -1;
+
+	LOG("replaying %zu transfers from %s, speed: %.2f", p->n_xfers, path,
+	    p->speed);
+
+	return p;
+
+err_free_p:
+	free(p);
+
+	return NULL;
+}
+
+static int replay_rdwr(void *priv, struct i2c_msg *msgs, unsigned n)
+{
+	struct i2creplay * const p = priv;
+	const struct replay_xfer *x;
+	size_t end;
+	size_t i;
+
+	/* The next recorded transfer, or the same as the last one when
+	 * polling a register more times than recorded, or one a bit further
+	 * when polling fewer times than recorded.  */
+	if ((p->pos < p->n_xfers) && replay_match(&p->xfers[p->pos], msgs, n))
+		i = p->pos;
+	else if ((p->last >= 0) && replay_match(&p->xfers[p->last], msgs, n))
+		return replay_serve(&p->xfers[p->last], msgs, n);
+	else {
+		end = p->pos + REPLAY_WINDOW;
+
+		if (end > p->n_xfers)
+			end = p->n_xfers;
+
+		for (i = p->pos + 1; i < end; ++i)
+			if (replay_match(&p->xfers[i], msgs, n))
+				break;
+
+		if (i >= end) {
+			LOG("no match in capture at position %zu "
+			    "(addr: 0x%02X)", p->pos, msgs[0].addr);
+			return -EIO;
+		}
+	}
+
+	x = &p->xfers[i];
+	replay_wait(p, x);
+	p->pos = i + 1;
+	p->last = i;
+
+	return replay_serve(x, msgs, n);
+}
+
+static void replay_close(void *priv)
+{
+	struct i2creplay * const p = priv;
+
+	free(p->xfers);
+	free(p->capture);
+	free(p);
+}
+
+static int replay_load(struct i2creplay *p, const char *path)
+{
+	const struct capture_header *header;
+	size_t size;
+	size_t offset;
+	size_t n_xfers;
+	long fsize;
+	FILE *f;
+
+	f = fopen(path, "rb");
+
+	if (f == NULL) {
+		LOG("failed to open capture file: %s", path);
+		return -1;
+	}
+
+	if (fseek(f, 0, SEEK_END) || ((fsize = ftell(f)) < 0)
+	    || fseek(f, 0, SEEK_SET))
+		goto err_close_f;
+
+	size = fsize;
+	p->capture = malloc(size ? size : 1);
+
+	if (p->capture == NULL)
+		goto err_close_f;
+
+	if (fread(p->capture, 1, size, f) != size)
+		goto err_free_capture;
+
+	header = (const struct capture_header *) p->capture;
+
+	if ((size < sizeof *header)
+	    || memcmp(header->magic, CAPTURE_MAGIC, sizeof header->magic)
+	    || (header->version != CAPTURE_VERSION)) {
+		LOG("invalid capture file: %s", path);
+		goto err_free_capture;
+	}
+
+	p->xfers = NULL;
+	p->n_xfers = 0;
+	n_xfers = 0;
+
+	for (offset = sizeof *header; offset < size;) {
+		struct replay_xfer *x;
+		unsigned i;
+
+		if (p->n_xfers == n_xfers) {
+			struct replay_xfer *xfers;
+
+			n_xfers += 256;
+			xfers = realloc(p->xfers, n_xfers * sizeof *xfers);
+
+			if (xfers == NULL)
+				goto err_free_xfers;
+
+			p->xfers = xfers;
+		}
+
+		x = &p->xfers[p->n_xfers];
+
+		if ((size - offset) < sizeof x->xfer)
+			goto err_truncated;
+
+		memcpy(&x->xfer, &p->capture[offset], sizeof x->xfer);
+		offset += sizeof x->xfer;
+		x->msgs = &p->capture[offset];
+
+		for (i = 0; i < x->xfer.n_msgs; ++i) {
+			struct capture_msg msg;
+
+			if ((size - offset) < sizeof msg)
+				goto err_truncated;
+
+			memcpy(&msg, &p->capture[offset], sizeof msg);
+			offset += sizeof msg;
+
+			if ((size - offset) < msg.len)
+				goto err_truncated;
+
+			offset += msg.len;
+		}
+
+		++p->n_xfers;
+	}
+
+	fclose(f);
+
+	return 0;
+
+err_truncated:
+	LOG("truncated capture file: %s", path);
+err_free_xfers:
+	free(p->xfers);
+err_free_capture:
+	free(p->capture);
+err_close_f:
+	fclose(f);
+
+	return -1;
+}
+
+/* The register address written before a read must be the same, but the
+ * data of plain writes may differ (i.e. after a driver change) so only the
+ * first byte with the register address is compared.  */
+static int replay_match(const struct replay_xfer *x,
+			const struct i2c_msg *msgs, unsigned n)
+{
+	const uint8_t *it = x->msgs;
+	unsigned i;
+
+	if (x->xfer.n_msgs != n)
+		return 0;
+
+	for (i = 0; i < n; ++i) {
+		const uint8_t *data = it + sizeof (struct capture_msg);
+		const int rd = msgs[i].flags & I2C_M_RD;
+		struct capture_msg msg;
+
+		memcpy(&msg, it, sizeof msg);
+
+		if ((msg.addr != msgs[i].addr) || (msg.len != msgs[i].len)
+		    || ((msg.flags & I2C_M_RD) != rd))
+			return 0;
+
+		if (!rd && msg.len) {
+			const int reg_ptr = ((i + 1) < n)
+				&& (msgs[i + 1].flags & I2C_M_RD);
+			const size_t cmp_len = reg_ptr ? msg.len : 1;
+
+			if (memcmp(data, msgs[i].buf, cmp_len))
+				return 0;
+		}
+
+		it = data + msg.len;
+	}
+
+	return 1;
+}
+
+static int replay_serve(const struct replay_xfer *x, struct i2c_msg *msgs,
+			unsigned n)
+{
+	const uint8_t *it = x->msgs;
+	unsigned i;
+
+	for (i = 0; i < n; ++i) {
+		const uint8_t *data = it + sizeof (struct capture_msg);
+		struct capture_msg msg;
+
+		memcpy(&msg, it, sizeof msg);
+
+		if (msgs[i].flags & I2C_M_RD)
+			memcpy(msgs[i].buf, data, msg.len);
+
+		it = data + msg.len;
+	}
+
+	return x->xfer.result;
+}
+
+/* Wait until the transfer is due relatively to the first replayed one, so
+ * the time spent by the driver between transfers is taken into account. */
+static void replay_wait(struct i2creplay *p, const struct replay_xfer *x)
+{
+	struct timespec now;
+	uint64_t due;
+	uint64_t t;
+
+	if (p->speed <= 0.0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (p->last < 0) {
+		p->base = x->xfer.timestamp;
+		p->start = now;
+	}
+
+	due = ts_to_ns(&p->start)
+		+ (x->xfer.timestamp - p->base) / p->speed
+		+ (x->xfer.duration_us * 1000ULL) / p->speed;
+	t = ts_to_ns(&now);
+
+	if (due > t) {
+		struct timespec delay;
+
+		delay.tv_sec = (due - t) / 1000000000ULL;
+		delay.tv_nsec = (due - t) % 1000000000ULL;
+		nanosleep(&delay, NULL);
+	}
+}
+
+static uint64_t ts_to_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
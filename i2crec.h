@@ -0,0 +1,49 @@
+/*
+  Plastic Logic hardware library - i2crec
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INCLUDE_I2CREC_H
+#define INCLUDE_I2CREC_H 1
+
+#include "i2cdev.h"
+#include <time.h>
+
+/* Capture file: a header followed by one record per transfer, each with the
+ * list of messages and all their data (written or read).  Messages sent
+ * with I2C_M_NOSTART are merged with the previous one, and SMBus transfers
+ * are recorded as the equivalent I2C messages, so a capture can always be
+ * replayed with plain I2C_RDWR transfers.  */
+struct i2crec;
+
+extern struct i2crec *i2crec_open(const char *path);
+extern void i2crec_close(struct i2crec *rec);
+extern void i2crec_add(struct i2crec *rec, const struct timespec *t0,
+		       unsigned long duration_us, const struct i2c_msg *msgs,
+		       unsigned n, int result);
+
+/* Replay transport, used with a "replay:<capture file>" bus path.  The
+ * transfers are matched with the capture in order, skipping a few recorded
+ * ones or repeating the last one to cope with variable polling loops, and
+ * get the recorded read data and result.  The i2c-replay-speed
+ * configuration value is the speed factor (1 by default to reproduce the
+ * recorded timings, 0 to run without any delay).  */
+extern const struct i2cdev_bus_ops i2creplay_ops;
+
+#endif /* INCLUDE_I2CREC_H */
@@ -0,0 +1,790 @@
+/*
+  Plastic Logic hardware library - i2csim
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "i2csim.h"
+#include "plhw_config.h"
+#include "max17135.h"
+#include "tps65185.h"
+#include <linux/i2c.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_TAG "i2csim"
+#include <plsdk/log.h>
+
+#define SIM_MAX_DEVS 16
+#define SIM_DEFAULT_POK_US 20000
+#define SIM_TPS65185_POWER_US 10000
+#define SIM_EEPROM_WRITE_US 5000
+#define SIM_EEPROM_DEFAULT_MODE "24c256"
+
+struct sim_dev;
+
+struct sim_model {
+	const char *name;
+	uint8_t addr;
+	int (*init)(struct sim_dev *dev, struct plhw_config *config);
+	int (*start)(struct sim_dev *dev);   /* 0 or -ENXIO to NAK */
+	void (*write)(struct sim_dev *dev, const uint8_t *data, size_t len);
+	void (*read)(struct sim_dev *dev, uint8_t *data, size_t len);
+	void (*stop)(struct sim_dev *dev);
+	/* for the register based devices, see regdev_write and regdev_read */
+	uint8_t (*read_reg)(struct sim_dev *dev, uint8_t reg, unsigned idx);
+	void (*write_reg)(struct sim_dev *dev, uint8_t reg, uint8_t value);
+};
+
+/* The state of all the models, each one only uses what it needs.  The
+ * counters are reset for each start condition. */
+struct sim_dev {
+	const struct sim_model *model;
+	uint8_t addr;
+	int addressed;
+	unsigned n_written;
+	unsigned n_read;
+	size_t ptr;
+	uint8_t regs[256];
+	uint8_t *mem;
+	size_t mem_size;
+	size_t page_size;
+	size_t offset_size;
+	int dirty;
+	long long t_event;
+	long long delay_us;
+};
+
+struct i2csim {
+	struct sim_dev devs[SIM_MAX_DEVS];
+	unsigned n_devs;
+	long bus_khz;
+};
+
+static void *sim_open(const char *arg, struct plhw_config *config);
+static int sim_rdwr(void *priv, struct i2c_msg *msgs, unsigned n);
+static void sim_close(void *priv);
+static int sim_add(struct i2csim *sim, const struct sim_model *model,
+		   int addr, struct plhw_config *config);
+static struct sim_dev *sim_find(struct i2csim *sim, uint16_t addr);
+static long long now_us(void);
+
+static int start_default(struct sim_dev *dev);
+static void regdev_write(struct sim_dev *dev, const uint8_t *data,
+			 size_t len);
+static void regdev_read(struct sim_dev *dev, uint8_t *data, size_t len);
+static uint8_t regdev_read_reg(struct sim_dev *dev, uint8_t reg,
+			       unsigned idx);
+static void regdev_write_reg(struct sim_dev *dev, uint8_t reg,
+			     uint8_t value);
+
+static int max17135_init(struct sim_dev *dev, struct plhw_config *config);
+static int max17135_start(struct sim_dev *dev);
+static uint8_t max17135_read_reg(struct sim_dev *dev, uint8_t reg,
+				 unsigned idx);
+static void max17135_write_reg(struct sim_dev *dev, uint8_t reg,
+			       uint8_t value);
+static int tps65185_init(struct sim_dev *dev, struct plhw_config *config);
+static int tps65185_start(struct sim_dev *dev);
+static uint8_t tps65185_read_reg(struct sim_dev *dev, uint8_t reg,
+				 unsigned idx);
+static void tps65185_write_reg(struct sim_dev *dev, uint8_t reg,
+			       uint8_t value);
+static int eeprom_init(struct sim_dev *dev, struct plhw_config *config);
+static int eeprom_start(struct sim_dev *dev);
+static void eeprom_write(struct sim_dev *dev, const uint8_t *data,
+			 size_t len);
+static void eeprom_read(struct sim_dev *dev, uint8_t *data, size_t len);
+static void eeprom_stop(struct sim_dev *dev);
+static int cpld_init(struct sim_dev *dev, struct plhw_config *config);
+static void cpld_write(struct sim_dev *dev, const uint8_t *data, size_t len);
+static void cpld_read(struct sim_dev *dev, uint8_t *data, size_t len);
+static int pcf8574_init(struct sim_dev *dev, struct plhw_config *config);
+static void pcf8574_write(struct sim_dev *dev, const uint8_t *data,
+			  size_t len);
+static void pcf8574_read(struct sim_dev *dev, uint8_t *data, size_t len);
+static void max11607_write(struct sim_dev *dev, const uint8_t *data,
+			   size_t len);
+static void max11607_read(struct sim_dev *dev, uint8_t *data, size_t len);
+static void max5820_write(struct sim_dev *dev, const uint8_t *data,
+			  size_t len);
+static void max5820_read(struct sim_dev *dev, uint8_t *data, size_t len);
+
+const struct i2cdev_bus_ops i2csim_ops = {
+	.prefix = "sim:",
+	.funcs = I2C_FUNC_I2C | I2C_FUNC_NOSTART,
+	.open = sim_open,
+	.rdwr = sim_rdwr,
+	.close = sim_close,
+};
+
+static const struct sim_model sim_models[] = {
+	{ "max17135", 0x48, max17135_init, max17135_start, regdev_write,
+	  regdev_read, NULL, max17135_read_reg, max17135_write_reg },
+	{ "tps65185", 0x68, tps65185_init, tps65185_start, regdev_write,
+	  regdev_read, NULL, tps65185_read_reg, tps65185_write_reg },
+	{ "eeprom", 0x50, eeprom_init, eeprom_start, eeprom_write,
+	  eeprom_read, eeprom_stop, NULL, NULL },
+	{ "cpld", 0x70, cpld_init, start_default, cpld_write, cpld_read,
+	  NULL, NULL, NULL },
+	{ "pcf8574", 0x21, pcf8574_init, start_default, pcf8574_write,
+	  pcf8574_read, NULL, NULL, NULL },
+	{ "max11607", 0x34, NULL, start_default, max11607_write,
+	  max11607_read, NULL, NULL, NULL },
+	{ "max5820", 0x39, NULL, start_default, max5820_write,
+	  max5820_read, NULL, NULL, NULL },
+	{ NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+/* ----------------------------------------------------------------------------
+ * static functions
+ */
+
+static void *sim_open(const char *arg, struct plhw_config *config)
+{
+	const struct sim_model *model;
+	struct i2csim *sim;
+	char *args;
+	char *tok;
+	char *save;
+
+	sim = malloc(sizeof (struct i2csim));
+
+	if (sim == NULL)
+		return NULL;
+
+	sim->n_devs = 0;
+	sim->bus_khz = plhw_config_get_int(config, "i2c-sim-khz", 0);
+
+	if (*arg == '\0') {
+		for (model = sim_models; model->name != NULL; ++model)
+			if (sim_add(sim, model, model->addr, config))
+				goto err_free_sim;
+
+		return sim;
+	}
+
+	args = strdup(arg);
+
+	if (args == NULL)
+		goto err_free_sim;
+
+	for (tok = strtok_r(args, ",", &save); tok != NULL;
+	     tok = strtok_r(NULL, ",", &save)) {
+		char *at = strchr(tok, '@');
+		int addr = -1;
+
+		if (at != NULL) {
+			*at = '\0';
+			addr = strtol(at + 1, NULL, 0);
+		}
+
+		for (model = sim_models; model->name != NULL; ++model)
+			if (!strcmp(tok, model->name))
+				break;
+
+		if (model->name == NULL) {
+			LOG("unknown model: %s", tok);
+			goto err_free_args;
+		}
+
+		if (sim_add(sim, model, (addr < 0) ? model->addr : addr,
+			    config))
+			goto err_free_args;
+	}
+
+	free(args);
+
+	return sim;
+
+err_free_args:
+	free(args);
+err_free_sim:
+	sim_close(sim);
+
+	return NULL;
+}
+
+static int sim_rdwr(void *priv, struct i2c_msg *msgs, unsigned n)
+{
+	struct i2csim * const sim = priv;
+	struct sim_dev *dev = NULL;
+	size_t n_bytes = 0;
+	unsigned i;
+	int ret = 0;
+
+	for (i = 0; i < n; ++i) {
+		struct i2c_msg * const m = &msgs[i];
+
+		if (!(m->flags & I2C_M_NOSTART) || (dev == NULL)) {
+			dev = sim_find(sim, m->addr);
+
+			if ((dev == NULL) || dev->model->start(dev)) {
+				dev = NULL;
+
+				if (m->flags & I2C_M_IGNORE_NAK)
+					continue;
+
+				ret = -ENXIO;
+				break;
+			}
+
+			dev->addressed = 1;
+			dev->n_written = 0;
+			dev->n_read = 0;
+			++n_bytes;
+		}
+
+		if (m->flags & I2C_M_RD)
+			dev->model->read(dev, m->buf, m->len);
+		else
+			dev->model->write(dev, m->buf, m->len);
+
+		n_bytes += m->len;
+	}
+
+	for (i = 0; i < sim->n_devs; ++i) {
+		struct sim_dev * const it = &sim->devs[i];
+
+		if (it->addressed) {
+			it->addressed = 0;
+
+			if (it->model->stop != NULL)
+				it->model->stop(it);
+		}
+	}
+
+	if (sim->bus_khz > 0) {
+		/* 9 clock cycles per byte, plus the start and stop bits */
+		const long long ns =
+			((n_bytes * 9 + 2) * 1000000LL) / sim->bus_khz;
+		struct timespec delay;
+
+		delay.tv_sec = ns / 1000000000LL;
+		delay.tv_nsec = ns % 1000000000LL;
+		nanosleep(&delay, NULL);
+	}
+
+	return ret;
+}
+
+static void sim_close(void *priv)
+{
+	struct i2csim * const sim = priv;
+	unsigned i;
+
+	for (i = 0; i < sim->n_devs; ++i)
+		free(sim->devs[i].mem);
+
+	free(sim);
+}
+
+static int sim_add(struct i2csim *sim, const struct sim_model *model,
+		   int addr, struct plhw_config *config)
+{
+	struct sim_dev *dev;
+
+	if (sim->n_devs == SIM_MAX_DEVS) {
+		LOG("too many devices");
+		return -1;
+	}
+
+	if (sim_find(sim, addr) != NULL) {
+		LOG("address already used: 0x%02X", addr);
+		return -1;
+	}
+
+	dev = &sim->devs[sim->n_devs];
+	memset(dev, 0, sizeof *dev);
+	dev->model = model;
+	dev->addr = addr;
+
+	if ((model->init != NULL) && model->init(dev, config)) {
+		LOG("failed to initialise %s", model->name);
+		return -1;
+	}
+
+	++sim->n_devs;
+
+	return 0;
+}
+
+static struct sim_dev *sim_find(struct i2csim *sim, uint16_t addr)
+{
+	unsigned i;
+
+	for (i = 0; i < sim->n_devs; ++i)
+		if (sim->devs[i].addr == addr)
+			return &sim->devs[i];
+
+	return NULL;
+}
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
+}
+
+/* --- generic devices --- */
+
+static int start_default(struct sim_dev *dev)
+{
+	return 0;
+}
+
+/* The first byte written sets the register pointer, which is then
+ * incremented after each byte written or read. */
+static void regdev_write(struct sim_dev *dev, const uint8_t *data,
+			 size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i, ++dev->n_written) {
+		if (!dev->n_written)
+			dev->ptr = data[i];
+		else
+			dev->model->write_reg(dev, dev->ptr++, data[i]);
+	}
+}
+
+static void regdev_read(struct sim_dev *dev, uint8_t *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i, ++dev->n_read)
+		data[i] = dev->model->read_reg(dev, dev->ptr, dev->n_read);
+}
+
+static uint8_t regdev_read_reg(struct sim_dev *dev, uint8_t reg,
+			       unsigned idx)
+{
+	return dev->regs[(uint8_t) (reg + idx)];
+}
+
+static void regdev_write_reg(struct sim_dev *dev, uint8_t reg,
+			     uint8_t value)
+{
+	dev->regs[reg] = value;
+}
+
+/* --- MAX17135 --- */
+
+#define MAX17135_EN 0x01
+#define MAX17135_POK 0x80
+
+static int max17135_init(struct sim_dev *dev, struct plhw_config *config)
+{
+	static const uint8_t timings[8] = {
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01
+	};
+
+	dev->regs[MAX17135_REG_PROD_REV] = 0x00;
+	dev->regs[MAX17135_REG_PROD_ID] = 0x4D;
+	dev->regs[MAX17135_REG_DVR] = 0x6B;
+	memcpy(&dev->regs[MAX17135_REG_TIMING_1], timings, sizeof timings);
+	dev->delay_us = plhw_config_get_int(config, "i2c-sim-pok-us",
+					    SIM_DEFAULT_POK_US);
+
+	return 0;
+}
+
+static int max17135_start(struct sim_dev *dev)
+{
+	uint8_t * const fault = &dev->regs[MAX17135_REG_FAULT];
+
+	if (!(dev->regs[MAX17135_REG_ENABLE] & MAX17135_EN))
+		*fault &= ~MAX17135_POK;
+	else if ((now_us() - dev->t_event) >= dev->delay_us)
+		*fault |= MAX17135_POK;
+
+	return 0;
+}
+
+/* The temperature registers are 2 bytes wide, 25 degrees C */
+static uint8_t max17135_read_reg(struct sim_dev *dev, uint8_t reg,
+				 unsigned idx)
+{
+	static const unsigned TEMP = (25 * 2) << 7;
+
+	if ((reg == MAX17135_REG_EXT_TEMP) || (reg == MAX17135_REG_INT_TEMP))
+		return (idx % 2) ? (TEMP & 0xFF) : (TEMP >> 8);
+
+	return regdev_read_reg(dev, reg, idx);
+}
+
+static void max17135_write_reg(struct sim_dev *dev, uint8_t reg,
+			       uint8_t value)
+{
+	switch (reg) {
+	case MAX17135_REG_ENABLE:
+		if ((value & MAX17135_EN)
+		    && !(dev->regs[reg] & MAX17135_EN))
+			dev->t_event = now_us();
+		dev->regs[reg] = value;
+		break;
+	case MAX17135_REG_CONF:
+	case MAX17135_REG_DVR:
+	case MAX17135_REG_PROG:
+	case MAX17135_REG_TIMING_1 ... MAX17135_REG_TIMING_8:
+		dev->regs[reg] = value;
+		break;
+	default: /* read-only */
+		break;
+	}
+}
+
+/* --- TPS65185 --- */
+
+#define TPS65185_ACTIVE 0x80
+#define TPS65185_STANDBY 0x40
+#define TPS65185_PG_ALL 0xFA
+
+static int tps65185_init(struct sim_dev *dev, struct plhw_config *config)
+{
+	static const uint8_t defaults[] = {
+		[TPS65185_REG_TMST_VALUE] = 25,
+		[TPS65185_REG_VADJ] = 0x03,
+		[TPS65185_REG_VCOM1] = 0x7D,
+		[TPS65185_REG_INT_EN1] = 0x7F,
+		[TPS65185_REG_INT_EN2] = 0xFF,
+		[TPS65185_REG_UPSEQ0] = 0xE4,
+		[TPS65185_REG_UPSEQ1] = 0x55,
+		[TPS65185_REG_DWNSEQ0] = 0x1E,
+		[TPS65185_REG_DWNSEQ1] = 0xE0,
+		[TPS65185_REG_TMST1] = 0x20,
+		[TPS65185_REG_TMST2] = 0x78,
+		[TPS65185_REG_REV_ID] = 0x65,
+	};
+
+	memcpy(dev->regs, defaults, sizeof defaults);
+	dev->delay_us = SIM_TPS65185_POWER_US;
+
+	return 0;
+}
+
+/* The ACTIVE and STANDBY bits clear themselves once the transition is
+ * complete, and the power good status follows. */
+static int tps65185_start(struct sim_dev *dev)
+{
+	uint8_t * const en = &dev->regs[TPS65185_REG_ENABLE];
+
+	if (!(*en & (TPS65185_ACTIVE | TPS65185_STANDBY)))
+		return 0;
+
+	if ((now_us() - dev->t_event) < dev->delay_us)
+		return 0;
+
+	dev->regs[TPS65185_REG_PG_STAT] =
+		(*en & TPS65185_ACTIVE) ? TPS65185_PG_ALL : 0x00;
+	dev->regs[TPS65185_REG_INT2] |= 0x01; /* PGOOD changed */
+	*en &= ~(TPS65185_ACTIVE | TPS65185_STANDBY);
+
+	return 0;
+}
+
+static uint8_t tps65185_read_reg(struct sim_dev *dev, uint8_t reg,
+				 unsigned idx)
+{
+	const uint8_t r = reg + idx;
+	const uint8_t value = dev->regs[r];
+
+	if ((r == TPS65185_REG_INT1) || (r == TPS65185_REG_INT2))
+		dev->regs[r] = 0;
+
+	return value;
+}
+
+static void tps65185_write_reg(struct sim_dev *dev, uint8_t reg,
+			       uint8_t value)
+{
+	switch (reg) {
+	case TPS65185_REG_ENABLE:
+		if (value & (TPS65185_ACTIVE | TPS65185_STANDBY))
+			dev->t_event = now_us();
+		dev->regs[reg] = value;
+		break;
+	case TPS65185_REG_TMST_VALUE:
+	case TPS65185_REG_INT1:
+	case TPS65185_REG_INT2:
+	case TPS65185_REG_PG_STAT:
+	case TPS65185_REG_REV_ID:
+		break;
+	default:
+		regdev_write_reg(dev, reg, value);
+		break;
+	}
+}
+
+/* --- 24Cxx EEPROM --- */
+
+static int eeprom_init(struct sim_dev *dev, struct plhw_config *config)
+{
+	const char *mode;
+	unsigned kbits;
+
+	mode = plhw_config_get_str(config, "i2c-sim-eeprom",
+				   SIM_EEPROM_DEFAULT_MODE);
+
+	if (strncmp(mode, "24c", 3) || !(kbits = strtoul(&mode[3], NULL, 10))
+	    || (kbits & (kbits - 1)) || (kbits > 1024)) {
+		LOG("unsupported EEPROM mode: %s", mode);
+		return -1;
+	}
+
+	dev->mem_size = kbits * 128;
+	dev->page_size = (kbits > 128) ? 64 : 16;
+	dev->offset_size = (kbits > 16) ? 2 : 1;
+	dev->mem = malloc(dev->mem_size);
+
+	if (dev->mem == NULL)
+		return -1;
+
+	memset(dev->mem, 0xFF, dev->mem_size);
+	dev->delay_us = SIM_EEPROM_WRITE_US;
+
+	return 0;
+}
+
+/* No acknowledge during the write cycle */
+static int eeprom_start(struct sim_dev *dev)
+{
+	return (now_us() < dev->t_event) ? -ENXIO : 0;
+}
+
+/* The data bytes wrap around within the current page */
+static void eeprom_write(struct sim_dev *dev, const uint8_t *data,
+			 size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i, ++dev->n_written) {
+		if (dev->n_written < dev->offset_size) {
+			dev->ptr = (dev->n_written ? (dev->ptr << 8) : 0)
+				| data[i];
+			dev->ptr %= dev->mem_size;
+		} else {
+			const size_t page = dev->ptr - (dev->ptr %
+							dev->page_size);
+
+			dev->mem[dev->ptr] = data[i];
+			dev->ptr = page + ((dev->ptr + 1) % dev->page_size);
+			dev->dirty = 1;
+		}
+	}
+}
+
+static void eeprom_read(struct sim_dev *dev, uint8_t *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		data[i] = dev->mem[dev->ptr];
+		dev->ptr = (dev->ptr + 1) % dev->mem_size;
+	}
+}
+
+static void eeprom_stop(struct sim_dev *dev)
+{
+	if (dev->dirty) {
+		dev->dirty = 0;
+		dev->t_event = now_us() + dev->delay_us;
+	}
+}
+
+/* --- CPLD --- */
+
+static int cpld_init(struct sim_dev *dev, struct plhw_config *config)
+{
+	dev->regs[0] = 1 << 2; /* API version 1 */
+	dev->regs[1] = 1 << 4; /* build version 1 */
+	dev->regs[2] = 0x02;   /* board identifier */
+
+	return 0;
+}
+
+static void cpld_write(struct sim_dev *dev, const uint8_t *data, size_t len)
+{
+	static const uint8_t rw_mask[3] = { 0x03, 0x0F, 0x00 };
+	size_t i;
+
+	for (i = 0; i < len; ++i, ++dev->n_written) {
+		const unsigned b = dev->n_written % 3;
+
+		dev->regs[b] = (dev->regs[b] & ~rw_mask[b])
+			| (data[i] & rw_mask[b]);
+	}
+}
+
+static void cpld_read(struct sim_dev *dev, uint8_t *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i, ++dev->n_read)
+		data[i] = dev->regs[dev->n_read % 3];
+}
+
+/* --- PCF8574 --- */
+
+static int pcf8574_init(struct sim_dev *dev, struct plhw_config *config)
+{
+	dev->regs[0] = 0xFF; /* output latch */
+	dev->regs[1] = 0xFF; /* input levels */
+
+	return 0;
+}
+
+static void pcf8574_write(struct sim_dev *dev, const uint8_t *data,
+			  size_t len)
+{
+	if (len)
+		dev->regs[0] = data[len - 1];
+}
+
+/* Quasi-bidirectional: a pin driven low reads low */
+static void pcf8574_read(struct sim_dev *dev, uint8_t *data, size_t len)
+{
+	memset(data, dev->regs[0] & dev->regs[1], len);
+}
+
+/* --- MAX11607 --- */
+
+#define MAX11607_SETUP 0x80
+#define MAX11607_NB_CHANNELS 4
+
+static void max11607_write(struct sim_dev *dev, const uint8_t *data,
+			   size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		dev->regs[(data[i] & MAX11607_SETUP) ? 0 : 1] = data[i];
+}
+
+/* Scan from channel 0 to the selected one, results are 0x200 + 0x10 * n */
+static void max11607_read(struct sim_dev *dev, uint8_t *data, size_t len)
+{
+	const unsigned cs = (dev->regs[1] >> 1) & 0x0F;
+	const unsigned n_ch = (cs < MAX11607_NB_CHANNELS) ?
+		(cs + 1) : MAX11607_NB_CHANNELS;
+	size_t i;
+
+	for (i = 0; i < len; ++i, ++dev->n_read) {
+		const unsigned ch = (dev->n_read / 2) % n_ch;
+		const unsigned value = 0x200 + (0x10 * ch);
+
+		data[i] = (dev->n_read % 2) ?
+			(value & 0xFF) : (0xFC | (value >> 8));
+	}
+}
+
+/* --- MAX5820 --- */
+
+enum max5820_sim_reg {
+	MAX5820_IN_A = 0,
+	MAX5820_IN_B,
+	MAX5820_DAC_A,
+	MAX5820_DAC_B,
+	MAX5820_PD_A,
+	MAX5820_PD_B,
+	MAX5820_RD_CH,
+	MAX5820_CMD,
+};
+
+static void max5820_write(struct sim_dev *dev, const uint8_t *data,
+			  size_t len)
+{
+	uint8_t * const r = dev->regs;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		unsigned cmd;
+		uint8_t value;
+
+		if (!(dev->n_written % 2)) {
+			if ((data[i] == 0xF1) || (data[i] == 0xF2)) {
+				r[MAX5820_RD_CH] = data[i] & 0x03;
+				continue;
+			}
+
+			r[MAX5820_CMD] = data[i];
+			++dev->n_written;
+			continue;
+		}
+
+		++dev->n_written;
+		cmd = r[MAX5820_CMD] >> 4;
+		value = ((r[MAX5820_CMD] & 0x0F) << 4) | (data[i] >> 4);
+
+		switch (cmd) {
+		case 0x0:
+			r[MAX5820_IN_A] = r[MAX5820_DAC_A] = value;
+			r[MAX5820_DAC_B] = r[MAX5820_IN_B];
+			break;
+		case 0x1:
+			r[MAX5820_IN_B] = r[MAX5820_DAC_B] = value;
+			r[MAX5820_DAC_A] = r[MAX5820_IN_A];
+			break;
+		case 0x4: r[MAX5820_IN_A] = value; break;
+		case 0x5: r[MAX5820_IN_B] = value; break;
+		case 0x8:
+		case 0x9:
+			r[MAX5820_DAC_A] = r[MAX5820_IN_A];
+			r[MAX5820_DAC_B] = r[MAX5820_IN_B];
+			r[(cmd == 0x8) ? MAX5820_IN_A : MAX5820_IN_B] = value;
+			break;
+		case 0xC:
+			r[MAX5820_IN_A] = r[MAX5820_DAC_A] = value;
+			r[MAX5820_IN_B] = r[MAX5820_DAC_B] = value;
+			break;
+		case 0xD:
+			r[MAX5820_IN_A] = r[MAX5820_IN_B] = value;
+			break;
+		case 0xE:
+			r[MAX5820_DAC_A] = r[MAX5820_IN_A];
+			r[MAX5820_DAC_B] = r[MAX5820_IN_B];
+			break;
+		case 0xF:
+			if (data[i] & 0x04)
+				r[MAX5820_PD_A] = data[i] & 0x03;
+			if (data[i] & 0x08)
+				r[MAX5820_PD_B] = data[i] & 0x03;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static void max5820_read(struct sim_dev *dev, uint8_t *data, size_t len)
+{
+	const int b = (dev->regs[MAX5820_RD_CH] == 2);
+	const uint8_t value = dev->regs[b ? MAX5820_DAC_B : MAX5820_DAC_A];
+	const uint8_t pd = dev->regs[b ? MAX5820_PD_B : MAX5820_PD_A];
+	size_t i;
+
+	for (i = 0; i < len; ++i, ++dev->n_read)
+		data[i] = (dev->n_read % 2) ?
+			((value & 0x0F) << 4) : ((pd << 4) | (value >> 4));
+}
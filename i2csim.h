@@ -0,0 +1,44 @@
+/*
+  Plastic Logic hardware library - i2csim
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INCLUDE_I2CSIM_H
+#define INCLUDE_I2CSIM_H 1
+
+#include "i2cdev.h"
+
+/* Simulated bus, used with a "sim:[model[@address],...]" bus path.  All the
+ * models are created with their default address if none is given:
+
+     max17135@0x48  HV PMIC, POK set i2c-sim-pok-us after EN (20ms)
+     tps65185@0x68  HV PMIC, ACTIVE/STANDBY transitions take 10ms
+     eeprom@0x50    24Cxx EEPROM, i2c-sim-eeprom mode (24c256), page wrap
+                    and NAK during the 5ms write cycle
+     cpld@0x70      CPLD API v1, 3 bytes
+     pcf8574@0x21   GPIO expander, all inputs high
+     max11607@0x34  4-channel ADC with fixed results
+     max5820@0x39   2-channel DAC
+
+ * Unknown addresses are not acknowledged (-ENXIO).  When i2c-sim-khz is
+ * set, each transfer takes the time it would take on the wire at that
+ * clock frequency.  */
+extern const struct i2cdev_bus_ops i2csim_ops;
+
+#endif /* INCLUDE_I2CSIM_H */
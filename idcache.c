@@ -0,0 +1,200 @@
+/*
+  Plastic Logic hardware library - idcache
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "idcache.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define LOG_TAG "idcache"
+#include <plsdk/log.h>
+
+#define IDCACHE_MAGIC "PLID"
+#define IDCACHE_VERSION 1
+#define IDCACHE_MAX_ENTRIES 32
+
+struct idcache_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t n_entries;
+};
+
+struct idcache_entry {
+	int cpld_address;
+	struct plhw_board_info info;
+};
+
+static int read_entries(const char *path, struct idcache_entry *entries,
+			size_t n);
+
+int idcache_load(const char *path, const char *i2c_bus, int cpld_address,
+		 struct plhw_board_info *info)
+{
+	struct idcache_entry entries[IDCACHE_MAX_ENTRIES];
+	int n;
+	int i;
+
+	assert(path != NULL);
+	assert(i2c_bus != NULL);
+	assert(info != NULL);
+
+	n = read_entries(path, entries, IDCACHE_MAX_ENTRIES);
+
+	for (i = 0; i < n; ++i) {
+		const struct idcache_entry * const e = &entries[i];
+
+		if ((e->cpld_address == cpld_address)
+		    && !strcmp(e->info.i2c_bus, i2c_bus)) {
+			memcpy(info, &e->info, sizeof *info);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int idcache_store(const char *path, int cpld_address,
+		  const struct plhw_board_info *info)
+{
+	struct idcache_entry entries[IDCACHE_MAX_ENTRIES];
+	struct idcache_header header;
+	char tmp_path[256];
+	int n;
+	int i;
+	FILE *f;
+
+	assert(path != NULL);
+	assert(info != NULL);
+
+	n = read_entries(path, entries, IDCACHE_MAX_ENTRIES);
+
+	if (n < 0)
+		n = 0;
+
+	for (i = 0; i < n; ++i)
+		if ((entries[i].cpld_address == cpld_address)
+		    && !strcmp(entries[i].info.i2c_bus, info->i2c_bus))
+			break;
+
+	/* drop the oldest entry when full */
+	if (i == IDCACHE_MAX_ENTRIES) {
+		memmove(&entries[0], &entries[1],
+			(--i) * sizeof (struct idcache_entry));
+		--n;
+	}
+
+	if (i == n)
+		++n;
+
+	memset(&entries[i], 0, sizeof (struct idcache_entry));
+	entries[i].cpld_address = cpld_address;
+	memcpy(&entries[i].info, info, sizeof *info);
+
+	if (snprintf(tmp_path, sizeof tmp_path, "%s.%ld", path,
+		     (long) getpid()) >= sizeof tmp_path) {
+		LOG("path too long (%s)", path);
+		return -1;
+	}
+
+	f = fopen(tmp_path, "wb");
+
+	if (f == NULL) {
+		LOG("failed to open %s", tmp_path);
+		return -1;
+	}
+
+	memcpy(header.magic, IDCACHE_MAGIC, sizeof header.magic);
+	header.version = IDCACHE_VERSION;
+	header.n_entries = n;
+
+	if ((fwrite(&header, sizeof header, 1, f) != 1) ||
+	    (fwrite(entries, sizeof entries[0], n, f) != n)) {
+		fclose(f);
+		goto err_unlink;
+	}
+
+	if (fclose(f) || rename(tmp_path, path))
+		goto err_unlink;
+
+	return 0;
+
+err_unlink:
+	LOG("failed to save identity cache (%s)", path);
+	unlink(tmp_path);
+
+	return -1;
+}
+
+/* ----------------------------------------------------------------------------
+ * static functions
+ */
+
+static int read_entries(const char *path, struct idcache_entry *entries,
+			size_t n)
+{
+	struct idcache_header header;
+	struct stat st;
+	FILE *f;
+	size_t i;
+	int ret = -1;
+
+	f = fopen(path, "rb");
+
+	if (f == NULL)
+		return -1;
+
+	if ((fread(&header, sizeof header, 1, f) != 1) ||
+	    memcmp(header.magic, IDCACHE_MAGIC, sizeof header.magic) ||
+	    (header.version != IDCACHE_VERSION)) {
+		LOG("invalid identity cache (%s)", path);
+		goto exit_close_file;
+	}
+
+	/* the file is only ever written in one go, so any other size means
+	 * it is corrupt rather than just holding fewer entries */
+	if ((header.n_entries > n) || fstat(fileno(f), &st) ||
+	    (st.st_size != (sizeof header
+			    + header.n_entries * sizeof entries[0]))) {
+		LOG("invalid identity cache size (%s)", path);
+		goto exit_close_file;
+	}
+
+	n = header.n_entries;
+
+	if (fread(entries, sizeof entries[0], n, f) != n) {
+		LOG("truncated identity cache (%s)", path);
+		goto exit_close_file;
+	}
+
+	for (i = 0; i < n; ++i)
+		entries[i].info.i2c_bus[sizeof entries[i].info.i2c_bus - 1] =
+			'\0';
+
+	ret = n;
+
+exit_close_file:
+	fclose(f);
+
+	return ret;
+}
@@ -0,0 +1,39 @@
+/*
+  Plastic Logic hardware library - idcache
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INCLUDE_IDCACHE_H
+#define INCLUDE_IDCACHE_H 1
+
+#include <libplhw.h>
+
+/* Identity of the parts found on each I2C bus, kept in a file between
+ * processes.  Entries are keyed by the bus path and the CPLD address, and
+ * the CPLD version and board ID they hold are compared with the ones read
+ * on start-up before the other values are used.  idcache_store replaces
+ * the file atomically, so concurrent processes only ever see complete
+ * entries.  */
+
+extern int idcache_load(const char *path, const char *i2c_bus,
+			int cpld_address, struct plhw_board_info *info);
+extern int idcache_store(const char *path, int cpld_address,
+			 const struct plhw_board_info *info);
+
+#endif /* INCLUDE_IDCACHE_H */
@@ -30,11 +30,19 @@
 
    This library provides low-level user-side functions to directly control the
    Plastic Logic display hardware.
+
+   The I2C device used by each part can be retrieved with its _get_i2c
+   function, for example to group accesses in transactions committed from
+   a worker thread, or to read the I2C statistics with the functions
+   declared in i2cdev.h.
 */
 
 /** Library version */
 #define PLHW_VERSION "1.3"
 
+/** I2C device of a part, see i2cdev.h */
+struct i2cdev;
+
 /** Invalid I2C address value */
 #define PLHW_NO_I2C_ADDR 0xFF
 
@@ -44,6 +52,112 @@
 #endif
 
 
+/**
+   @name Configuration
+   @{
+
+   The configuration file is parsed only once and shared by all the libplhw
+   instances.  To avoid parsing it altogether, a binary board profile can be
+   saved and then used by setting the PLHW_PROFILE environment variable to
+   its path.
+
+   When the lazy-init configuration value is set to 1, creating an instance
+   does not access the bus.  The identification reads and initial settings
+   are then done by the first operation which needs them, and this operation
+   fails if the part can't be reached.
+
+   The id-cache configuration value is the path to a file where
+   plhw_board_init keeps the parts found on each I2C bus with their
+   identification values.  When an entry exists, the board is created with
+   these parts and only the CPLD is read to check that its version and board
+   ID haven't changed, instead of probing the bus and reading each part's
+   identification registers.  Otherwise, or if they have changed, the
+   board is initialised as usual and the entry is updated.  With lazy-init,
+   the CPLD is only checked by its first operation, which fails if they
+   have changed, and the other parts read their identification registers
+   on first use as usual.  The entry is then updated by the next
+   plhw_board_init without lazy-init.
+*/
+
+/** Save the current configuration as a binary board profile
+    @param[in] path path to the profile file to create
+    @return 0 if success, -1 if error
+ */
+extern int plhw_save_profile(const char *path);
+
+/** @} */
+
+
+/**
+   @name Board discovery
+   @{
+
+   The I2C adapters listed in /sys/bus/i2c/devices are all probed in
+   parallel, each with a single I2C transfer reading the identification
+   registers of all the parts at their configured or default address.  The
+   transfer is only split to find out which parts are missing.
+*/
+
+/** Board parts, as found by the discovery */
+enum plhw_part {
+	PLHW_PART_CPLD     = 0x01,   /**< CPLD */
+	PLHW_PART_MAX17135 = 0x02,   /**< MAX17135 HVPMIC */
+	PLHW_PART_TPS65185 = 0x04,   /**< TPS65185 HVPMIC */
+	PLHW_PART_MAX5820  = 0x08,   /**< MAX5820 DAC */
+	PLHW_PART_MAX11607 = 0x10,   /**< MAX11607 ADC */
+	PLHW_PART_PBTN     = 0x20,   /**< push buttons GPIO expander */
+	PLHW_PART_EEPROM   = 0x40,   /**< EEPROM */
+};
+
+#define PLHW_EEPROM_DEF_I2C_ADDR 0x50 /**< default EEPROM I2C address */
+#define PLHW_I2C_BUS_SIZE 32          /**< size of an I2C bus path */
+
+/** Parts found on an I2C bus and their identification */
+struct plhw_board_info {
+	char i2c_bus[PLHW_I2C_BUS_SIZE]; /**< I2C bus device path */
+	unsigned parts;              /**< bit mask of enum plhw_part values */
+	int cpld_version;            /**< CPLD API version or -1 */
+	int cpld_board_id;           /**< board ID stored in CPLD or -1 */
+	int max17135_prod_id;        /**< MAX17135 product identifier or -1 */
+	int max17135_prod_rev;       /**< MAX17135 product revision or -1 */
+	int tps65185_rev_id;         /**< TPS65185 REV_ID register or -1 */
+};
+
+/** Probe the parts on a given I2C bus
+
+    The parts are first probed with plain reads.  The CPLD API version, the
+    MAX17135 product ID and the TPS65185 version are then checked before
+    reporting them.  The other parts have no identification register, so
+    they are only reported when one of these was found.
+
+    @param[in] i2c_bus path to the I2C bus device
+    @param[out] info board information
+    @return 0 if at least one part was found, -1 otherwise
+ */
+extern int plhw_discover_bus(const char *i2c_bus,
+			     struct plhw_board_info *info);
+
+/** Probe the parts on the configured I2C bus, or on all the I2C adapters
+
+    Only the bus set with the i2c-bus configuration key is probed, unless
+    all_buses is set: all the I2C adapters are then probed in parallel.
+    This accesses the addresses used by the parts on each adapter, with
+    register reads for the HVPMICs, so only do it when unknown devices
+    aren't affected.
+
+    @param[out] boards array to receive the information of each I2C bus
+           with at least one part found, in adapter number order
+    @param[in] n number of entries in the boards array
+    @param[in] all_buses probe all the I2C adapters instead of the
+           configured bus
+    @return number of entries filled in boards or -1 if error
+ */
+extern int plhw_discover(struct plhw_board_info *boards, size_t n,
+			 int all_buses);
+
+/** @} */
+
+
 /**
    @name CPLD
    @{
@@ -73,15 +187,21 @@ extern struct cpld *cpld_init(const char *i2c_bus, char i2c_address);
  */
 extern void cpld_free(struct cpld *cpld);
 
+/** Get the I2C device used by the CPLD, to use with i2cdev.h
+    @param[in] cpld cpld instance
+    @return I2C device instance
+ */
+extern struct i2cdev *cpld_get_i2c(struct cpld *cpld);
+
 /** Get the CPLD firmware version
     @param[in] cpld cpld instance
-    @return CPLD firmware version number
+    @return CPLD firmware version number or -1 if error
 */
 extern int cpld_get_version(const struct cpld *cpld);
 
 /** Get the board ID stored in CPLD firmware
     @param[in] cpld cpld instance
-    @return board ID stored in CPLD firmare
+    @return board ID stored in CPLD firmare or -1 if error
  */
 extern int cpld_get_board_id(const struct cpld *cpld);
 
@@ -95,7 +215,7 @@ extern size_t cpld_get_data_size(const struct cpld *cpld);
     @param[in] cpld cpld instance
     @param[out] data user buffer to receive the CPLD data
     @param[in] size size of the user buffer in bytes
-    @return number of bytes copied to the user buffer
+    @return number of bytes copied to the user buffer or -1 if error
  */
 extern int cpld_dump(const struct cpld *cpld, char *data, size_t size);
 
@@ -149,6 +269,18 @@ enum max17135_fault_id {
 	MAX17135_FAULT_OT,           /**< thermal shutdown */
 };
 
+/** Bits of the fault register, as returned by max17135_get_faults */
+enum max17135_fault_bit {
+	MAX17135_FAULT_BIT_FBPG    = 0x01, /**< GVDD undervoltage fault */
+	MAX17135_FAULT_BIT_HVINP   = 0x02, /**< HVINP undervoltage fault */
+	MAX17135_FAULT_BIT_HVINN   = 0x04, /**< HVINN undervoltage fault */
+	MAX17135_FAULT_BIT_FBNG    = 0x08, /**< GVEE undervoltage fault */
+	MAX17135_FAULT_BIT_HVINPSC = 0x10, /**< HVINP short-circuit fault */
+	MAX17135_FAULT_BIT_HVINNSC = 0x20, /**< HVINN short-circuit fault */
+	MAX17135_FAULT_BIT_OT      = 0x40, /**< thermal shutdown */
+	MAX17135_FAULT_BIT_POK     = 0x80, /**< power OK (not a fault) */
+};
+
 /** High-voltage power supply identifiers */
 enum max17135_en_id {
 	MAX17135_EN_EN = 1,          /**< main HV PSU */
@@ -171,15 +303,21 @@ extern struct max17135 *max17135_init(const char *i2c_bus, char i2c_address);
  */
 extern void max17135_free(struct max17135 *p);
 
+/** Get the I2C device used by the MAX17135, to use with i2cdev.h
+    @param[in] p max17135 instance
+    @return I2C device instance
+ */
+extern struct i2cdev *max17135_get_i2c(struct max17135 *p);
+
 /** Get product identifier code
     @param[in] p max17135 instance
-    @return product identifier code
+    @return product identifier code or -1 if error
 */
 extern int max17135_get_prod_id(struct max17135 *p);
 
 /** Get product revision number
     @param[in] p max17135 instance
-    @return product revision number
+    @return product revision number or -1 if error
  */
 extern int max17135_get_prod_rev(struct max17135 *p);
 
@@ -269,6 +407,48 @@ extern int max17135_get_temperature(struct max17135 *p, short *temp,
  */
 extern int max17135_get_temp_failure(struct max17135 *p);
 
+/** Temperature sample, read in the background by the temperature sampler */
+struct max17135_temp_sample {
+	short ext;                   /**< external sensor measurement */
+	short ext_avg;               /**< moving average of ext */
+	short in;                    /**< internal sensor measurement */
+	short in_avg;                /**< moving average of in */
+	int failure;                 /**< enum max17135_temp_failure code */
+	uint64_t timestamp_us;       /**< CLOCK_MONOTONIC time of the sample */
+};
+
+/** Start reading the temperatures in the background
+
+    A thread reads both temperature sensors and the temperature status
+    every period_ms milliseconds at the lowest bus priority.  While it is
+    running, max17135_get_temperature and max17135_get_temp_failure return
+    the last sampled values without any bus access, unless the last sample
+    is older than 2 periods (i.e. the bus is busy or failing) in which case
+    the registers are read directly.  The moving averages
+    are over the last 16 samples.  Starting the sampler again only changes
+    the period.  It must not be started or stopped while another thread
+    uses the same instance.
+
+    @param[in] p max17135 instance
+    @param[in] period_ms sampling period in milliseconds
+    @return 0 if success, -1 if error
+ */
+extern int max17135_start_temp_sampler(struct max17135 *p,
+				       unsigned period_ms);
+
+/** Stop the temperature sampler, also done by max17135_free
+    @param[in] p max17135 instance
+ */
+extern void max17135_stop_temp_sampler(struct max17135 *p);
+
+/** Get the last temperature sample, without any bus access
+    @param[in] p max17135 instance
+    @param[out] sample last sample
+    @return 0 if success, -1 if the sampler is not running or has no sample
+ */
+extern int max17135_get_temp_sample(struct max17135 *p,
+				    struct max17135_temp_sample *sample);
+
 /** Convert temperature value into degrees as floating point value
     @param[in] p max17135 instance
     @param[in] temp temperature measurement value
@@ -284,11 +464,22 @@ extern int max17135_get_pok(struct max17135 *p);
 
 /** Set POK delay
     @param[in] p max17135 instance
-    @param delay_us delay in micro-seconds to wait before polling POK status
+    @param delay_us delay in micro-seconds to wait before polling POK status,
+           until enough POK rise times have been observed at the current
+           temperature, and not used when waiting for POK with a GPIO line
  */
 extern void max17135_set_pok_delay(struct max17135 *p, unsigned delay_us);
 
 /** Wait for POK signal (block until set or timeout or I/O error)
+
+    When the MAX17135-pok-gpio configuration value gives the GPIO line
+    connected to the POK pin as "<gpiochip>:<offset>", this waits for the
+    line to become active and then confirms with the fault register.
+    Otherwise or if the line can't be used, the fault register is polled.
+    The time it takes for POK to be set is recorded for each temperature
+    band, based on the last max17135_get_temperature measurement, and used
+    to poll around the expected time on the next power-ups.
+
     @param[in] p max17135 instance
     @return 0 if success, -1 if error
  */
@@ -311,10 +502,65 @@ extern int max17135_get_en(struct max17135 *p, enum max17135_en_id id);
 
 /** Get fault identifier
     @param[in] p max17135 instance
-    @return fault identifier (>= 0) or -1 if error
+    @return first fault identifier (>= 0) or -1 if error
  */
 extern int max17135_get_fault(struct max17135 *p);
 
+/** Get all the faults and the POK status with a single register read
+    @param[in] p max17135 instance
+    @return enum max17135_fault_bit mask or -1 if error
+ */
+extern int max17135_get_faults(struct max17135 *p);
+
+/** Fault monitor event */
+struct max17135_fault_event {
+	uint8_t faults;              /**< enum max17135_fault_bit mask */
+	uint8_t changed;             /**< bits changed since the last event */
+	int temp_failure;            /**< enum max17135_temp_failure code */
+	uint64_t timestamp_us;       /**< CLOCK_MONOTONIC time of the sample */
+};
+
+/** Fault monitor callback, called in the monitor thread */
+typedef void (*max17135_fault_cb_t)(struct max17135 *p,
+				    const struct max17135_fault_event *event,
+				    void *arg);
+
+/** Start monitoring the faults in the background
+
+    A thread reads the fault register, including POK, and the temperature
+    status every period_ms milliseconds with a single transaction.  Each
+    change gives an event, passed to the callback if not NULL and written to
+    the file descriptor returned by max17135_get_fault_fd.  The first event
+    is relative to a state with no fault and POK cleared.  The monitor must
+    not be started or stopped while another thread uses the same instance.
+
+    @param[in] p max17135 instance
+    @param[in] period_ms sampling period in milliseconds
+    @param[in] cb callback function or NULL
+    @param[in] arg argument passed to the callback
+    @return 0 if success, -1 if error
+ */
+extern int max17135_start_fault_monitor(struct max17135 *p,
+					unsigned period_ms,
+					max17135_fault_cb_t cb, void *arg);
+
+/** Stop the fault monitor, also done by max17135_free
+    @param[in] p max17135 instance
+ */
+extern void max17135_stop_fault_monitor(struct max17135 *p);
+
+/** Get the fault monitor event file descriptor
+
+    The file descriptor is non-blocking and can be used with poll() or
+    select().  Each read() of sizeof (struct max17135_fault_event) bytes
+    returns one event.  Events are dropped if they aren't read quickly
+    enough.
+
+    @param[in] p max17135 instance
+    @return file descriptor or -1 if the monitor is not running
+ */
+extern int max17135_get_fault_fd(struct max17135 *p);
+
 /** @} */
 
 
@@ -389,9 +635,15 @@ extern struct tps65185 *tps65185_init(const char *i2c_bus, char i2c_address);
  */
 extern void tps65185_free(struct tps65185 *p);
 
+/** Get the I2C device used by the TPS65185, to use with i2cdev.h
+    @param[in] p tps65185 instance
+    @return I2C device instance
+ */
+extern struct i2cdev *tps65185_get_i2c(struct tps65185 *p);
+
 /** Get constant chip information
     @param[in] p tps65185 instance
-    @param[out] info information structure
+    @param[out] info information structure, all 0 if it can't be read
 */
 extern void tps65185_get_info(struct tps65185 *p, struct tps65185_info *info);
 
@@ -476,6 +728,12 @@ extern struct eeprom *eeprom_init(const char *i2c_bus, char i2c_address,
  */
 extern void eeprom_free(struct eeprom *eeprom);
 
+/** Get the I2C device used by the EEPROM, to use with i2cdev.h
+    @param[in] eeprom eeprom instance
+    @return I2C device instance
+ */
+extern struct i2cdev *eeprom_get_i2c(struct eeprom *eeprom);
+
 /** Get the EEPROM mode identifier
     @param[in] eeprom eeprom instance
     @return static string with EEPROM mode
@@ -489,6 +747,10 @@ extern const char *eeprom_get_mode(struct eeprom *eeprom);
 extern size_t eeprom_get_size(struct eeprom *eeprom);
 
 /** Set the EEPROM page size to override default value
+
+    The page size is left unchanged if the write buffer can't be grown to
+    hold a whole page.
+
     @param[in] eeprom eeprom instance
     @param[in] page_size size of the EEPROM page
 */
@@ -579,6 +841,12 @@ extern struct dac5820 *dac5820_init(const char *i2c_bus, int i2c_address);
  */
 extern void dac5820_free(struct dac5820 *dac);
 
+/** Get the I2C device used by the DAC, to use with i2cdev.h
+    @param[in] dac dac5820 instance
+    @return I2C device instance
+ */
+extern struct i2cdev *dac5820_get_i2c(struct dac5820 *dac);
+
 /** Set the output power mode for a given channel
     @param[in] dac dac5820 instance
     @param[in] channel output channel identifier
@@ -637,6 +905,12 @@ extern struct adc11607 *adc11607_init(const char *i2c_bus, int i2c_address);
  */
 extern void adc11607_free(struct adc11607 *adc);
 
+/** Get the I2C device used by the ADC, to use with i2cdev.h
+    @param[in] adc adc11607 instance
+    @return I2C device instance
+ */
+extern struct i2cdev *adc11607_get_i2c(struct adc11607 *adc);
+
 /** Set external reference value in volts
     @param[in] adc adc11607 instance
     @param[in] value reference voltage in volts
@@ -743,6 +1017,12 @@ extern struct pbtn *pbtn_init(const char *i2c_bus, int i2c_address);
  */
 extern void pbtn_free(struct pbtn *pbtn);
 
+/** Get the I2C device used by the push buttons, to use with i2cdev.h
+    @param[in] pbtn push buttons instance
+    @return I2C device instance
+ */
+extern struct i2cdev *pbtn_get_i2c(struct pbtn *pbtn);
+
 /** Probe the state of the push buttons
     @param[in] pbtn pbtn instance as created by pbtn_init
     @param[in] mask binary mask to select a set of push buttons
@@ -774,4 +1054,107 @@ extern int pbtn_wait_any(struct pbtn *pbtn, enum pbtn_id mask, int state);
 
 /** @} */
 
+
+/**
+   @name Board
+   @{
+
+   A board instance brings up all the parts of a display board at once, in a
+   single memory allocation.  The parts share the same I2C bus, and their
+   identification reads and initial writes are all sent in a single I2C
+   transaction.  The parts are then used with their regular functions, but
+   must not be freed on their own.
+*/
+
+/** Opaque structure used in public board interface */
+struct plhw_board;
+
+/** Board description */
+struct plhw_board_desc {
+	const char *i2c_bus;         /**< I2C bus device or NULL for i2c-bus */
+	unsigned parts;              /**< enum plhw_part mask, 0 to discover */
+	const char *eeprom_mode;     /**< EEPROM mode or NULL for eeprom-mode */
+	char eeprom_i2c_address;     /**< EEPROM address or PLHW_NO_I2C_ADDR */
+};
+
+/** Create a board instance and initialise all its parts
+    @param[in] desc board description, or NULL to discover the parts on the
+               configured I2C bus
+    @return pointer to new board instance or NULL if any part failed
+ */
+extern struct plhw_board *plhw_board_init(const struct plhw_board_desc *desc);
+
+/** Free a board instance and all its parts
+    @param[in] board board instance as created by plhw_board_init
+ */
+extern void plhw_board_free(struct plhw_board *board);
+
+/** Get the parts of the board
+    @param[in] board board instance as created by plhw_board_init
+    @return bit mask of enum plhw_part values
+ */
+extern unsigned plhw_board_get_parts(const struct plhw_board *board);
+
+/** Get the board parts, or NULL if they are not on the board
+    @param[in] board board instance as created by plhw_board_init
+    @return part instance or NULL
+ */
+extern struct cpld *plhw_board_get_cpld(struct plhw_board *board);
+extern struct max17135 *plhw_board_get_max17135(struct plhw_board *board);
+extern struct tps65185 *plhw_board_get_tps65185(struct plhw_board *board);
+extern struct dac5820 *plhw_board_get_dac5820(struct plhw_board *board);
+extern struct adc11607 *plhw_board_get_adc11607(struct plhw_board *board);
+extern struct pbtn *plhw_board_get_pbtn(struct plhw_board *board);
+extern struct eeprom *plhw_board_get_eeprom(struct plhw_board *board);
+
+/** HV power sequence stages */
+enum plhw_hv_stage {
+	PLHW_HV_START,               /**< sequence started */
+	PLHW_HV_TEMP,                /**< temperature read, after ENABLE */
+	PLHW_HV_ENABLE,              /**< HV PSUs enabled or all disabled */
+	PLHW_HV_POK,                 /**< POK set */
+	PLHW_HV_VCOM,                /**< VCOM set and switched on */
+	PLHW_HV_NB_STAGES
+};
+
+/** HV power sequence report */
+struct plhw_hv_stats {
+	uint64_t stage_us[PLHW_HV_NB_STAGES]; /**< CLOCK_MONOTONIC time at the
+						 end of each stage, or 0 */
+	short temperature;           /**< external temperature measurement */
+	int temp_valid;              /**< 1 if temperature was read */
+};
+
+/** Turn the HV on with a board with CPLD, MAX17135 and MAX5820
+
+    This does the same as cpld_set_switch(CPLD_HVEN), max17135_set_en(EN),
+    max17135_wait_for_pok, dac5820_output and cpld_set_switch with
+    CPLD_COM_PSU, CPLD_COM_SW_EN and CPLD_COM_SW_CLOSE, in this order.  The
+    writes before and after the POK wait are each sent with a single
+    transfer at the HV bus priority.  The external temperature is read
+    after the enable write, while the rails ramp up, which is free when the
+    temperature sampler is running.  The POK rise time is still measured
+    from the enable write.  On error, the HV is turned off again with
+    plhw_board_hv_off.
+
+    @param[in] board board instance as created by plhw_board_init
+    @param[in] vcom_channel DAC channel used for VCOM
+    @param[in] vcom VCOM DAC value
+    @param[out] stats stage timestamps and temperature, or NULL
+    @return 0 if success, -1 if error
+ */
+extern int plhw_board_hv_on(struct plhw_board *board,
+			    enum dac5820_channel_id vcom_channel, char vcom,
+			    struct plhw_hv_stats *stats);
+
+/** Turn the HV off, in the reverse order and with a single transfer
+    @param[in] board board instance as created by plhw_board_init
+    @param[out] stats start and PLHW_HV_ENABLE timestamps, or NULL
+    @return 0 if success, -1 if error
+ */
+extern int plhw_board_hv_off(struct plhw_board *board,
+			     struct plhw_hv_stats *stats);
+
+/** @} */
+
 #endif /* INCLUDE_LIBPLHW_H */
@@ -20,10 +20,19 @@
 */
 
 #include "max17135.h"
+#include "board.h"
+#include "gpioline.h"
 #include "i2cdev.h"
+#include "regmap.h"
+#include "plhw_config.h"
+#include "util.h"
 #include <libplhw.h>
-#include <plsdk/plconfig.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Set to 1 to allow timing registers to be persistently saved in the chip.
@@ -31,86 +40,297 @@
  * the chip to malfunction.  */
 #define MAX17135_ALLOW_SAVE 0
 
+/* Maximum time to wait for POK once the HV rails are enabled */
+#define POK_TIMEOUT_MS 1000
+#define POK_POLL_US 5000
+
+/* POK rise time histograms, one per temperature band of POK_BAND_WIDTH
+ * degrees from POK_BAND_MIN and one for an unknown temperature.  The
+ * counts are halved when a histogram is full to follow slow drifts.  */
+#define POK_NB_BANDS 8
+#define POK_BAND_MIN -10
+#define POK_BAND_WIDTH 10
+#define POK_NB_BUCKETS 32
+#define POK_BUCKET_US 1000
+#define POK_MIN_SAMPLES 4
+#define POK_MAX_SAMPLES 64
+#define POK_MIN_POLL_US 250
+
+struct pok_hist {
+	uint16_t count[POK_NB_BUCKETS];
+	unsigned total;
+};
+
+/* Temperature sampler: the thread is the only writer of the ring, readers
+ * copy the last slot and check its sequence number hasn't changed.  The
+ * moving averages are over the whole ring.  The period is atomic so the
+ * readers can check the age of a sample without the mutex.  */
+#define TEMP_RING_SIZE 16
+#define TEMP_STALE_PERIODS 2
+
+struct temp_slot {
+	unsigned long seq;
+	struct max17135_temp_sample sample;
+};
+
+struct temp_sampler {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stop;
+	unsigned period_ms;
+	struct i2cdev_txn *txn;
+	unsigned long head;
+	struct temp_slot ring[TEMP_RING_SIZE];
+};
+
+/* Fault monitor: transitions are passed to the callback and written to a
+ * non-blocking pipe, events are dropped if it is full.  */
+struct fault_monitor {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stop;
+	unsigned period_ms;
+	max17135_fault_cb_t cb;
+	void *cb_arg;
+	int pipe_fds[2];
+	struct i2cdev_txn *txn;
+	struct max17135_fault_event last;
+};
+
 #define LOG_TAG "max17135"
 #include <plsdk/log.h>
 
 struct max17135 {
 	struct i2cdev *i2c;
-	struct plconfig *config;
+	struct regmap *map;
+	struct plhw_config *config;
 	char prod_id;
 	char prod_rev;
 	char timing[MAX17135_NB_TIMINGS];
 	struct {
 		unsigned timings_read:1;
 		unsigned timings_written:1;
+		unsigned in_place:1;
 	} flags;
+	int ready;
 	unsigned pok_delay_us;
+	struct gpioline *pok_line;
+	short temp;        /* last temperature, with the I2C lock held */
+	int temp_valid;
+	struct pok_hist pok_hist[POK_NB_BANDS + 1];
+	struct temp_sampler *sampler;
+	struct fault_monitor *monitor;
+};
+
+/* The chip clears EN on a fault or thermal shutdown, so ENABLE is never
+ * cached.  The timing registers are not in the map, they are cached in
+ * timing and always read or written in one burst. */
+static const struct regmap_reg max17135_regs[] = {
+	{ MAX17135_REG_CONF,         REGMAP_CACHED     },
+	{ MAX17135_REG_PROD_REV,     REGMAP_CACHED     },
+	{ MAX17135_REG_PROD_ID,      REGMAP_CACHED     },
+	{ MAX17135_REG_DVR,          REGMAP_CACHED     },
+	{ MAX17135_REG_ENABLE,       REGMAP_VOLATILE   },
+	{ MAX17135_REG_PROG,         REGMAP_WRITE_ONLY },
 };
 
-static int read_const_registers(struct max17135 *p);
+static int check_ready(struct max17135 *p);
+static int setup_cb(void *ctx);
+static int add_id_reads(struct max17135 *p, struct i2cdev_txn **t);
+static int get_en_bits(enum max17135_en_id id, int on, uint8_t *mask,
+		       uint8_t *value);
 static int read_timings(struct max17135 *p);
 static int write_timings(struct max17135 *p);
 static int save_timings(struct max17135 *p);
+static int wait_for_pok_line(struct max17135 *p);
+static struct pok_hist *get_pok_hist(struct max17135 *p);
+static void pok_schedule(const struct pok_hist *h, unsigned def_delay_us,
+			 unsigned *delay_us, unsigned *poll_us,
+			 unsigned *window_us);
+static unsigned pok_percentile(const struct pok_hist *h, unsigned pc);
+static void pok_record(struct pok_hist *h, unsigned rise_us);
+static unsigned elapsed_us(const struct timespec *t0);
+static int temp_failure(const union max17135_temp_stat *stat);
+static int get_last_sample(struct max17135 *p,
+			   struct max17135_temp_sample *sample);
+static int get_fresh_sample(struct max17135 *p,
+			    struct max17135_temp_sample *sample);
+static void *temp_sampler_thread(void *arg);
+static void temp_sample(struct max17135 *p, struct temp_sampler *s);
+static short temp_value(const uint8_t *data);
+static void *fault_monitor_thread(void *arg);
+static void fault_sample(struct max17135 *p, struct fault_monitor *m);
+static void add_period(struct timespec *t, unsigned period_ms);
+static uint64_t now_us(void);
 
 struct max17135 *max17135_init(const char *i2c_bus, char i2c_address)
 {
 	struct max17135 *p;
 
-	p = malloc(sizeof(struct max17135));
+	p = malloc(max17135_size());
 
 	if (p == NULL)
 		return NULL;
 
-	p->config = plconfig_init(NULL, "libplhw");
+	if (max17135_init_at(p, i2c_bus, i2c_address) == NULL)
+		goto err_free_max17135;
+
+	p->flags.in_place = 0;
+
+	if (!plhw_config_get_int(p->config, "lazy-init", 0)
+	    && max17135_setup(p)) {
+		max17135_free(p);
+		return NULL;
+	}
+
+	return p;
+
+err_free_max17135:
+	free(p);
+
+	return NULL;
+}
+
+size_t max17135_size(void)
+{
+	return PLHW_ALIGN(sizeof (struct max17135)) + i2cdev_size()
+		+ regmap_size();
+}
+
+struct max17135 *max17135_init_at(void *mem, const char *i2c_bus,
+				  char i2c_address)
+{
+	struct max17135 *p = mem;
+	char *i2c_mem = (char *) mem + PLHW_ALIGN(sizeof (struct max17135));
+	const char *pok_gpio;
+
+	assert(mem != NULL);
+
+	p->config = plhw_config_get();
 
 	if (p->config == NULL)
-		goto err_free_max17135;
+		return NULL;
 
-	if (i2c_address == PLHW_NO_I2C_ADDR)
-		i2c_address = plconfig_get_i2c_addr(
+	if ((unsigned char) i2c_address == PLHW_NO_I2C_ADDR)
+		i2c_address = plhw_config_get_i2c_addr(
 			p->config, "MAX17135-address", 0x48);
 
-	p->i2c = i2cdev_init(i2c_bus, i2c_address);
+	p->i2c = i2cdev_init_at(i2c_mem, i2c_bus, i2c_address);
 
 	if (p->i2c == NULL) {
 		LOG("failed to initialise I2C");
-		goto err_free_plconfig;
-	}
-
-	if (read_const_registers(p)) {
-		LOG("failed to read registers");
-		goto err_free_i2cdev;
+		plhw_config_put(p->config);
+		return NULL;
 	}
 
+	p->map = regmap_init_at((i2c_mem + i2cdev_size()), p->i2c,
+				max17135_regs,
+				sizeof max17135_regs / sizeof max17135_regs[0]);
 	p->flags.timings_read = 0;
 	p->flags.timings_written = 0;
+	p->flags.in_place = 1;
+	lazy_set_ready(&p->ready, 0);
+	p->temp_valid = 0;
 	p->pok_delay_us = 10000;
+	memset(p->pok_hist, 0, sizeof p->pok_hist);
+	p->sampler = NULL;
+	p->monitor = NULL;
+	p->pok_line = NULL;
+	pok_gpio = plhw_config_get_str(p->config, "MAX17135-pok-gpio", NULL);
+
+	if ((pok_gpio != NULL) &&
+	    ((p->pok_line = gpioline_init(pok_gpio, "max17135-pok")) == NULL))
+		LOG("POK line not available, polling instead");
 
 	return p;
+}
 
-err_free_i2cdev:
-	i2cdev_free(p->i2c);
-err_free_plconfig:
-	plconfig_free(p->config);
-err_free_max17135:
-	free(p);
+int max17135_add_setup(struct max17135 *p, struct i2cdev_txn **t)
+{
+	assert(p != NULL);
+	assert(t != NULL);
 
-	return NULL;
+	if (add_id_reads(p, t))
+		return -1;
+
+	lazy_set_ready(&p->ready, 1);
+
+	return 0;
+}
+
+int max17135_setup(struct max17135 *p)
+{
+	struct i2cdev_txn *t = NULL;
+	int ret;
+
+	assert(p != NULL);
+
+	/* only ready once the identification has been read */
+	ret = add_id_reads(p, &t);
+
+	if (!ret)
+		ret = i2cdev_txn_commit(t);
+
+	if (t != NULL)
+		i2cdev_txn_free(t);
+
+	if (ret) {
+		LOG("failed to read registers");
+		lazy_set_ready(&p->ready, 0);
+		return -1;
+	}
+
+	lazy_set_ready(&p->ready, 1);
+
+	return 0;
+}
+
+void max17135_set_ids(struct max17135 *p, int prod_id, int prod_rev)
+{
+	assert(p != NULL);
+
+	p->prod_id = prod_id;
+	p->prod_rev = prod_rev;
+	lazy_set_ready(&p->ready, 1);
 }
 
 void max17135_free(struct max17135 *p)
 {
 	assert(p != NULL);
 
+	if (p->monitor != NULL)
+		max17135_stop_fault_monitor(p);
+
+	if (p->sampler != NULL)
+		max17135_stop_temp_sampler(p);
+
+	if (p->pok_line != NULL)
+		gpioline_free(p->pok_line);
+
+	regmap_free(p->map);
 	i2cdev_free(p->i2c);
-	plconfig_free(p->config);
-	free(p);
+	plhw_config_put(p->config);
+
+	if (!p->flags.in_place)
+		free(p);
+}
+
+struct i2cdev *max17135_get_i2c(struct max17135 *p)
+{
+	assert(p != NULL);
+
+	return p->i2c;
 }
 
 int max17135_get_prod_id(struct max17135 *p)
 {
 	assert(p != NULL);
 
+	if (check_ready(p))
+		return -1;
+
 	return p->prod_id;
 }
 
@@ -118,6 +338,9 @@ int max17135_get_prod_rev(struct max17135 *p)
 {
 	assert(p != NULL);
 
+	if (check_ready(p))
+		return -1;
+
 	return p->prod_rev;
 }
 
@@ -126,7 +349,7 @@ int max17135_get_vcom(struct max17135 *p, char *dvr)
 	assert(p != NULL);
 	assert(dvr != NULL);
 
-	if (i2cdev_read_reg8(p->i2c, MAX17135_REG_DVR, dvr, 1))
+	if (regmap_read(p->map, MAX17135_REG_DVR, (uint8_t *) dvr))
 		return -1;
 
 	return 0;
@@ -136,7 +359,7 @@ int max17135_set_vcom(struct max17135 *p, char value)
 {
 	assert(p != NULL);
 
-	return i2cdev_write_reg8(p->i2c, MAX17135_REG_DVR, &value, 1);
+	return regmap_write(p->map, MAX17135_REG_DVR, value);
 }
 
 int max17135_save_vcom(struct max17135 *p)
@@ -149,7 +372,7 @@ int max17135_save_vcom(struct max17135 *p)
 	prog.byte = 0;
 	prog.dvr = 1;
 
-	return i2cdev_write_reg8(p->i2c, MAX17135_REG_PROG, &prog.byte, 1);
+	return regmap_write(p->map, MAX17135_REG_PROG, prog.byte);
 #else
 	LOG("writing the VCOM value is not allowed");
 	return -1;
@@ -158,13 +381,16 @@ int max17135_save_vcom(struct max17135 *p)
 
 int max17135_get_timing(struct max17135 *p, unsigned n)
 {
+	int ret;
+
 	assert(p != NULL);
 	assert(n < MAX17135_NB_TIMINGS);
 
-	if (read_timings(p))
-		return -1;
+	i2cdev_lock(p->i2c);
+	ret = read_timings(p) ? -1 : p->timing[n];
+	i2cdev_unlock(p->i2c);
 
-	return p->timing[n];
+	return ret;
 }
 
 int max17135_get_timings(struct max17135 *p, char *data, size_t size)
@@ -178,8 +404,12 @@ int max17135_get_timings(struct max17135 *p, char *data, size_t size)
 	assert(p != NULL);
 	assert(data != NULL);
 
-	if (read_timings(p))
+	i2cdev_lock(p->i2c);
+
+	if (read_timings(p)) {
+		i2cdev_unlock(p->i2c);
 		return -1;
+	}
 
 	in = p->timing;
 	out = data;
@@ -187,20 +417,29 @@ int max17135_get_timings(struct max17135 *p, char *data, size_t size)
 	for (i = 0; i < rd_size; ++i)
 		*out++ = *in++;
 
+	i2cdev_unlock(p->i2c);
+
 	return i;
 }
 
 int max17135_set_timing(struct max17135 *p, unsigned n, char value)
 {
+	int ret;
+
 	assert(p != NULL);
 	assert(n < MAX17135_NB_TIMINGS);
 
-	if (read_timings(p))
-		return -1;
+	i2cdev_lock(p->i2c);
+	ret = read_timings(p);
+
+	if (!ret) {
+		p->timing[n] = value;
+		ret = write_timings(p);
+	}
 
-	p->timing[n] = value;
+	i2cdev_unlock(p->i2c);
 
-	return write_timings(p);
+	return ret;
 }
 
 int max17135_set_timings(struct max17135 *p, const char *data, size_t size)
@@ -210,29 +449,39 @@ int max17135_set_timings(struct max17135 *p, const char *data, size_t size)
 	const char *in;
 	char *out;
 	unsigned i;
+	int ret;
 
 	assert(p != NULL);
 
-	if (read_timings(p))
-		return -1;
+	i2cdev_lock(p->i2c);
+	ret = read_timings(p);
+
+	if (!ret) {
+		in = data;
+		out = p->timing;
 
-	in = data;
-	out = p->timing;
+		for (i = 0; i < wr_size; ++i)
+			*out++ = *in++;
 
-	for (i = 0; i < wr_size; ++i)
-		*out++ = *in++;
+		ret = write_timings(p);
+	}
+
+	i2cdev_unlock(p->i2c);
 
-	return write_timings(p);
+	return ret;
 }
 
 int max17135_save_timings(struct max17135 *p)
 {
+	int ret;
+
 	assert(p != NULL);
 
-	if (!p->flags.timings_written)
-		return 0;
+	i2cdev_lock(p->i2c);
+	ret = p->flags.timings_written ? save_timings(p) : 0;
+	i2cdev_unlock(p->i2c);
 
-	return save_timings(p);
+	return ret;
 }
 
 int max17135_get_temp_sensor_en(struct max17135 *p)
@@ -242,7 +491,7 @@ int max17135_get_temp_sensor_en(struct max17135 *p)
 
 	assert(p != NULL);
 
-	ret = i2cdev_read_reg8(p->i2c, MAX17135_REG_CONF, &conf.byte, 1);
+	ret = regmap_read(p->map, MAX17135_REG_CONF, (uint8_t *) &conf.byte);
 
 	if (!ret)
 		ret = conf.shutdown ? 0 : 1;
@@ -252,31 +501,40 @@ int max17135_get_temp_sensor_en(struct max17135 *p)
 
 int max17135_set_temp_sensor_en(struct max17135 *p, int en)
 {
+	union max17135_conf mask;
 	union max17135_conf conf;
-	int ret;
 
 	assert(p != NULL);
 
-	ret = i2cdev_read_reg8(p->i2c, MAX17135_REG_CONF, &conf.byte, 1);
-
-	if (!ret) {
-		conf.shutdown = en ? 0 : 1;
-		ret = i2cdev_write_reg8(p->i2c, MAX17135_REG_CONF,
-					&conf.byte,1);
-	}
+	mask.byte = 0;
+	mask.shutdown = 1;
+	conf.byte = 0;
+	conf.shutdown = en ? 0 : 1;
 
-	return ret;
+	return regmap_update_bits(p->map, MAX17135_REG_CONF, mask.byte,
+				  conf.byte);
 }
 
 int max17135_get_temperature(struct max17135 *p, short *temp,
 			     enum max17135_temp_id id)
 {
+	struct max17135_temp_sample sample;
 	char reg;
-	char value[2];
+	uint8_t value[2];
+	int ret;
 
 	assert(p != NULL);
 	assert(temp != NULL);
 
+	if (!get_fresh_sample(p, &sample)) {
+		*temp = (id == MAX17135_TEMP_EXT) ? sample.ext : sample.in;
+		i2cdev_lock(p->i2c);
+		p->temp = *temp;
+		p->temp_valid = 1;
+		i2cdev_unlock(p->i2c);
+		return 0;
+	}
+
 	switch (id) {
 	case MAX17135_TEMP_EXT:
 		reg = MAX17135_REG_EXT_TEMP;
@@ -291,30 +549,117 @@ int max17135_get_temperature(struct max17135 *p, short *temp,
 		return -1;
 	}
 
-	if (i2cdev_read_reg8(p->i2c, reg, value, 2))
-		return -1;
+	i2cdev_lock(p->i2c);
+	ret = i2cdev_read_reg8(p->i2c, reg, value, 2);
 
-	*temp = (value[0] << 8) | (value[1]);
+	if (!ret) {
+		*temp = temp_value(value);
+		p->temp = *temp;
+		p->temp_valid = 1;
+	}
 
-	return 0;
+	i2cdev_unlock(p->i2c);
+
+	return ret ? -1 : 0;
 }
 
 int max17135_get_temp_failure(struct max17135 *p)
 {
+	struct max17135_temp_sample sample;
 	union max17135_temp_stat stat;
 
 	assert(p != NULL);
 
+	if (!get_fresh_sample(p, &sample))
+		return sample.failure;
+
 	if (i2cdev_read_reg8(p->i2c, MAX17135_REG_TEMP_STAT, &stat.byte, 1))
 		return -1;
 
-	if (stat.open)
-		return MAX17135_TEMP_OPEN;
+	return temp_failure(&stat);
+}
 
-	if (stat.shrt)
-		return MAX17135_TEMP_SHORT;
+int max17135_start_temp_sampler(struct max17135 *p, unsigned period_ms)
+{
+	struct temp_sampler *s;
+	pthread_condattr_t attr;
 
-	return MAX17135_TEMP_OK;
+	assert(p != NULL);
+	assert(period_ms > 0);
+
+	if (p->sampler != NULL) {
+		__atomic_store_n(&p->sampler->period_ms, period_ms,
+				 __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	s = malloc(sizeof (struct temp_sampler));
+
+	if (s == NULL)
+		return -1;
+
+	memset(s, 0, sizeof (struct temp_sampler));
+	s->period_ms = period_ms;
+	s->txn = i2cdev_txn_begin(p->i2c);
+
+	if (s->txn == NULL)
+		goto err_free_sampler;
+
+	pthread_mutex_init(&s->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	p->sampler = s;
+
+	if (pthread_create(&s->thread, NULL, temp_sampler_thread, p)) {
+		LOG("failed to create sampler thread");
+		p->sampler = NULL;
+		goto err_destroy;
+	}
+
+	return 0;
+
+err_destroy:
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->mutex);
+	i2cdev_txn_free(s->txn);
+err_free_sampler:
+	free(s);
+
+	return -1;
+}
+
+void max17135_stop_temp_sampler(struct max17135 *p)
+{
+	struct temp_sampler *s;
+
+	assert(p != NULL);
+
+	s = p->sampler;
+
+	if (s == NULL)
+		return;
+
+	pthread_mutex_lock(&s->mutex);
+	s->stop = 1;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->mutex);
+	pthread_join(s->thread, NULL);
+	p->sampler = NULL;
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->mutex);
+	i2cdev_txn_free(s->txn);
+	free(s);
+}
+
+int max17135_get_temp_sample(struct max17135 *p,
+			     struct max17135_temp_sample *sample)
+{
+	assert(p != NULL);
+	assert(sample != NULL);
+
+	return get_last_sample(p, sample);
 }
 
 float max17135_convert_temperature(struct max17135 *p, short temp)
@@ -333,7 +678,7 @@ int max17135_get_pok(struct max17135 *p)
 	if (i2cdev_read_reg8(p->i2c, MAX17135_REG_FAULT, &fault.byte, 1))
 		return -1;
 
-	return fault.pok;
+	return fault.pok ? 1 : 0;
 }
 
 void max17135_set_pok_delay(struct max17135 *p, unsigned delay_us)
@@ -345,51 +690,123 @@ void max17135_set_pok_delay(struct max17135 *p, unsigned delay_us)
 
 int max17135_wait_for_pok(struct max17135 *p)
 {
-	static const int POLL_SLEEP_US = 5000;
-	static const int POLL_LOOPS = 1000000 / POLL_SLEEP_US;
+	struct timespec t0;
+
+	assert(p != NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	return max17135_wait_for_pok_from(p, &t0);
+}
+
+int max17135_wait_for_pok_from(struct max17135 *p, const struct timespec *t0)
+{
+	struct pok_hist *hist;
+	unsigned delay_us;
+	unsigned poll_us;
+	unsigned window_us;
+	unsigned last_us;
+	unsigned now_us;
 	int pok;
-	int i;
 
 	assert(p != NULL);
+	assert(t0 != NULL);
+
+	i2cdev_lock_prio(p->i2c, I2CDEV_PRIO_HV);
+	hist = get_pok_hist(p);
+	i2cdev_unlock(p->i2c);
+
+	if (p->pok_line != NULL) {
+		const int ret = wait_for_pok_line(p);
+
+		if (!ret)
+			pok_record(hist, elapsed_us(t0));
+
+		if (ret <= 0)
+			return ret;
+	}
+
+	/* the time spent since t0 counts towards the initial delay */
+	pok_schedule(hist, p->pok_delay_us, &delay_us, &poll_us, &window_us);
+	now_us = elapsed_us(t0);
 
-	usleep(p->pok_delay_us);
+	if (now_us < delay_us)
+		usleep(delay_us - now_us);
 
-	for (i = POLL_LOOPS, pok = 0; i && !pok; --i) {
+	for (last_us = 0; ; last_us = now_us) {
+		i2cdev_lock_prio(p->i2c, I2CDEV_PRIO_HV);
 		pok = max17135_get_pok(p);
+		i2cdev_unlock(p->i2c);
+		now_us = elapsed_us(t0);
+
+		if (pok > 0)
+			break;
+
+		if (pok < 0) {
+			if (i2cdev_breaker_is_open(p->i2c)) {
+				LOG("device not responding");
+				return -1;
+			}
 
-		if (pok < 0)
 			LOG("failed to get POK status");
-		else if (!pok)
-			usleep(POLL_SLEEP_US);
-	}
+		}
 
-	if (!pok) {
-		LOG("time out waiting for POK");
-		return -1;
+		if (now_us >= (POK_TIMEOUT_MS * 1000)) {
+			LOG("time out waiting for POK");
+			return -1;
+		}
+
+		usleep((now_us < window_us) ? poll_us : POK_POLL_US);
 	}
 
+	/* POK rose between the last two polls, or before the first one */
+	pok_record(hist, last_us ? ((last_us + now_us) / 2) : now_us);
+
 	return 0;
 }
 
 int max17135_set_en(struct max17135 *p, enum max17135_en_id id, int on)
 {
-	union max17135_enable enable;
+	uint8_t mask;
+	uint8_t value;
+	int ret;
 
 	assert(p != NULL);
 
-	if (i2cdev_read_reg8(p->i2c, MAX17135_REG_ENABLE, &enable.byte, 1))
+	if (get_en_bits(id, on, &mask, &value))
 		return -1;
 
-	switch (id) {
-	case MAX17135_EN_EN:      enable.en     = on ? 1 : 0;    break;
-	case MAX17135_EN_CEN:     enable.cen    = on ? 1 : 0;    break;
-	case MAX17135_EN_CEN2:    enable.cen2   = on ? 1 : 0;    break;
-	default:
-		assert(!"invalid HV enable identifier");
+	i2cdev_lock_prio(p->i2c, I2CDEV_PRIO_HV);
+	ret = regmap_update_bits(p->map, MAX17135_REG_ENABLE, mask, value);
+	i2cdev_unlock(p->i2c);
+
+	return ret;
+}
+
+int max17135_add_en(struct max17135 *p, struct i2cdev_txn **t,
+		    enum max17135_en_id id, int on)
+{
+	uint8_t mask;
+	uint8_t value;
+
+	assert(p != NULL);
+	assert(t != NULL);
+
+	if (get_en_bits(id, on, &mask, &value))
 		return -1;
-	}
 
-	return i2cdev_write_reg8(p->i2c, MAX17135_REG_ENABLE, &enable.byte, 1);
+	if ((*t == NULL) && ((*t = i2cdev_txn_begin(p->i2c)) == NULL))
+		return -1;
+
+	return regmap_add_update_bits(p->map, *t, MAX17135_REG_ENABLE, mask,
+				      value);
+}
+
+void max17135_invalidate(struct max17135 *p)
+{
+	assert(p != NULL);
+
+	regmap_invalidate(p->map);
 }
 
 int max17135_get_en(struct max17135 *p, enum max17135_en_id id)
@@ -399,7 +816,7 @@ int max17135_get_en(struct max17135 *p, enum max17135_en_id id)
 
 	assert(p != NULL);
 
-	if (i2cdev_read_reg8(p->i2c, MAX17135_REG_ENABLE, &enable.byte, 1))
+	if (regmap_read(p->map, MAX17135_REG_ENABLE, (uint8_t *) &enable.byte))
 		return -1;
 
 	switch (id) {
@@ -417,21 +834,26 @@ int max17135_get_en(struct max17135 *p, enum max17135_en_id id)
 int max17135_get_fault(struct max17135 *p)
 {
 	union max17135_fault fault;
+	int faults;
 
 	assert(p != NULL);
 
-	if (i2cdev_read_reg8(p->i2c, MAX17135_REG_FAULT, &fault.byte, 1))
+	faults = max17135_get_faults(p);
+
+	if (faults < 0)
 		return -1;
 
+	fault.byte = faults;
+
 	if (fault.fbpg)
 		return MAX17135_FAULT_FBPG;
 
-	if (fault.hvinp)
-		return MAX17135_FAULT_HVINN;
-
 	if (fault.hvinp)
 		return MAX17135_FAULT_HVINP;
 
+	if (fault.hvinn)
+		return MAX17135_FAULT_HVINN;
+
 	if (fault.fbng)
 		return MAX17135_FAULT_FBNG;
 
@@ -447,37 +869,178 @@ int max17135_get_fault(struct max17135 *p)
 	return MAX17135_FAULT_NONE;
 }
 
+int max17135_get_faults(struct max17135 *p)
+{
+	uint8_t fault;
+
+	assert(p != NULL);
+
+	if (i2cdev_read_reg8(p->i2c, MAX17135_REG_FAULT, &fault, 1))
+		return -1;
+
+	return fault;
+}
+
+int max17135_start_fault_monitor(struct max17135 *p, unsigned period_ms,
+				 max17135_fault_cb_t cb, void *arg)
+{
+	struct fault_monitor *m;
+	pthread_condattr_t attr;
+
+	assert(p != NULL);
+	assert(period_ms > 0);
+
+	if (p->monitor != NULL) {
+		LOG("fault monitor already running");
+		return -1;
+	}
+
+	m = malloc(sizeof (struct fault_monitor));
+
+	if (m == NULL)
+		return -1;
+
+	memset(m, 0, sizeof (struct fault_monitor));
+	m->period_ms = period_ms;
+	m->cb = cb;
+	m->cb_arg = arg;
+	m->last.temp_failure = MAX17135_TEMP_OK;
+
+	if (pipe(m->pipe_fds)) {
+		LOG("failed to create event pipe");
+		goto err_free_monitor;
+	}
+
+	fcntl(m->pipe_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(m->pipe_fds[1], F_SETFL, O_NONBLOCK);
+	m->txn = i2cdev_txn_begin(p->i2c);
+
+	if (m->txn == NULL)
+		goto err_close_pipe;
+
+	pthread_mutex_init(&m->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&m->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	p->monitor = m;
+
+	if (pthread_create(&m->thread, NULL, fault_monitor_thread, p)) {
+		LOG("failed to create monitor thread");
+		p->monitor = NULL;
+		goto err_destroy;
+	}
+
+	return 0;
+
+err_destroy:
+	pthread_cond_destroy(&m->cond);
+	pthread_mutex_destroy(&m->mutex);
+	i2cdev_txn_free(m->txn);
+err_close_pipe:
+	close(m->pipe_fds[0]);
+	close(m->pipe_fds[1]);
+err_free_monitor:
+	free(m);
+
+	return -1;
+}
+
+void max17135_stop_fault_monitor(struct max17135 *p)
+{
+	struct fault_monitor *m;
+
+	assert(p != NULL);
+
+	m = p->monitor;
+
+	if (m == NULL)
+		return;
+
+	pthread_mutex_lock(&m->mutex);
+	m->stop = 1;
+	pthread_cond_signal(&m->cond);
+	pthread_mutex_unlock(&m->mutex);
+	pthread_join(m->thread, NULL);
+	p->monitor = NULL;
+	pthread_cond_destroy(&m->cond);
+	pthread_mutex_destroy(&m->mutex);
+	i2cdev_txn_free(m->txn);
+	close(m->pipe_fds[0]);
+	close(m->pipe_fds[1]);
+	free(m);
+}
+
+int max17135_get_fault_fd(struct max17135 *p)
+{
+	assert(p != NULL);
+
+	return (p->monitor == NULL) ? -1 : p->monitor->pipe_fds[0];
+}
+
 /* ----------------------------------------------------------------------------
  * static functions
  */
 
-static int read_const_registers(struct max17135 *p)
+/* With lazy-init, the product identification is only read on first use */
+static int check_ready(struct max17135 *p)
+{
+	return lazy_setup(&p->ready, p->i2c, setup_cb, p);
+}
+
+static int setup_cb(void *ctx)
 {
-	if (i2cdev_read_reg8(p->i2c, MAX17135_REG_PROD_REV, &p->prod_rev, 1))
+	return max17135_setup(ctx);
+}
+
+static int add_id_reads(struct max17135 *p, struct i2cdev_txn **t)
+{
+	if ((*t == NULL) && ((*t = i2cdev_txn_begin(p->i2c)) == NULL))
 		return -1;
 
-	if (i2cdev_read_reg8(p->i2c, MAX17135_REG_PROD_ID, &p->prod_id, 1))
+	if ((i2cdev_txn_add_read_reg8(*t, p->i2c, MAX17135_REG_PROD_REV,
+				      &p->prod_rev, 1) < 0) ||
+	    (i2cdev_txn_add_read_reg8(*t, p->i2c, MAX17135_REG_PROD_ID,
+				      &p->prod_id, 1) < 0))
+		return -1;
+
+	return 0;
+}
+
+static int get_en_bits(enum max17135_en_id id, int on, uint8_t *mask,
+		       uint8_t *value)
+{
+	union max17135_enable m;
+	union max17135_enable v;
+
+	m.byte = 0;
+	v.byte = 0;
+
+	switch (id) {
+	case MAX17135_EN_EN:    m.en = 1;   v.en   = on ? 1 : 0;  break;
+	case MAX17135_EN_CEN:   m.cen = 1;  v.cen  = on ? 1 : 0;  break;
+	case MAX17135_EN_CEN2:  m.cen2 = 1; v.cen2 = on ? 1 : 0;  break;
+	default:
+		assert(!"invalid HV enable identifier");
 		return -1;
+	}
+
+	*mask = m.byte;
+	*value = v.byte;
 
 	return 0;
 }
 
 static int read_timings(struct max17135 *p)
 {
-	char reg;
-	char *timing;
 	int ret;
-	int i;
 
 	if (p->flags.timings_read)
 		return 0;
 
-	reg = MAX17135_REG_TIMING_1;
-	timing = p->timing;
-	ret = 0;
-
-	for (i = 0; (i < MAX17135_NB_TIMINGS) && !ret; ++i)
-		ret = i2cdev_read_reg8(p->i2c, reg++, timing++, 1);
+	/* the timing registers are contiguous, read them in one burst */
+	ret = i2cdev_read_reg8(p->i2c, MAX17135_REG_TIMING_1, p->timing,
+			       MAX17135_NB_TIMINGS);
 
 	if (!ret)
 		p->flags.timings_read = 1;
@@ -489,16 +1052,13 @@ static int read_timings(struct max17135 *p)
 
 static int write_timings(struct max17135 *p)
 {
-	char reg = MAX17135_REG_TIMING_1;
-	char *timing = p->timing;
-	int ret = 0;
-	int i;
+	int ret;
 
 	if (p->flags.timings_written)
 		return 0;
 
-	for (i = 0; (i < MAX17135_NB_TIMINGS) && !ret; ++i)
-		ret = i2cdev_write_reg8(p->i2c, reg++, timing++, 1);
+	ret = i2cdev_write_reg8(p->i2c, MAX17135_REG_TIMING_1, p->timing,
+				MAX17135_NB_TIMINGS);
 
 	if (!ret)
 		p->flags.timings_written = 1;
@@ -519,8 +1079,7 @@ static int save_timings(struct max17135 *p)
 		prog.byte = 0;
 		prog.timing = 1;
 
-		ret = i2cdev_write_reg8(p->i2c, MAX17135_REG_PROG,
-					&prog.byte,1);
+		ret = regmap_write(p->map, MAX17135_REG_PROG, prog.byte);
 	}
 
 	return ret;
@@ -529,3 +1088,361 @@ static int save_timings(struct max17135 *p)
 	return -1;
 #endif
 }
+
+/* Returns 0 if POK is set, -1 if error or 1 to fall back to polling */
+static int wait_for_pok_line(struct max17135 *p)
+{
+	int line;
+	int pok;
+
+	line = gpioline_wait(p->pok_line, POK_TIMEOUT_MS);
+
+	if (line < 0)
+		return 1;
+
+	if (!line) {
+		LOG("time out waiting for POK");
+		return -1;
+	}
+
+	/* confirm with the fault register in case of a glitch */
+	i2cdev_lock_prio(p->i2c, I2CDEV_PRIO_HV);
+	pok = max17135_get_pok(p);
+	i2cdev_unlock(p->i2c);
+
+	return (pok > 0) ? 0 : 1;
+}
+
+/* To be called with the I2C lock held, for the last temperature */
+static struct pok_hist *get_pok_hist(struct max17135 *p)
+{
+	int band;
+
+	if (!p->temp_valid)
+		return &p->pok_hist[POK_NB_BANDS];
+
+	/* the measurement is in 1/256 degrees */
+	band = ((p->temp / 256) - POK_BAND_MIN) / POK_BAND_WIDTH;
+
+	if (band < 0)
+		band = 0;
+	else if (band >= POK_NB_BANDS)
+		band = POK_NB_BANDS - 1;
+
+	return &p->pok_hist[band];
+}
+
+/* Without enough history, the configured delay is followed by regular
+ * polling.  Otherwise, the first poll is at the 10th percentile of the rise
+ * times and the polls are closer together until the 90th percentile.  */
+static void pok_schedule(const struct pok_hist *h, unsigned def_delay_us,
+			 unsigned *delay_us, unsigned *poll_us,
+			 unsigned *window_us)
+{
+	unsigned lo;
+	unsigned hi;
+
+	if (h->total < POK_MIN_SAMPLES) {
+		*delay_us = def_delay_us;
+		*poll_us = POK_POLL_US;
+		*window_us = 0;
+		return;
+	}
+
+	lo = pok_percentile(h, 10);
+	hi = pok_percentile(h, 90) + POK_BUCKET_US;
+	*delay_us = lo;
+	*poll_us = (hi - lo) / 8;
+
+	if (*poll_us < POK_MIN_POLL_US)
+		*poll_us = POK_MIN_POLL_US;
+
+	*window_us = hi + POK_BUCKET_US;
+}
+
+static unsigned pok_percentile(const struct pok_hist *h, unsigned pc)
+{
+	const unsigned n = (h->total * pc) / 100;
+	unsigned sum;
+	unsigned i;
+
+	for (i = 0, sum = 0; i < (POK_NB_BUCKETS - 1); ++i) {
+		sum += h->count[i];
+
+		if (sum > n)
+			break;
+	}
+
+	return i * POK_BUCKET_US;
+}
+
+static void pok_record(struct pok_hist *h, unsigned rise_us)
+{
+	unsigned i = rise_us / POK_BUCKET_US;
+
+	if (i >= POK_NB_BUCKETS)
+		i = POK_NB_BUCKETS - 1;
+
+	if (h->total == POK_MAX_SAMPLES) {
+		unsigned j;
+
+		for (j = 0, h->total = 0; j < POK_NB_BUCKETS; ++j) {
+			h->count[j] /= 2;
+			h->total += h->count[j];
+		}
+	}
+
+	++h->count[i];
+	++h->total;
+}
+
+static unsigned elapsed_us(const struct timespec *t0)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return ((t.tv_sec - t0->tv_sec) * 1000000)
+		+ ((t.tv_nsec - t0->tv_nsec) / 1000);
+}
+
+static int temp_failure(const union max17135_temp_stat *stat)
+{
+	if (stat->open)
+		return MAX17135_TEMP_OPEN;
+
+	if (stat->shrt)
+		return MAX17135_TEMP_SHORT;
+
+	return MAX17135_TEMP_OK;
+}
+
+static int get_last_sample(struct max17135 *p,
+			   struct max17135_temp_sample *sample)
+{
+	const struct temp_sampler *s = p->sampler;
+
+	if (s == NULL)
+		return -1;
+
+	for (;;) {
+		const unsigned long head =
+			__atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+		const struct temp_slot *slot;
+		unsigned long seq;
+
+		if (!head)
+			return -1;
+
+		slot = &s->ring[(head - 1) & (TEMP_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq != head)
+			continue; /* overwritten, try the new head */
+
+		memcpy(sample, &slot->sample, sizeof *sample);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+}
+
+/* Samples get dropped while the bus fails, so an old one is not used in
+ * place of a direct read.  */
+static int get_fresh_sample(struct max17135 *p,
+			    struct max17135_temp_sample *sample)
+{
+	struct temp_sampler *s = p->sampler;
+	uint64_t max_age_us;
+
+	if (get_last_sample(p, sample))
+		return -1;
+
+	max_age_us = __atomic_load_n(&s->period_ms, __ATOMIC_RELAXED)
+		* 1000ULL * TEMP_STALE_PERIODS;
+
+	return ((now_us() - sample->timestamp_us) > max_age_us) ? -1 : 0;
+}
+
+static void *temp_sampler_thread(void *arg)
+{
+	struct max17135 *p = arg;
+	struct temp_sampler *s = p->sampler;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	pthread_mutex_lock(&s->mutex);
+
+	while (!s->stop) {
+		pthread_mutex_unlock(&s->mutex);
+		temp_sample(p, s);
+		pthread_mutex_lock(&s->mutex);
+		add_period(&next, __atomic_load_n(&s->period_ms,
+						  __ATOMIC_RELAXED));
+
+		while (!s->stop && (pthread_cond_timedwait(
+					    &s->cond, &s->mutex, &next)
+				    != ETIMEDOUT));
+	}
+
+	pthread_mutex_unlock(&s->mutex);
+
+	return NULL;
+}
+
+/* All the registers are read with one transaction at the lowest priority,
+ * and failed samples are dropped.  */
+static void temp_sample(struct max17135 *p, struct temp_sampler *s)
+{
+	const unsigned long pos = s->head;
+	struct temp_slot * const slot = &s->ring[pos & (TEMP_RING_SIZE - 1)];
+	struct max17135_temp_sample sample;
+	union max17135_temp_stat stat;
+	uint8_t ext[2];
+	uint8_t in[2];
+	long ext_sum;
+	long in_sum;
+	unsigned n;
+	unsigned i;
+	int ret;
+
+	i2cdev_txn_reset(s->txn);
+
+	if ((i2cdev_txn_add_read_reg8(s->txn, p->i2c, MAX17135_REG_EXT_TEMP,
+				      ext, 2) < 0) ||
+	    (i2cdev_txn_add_read_reg8(s->txn, p->i2c, MAX17135_REG_INT_TEMP,
+				      in, 2) < 0) ||
+	    (i2cdev_txn_add_read_reg8(s->txn, p->i2c, MAX17135_REG_TEMP_STAT,
+				      &stat.byte, 1) < 0))
+		return;
+
+	i2cdev_lock_prio(p->i2c, I2CDEV_PRIO_BULK);
+	ret = i2cdev_txn_commit(s->txn);
+	i2cdev_unlock(p->i2c);
+
+	if (ret)
+		return;
+
+	sample.ext = temp_value(ext);
+	sample.in = temp_value(in);
+	sample.failure = temp_failure(&stat);
+	sample.timestamp_us = now_us();
+
+	/* the previous samples are only ever written by this thread */
+	n = (pos < TEMP_RING_SIZE) ? pos : (TEMP_RING_SIZE - 1);
+	ext_sum = sample.ext;
+	in_sum = sample.in;
+
+	for (i = 1; i <= n; ++i) {
+		const struct temp_slot *prev =
+			&s->ring[(pos - i) & (TEMP_RING_SIZE - 1)];
+
+		ext_sum += prev->sample.ext;
+		in_sum += prev->sample.in;
+	}
+
+	sample.ext_avg = ext_sum / (long) (n + 1);
+	sample.in_avg = in_sum / (long) (n + 1);
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&slot->sample, &sample, sizeof sample);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&s->head, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* The temperature registers hold a signed value in 1/256 degrees, MSB
+ * first */
+static short temp_value(const uint8_t *data)
+{
+	return (short) ((data[0] << 8) | data[1]);
+}
+
+static void *fault_monitor_thread(void *arg)
+{
+	struct max17135 *p = arg;
+	struct fault_monitor *m = p->monitor;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	pthread_mutex_lock(&m->mutex);
+
+	while (!m->stop) {
+		pthread_mutex_unlock(&m->mutex);
+		fault_sample(p, m);
+		pthread_mutex_lock(&m->mutex);
+		add_period(&next, m->period_ms);
+
+		while (!m->stop && (pthread_cond_timedwait(
+					    &m->cond, &m->mutex, &next)
+				    != ETIMEDOUT));
+	}
+
+	pthread_mutex_unlock(&m->mutex);
+
+	return NULL;
+}
+
+/* FAULT, which includes POK, and TEMP_STAT are read with one transaction.
+ * The state starts with no fault and POK cleared, so the first sample
+ * only gives an event if this is not the case.  */
+static void fault_sample(struct max17135 *p, struct fault_monitor *m)
+{
+	struct max17135_fault_event event;
+	union max17135_temp_stat stat;
+	uint8_t fault;
+	int ret;
+
+	i2cdev_txn_reset(m->txn);
+
+	if ((i2cdev_txn_add_read_reg8(m->txn, p->i2c, MAX17135_REG_FAULT,
+				      &fault, 1) < 0) ||
+	    (i2cdev_txn_add_read_reg8(m->txn, p->i2c, MAX17135_REG_TEMP_STAT,
+				      &stat.byte, 1) < 0))
+		return;
+
+	i2cdev_lock_prio(p->i2c, I2CDEV_PRIO_STATUS);
+	ret = i2cdev_txn_commit(m->txn);
+	i2cdev_unlock(p->i2c);
+
+	if (ret)
+		return;
+
+	event.faults = fault;
+	event.changed = fault ^ m->last.faults;
+	event.temp_failure = temp_failure(&stat);
+	event.timestamp_us = now_us();
+
+	if (!event.changed && (event.temp_failure == m->last.temp_failure))
+		return;
+
+	memcpy(&m->last, &event, sizeof event);
+
+	if (m->cb != NULL)
+		m->cb(p, &event, m->cb_arg);
+
+	if ((write(m->pipe_fds[1], &event, sizeof event) != sizeof event)
+	    && (errno == EAGAIN))
+		LOG("fault event pipe full, event dropped");
+}
+
+static void add_period(struct timespec *t, unsigned period_ms)
+{
+	t->tv_sec += period_ms / 1000;
+	t->tv_nsec += (period_ms % 1000) * 1000000;
+
+	if (t->tv_nsec >= 1000000000) {
+		t->tv_nsec -= 1000000000;
+		++t->tv_sec;
+	}
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (t.tv_sec * 1000000ULL) + (t.tv_nsec / 1000);
+}
@@ -22,6 +22,8 @@
 #ifndef INCLUDE_MAX17135_H
 #define INCLUDE_MAX17135_H 1
 
+#define MAX17135_PROD_ID 0x4D
+
 enum max17135_register {
 	MAX17135_REG_EXT_TEMP   = 0x00,
 	MAX17135_REG_CONF       = 0x01,
@@ -21,9 +21,11 @@
 
 #include "gpio_signals.h"
 #include "gpioex.h"
+#include "board.h"
 #include "i2cdev.h"
+#include "plhw_config.h"
+#include "util.h"
 #include <libplhw.h>
-#include <plsdk/plconfig.h>
 #include <assert.h>
 #include <unistd.h>
 
@@ -34,10 +36,11 @@
 
 struct pbtn {
 	struct gpioex *gpio;
-	struct plconfig *config;
+	struct plhw_config *config;
 	unsigned poll_sleep_us;
 	char btns;
 	pbtn_abort_t abort;
+	int in_place;
 };
 
 static int wait_btn(struct pbtn *b, enum pbtn_id mask, int state, int any);
@@ -46,39 +49,77 @@ struct pbtn *pbtn_init(const char *i2c_bus, int i2c_address)
 {
 	struct pbtn *b;
 
-	b = malloc(sizeof (struct pbtn));
+	b = malloc(pbtn_size());
 
 	if (b == NULL)
 		return NULL;
 
-	b->config = plconfig_init(NULL, "libplhw");
+	if (pbtn_init_at(b, i2c_bus, i2c_address) == NULL) {
+		free(b);
+		return NULL;
+	}
+
+	b->in_place = 0;
+
+	if (!plhw_config_get_int(b->config, "lazy-init", 0)
+	    && pbtn_setup(b)) {
+		pbtn_free(b);
+		return NULL;
+	}
+
+	return b;
+}
+
+size_t pbtn_size(void)
+{
+	return PLHW_ALIGN(sizeof (struct pbtn)) + gpioex_size();
+}
+
+struct pbtn *pbtn_init_at(void *mem, const char *i2c_bus, int i2c_address)
+{
+	struct pbtn *b = mem;
+	char *gpio_mem = (char *) mem + PLHW_ALIGN(sizeof (struct pbtn));
+
+	assert(mem != NULL);
+
+	b->in_place = 1;
+	b->config = plhw_config_get();
 
 	if (b->config == NULL)
-		goto err_free_pbtn;
+		return NULL;
 
 	if (i2c_address == PLHW_NO_I2C_ADDR)
-		i2c_address = plconfig_get_i2c_addr(
+		i2c_address = plhw_config_get_i2c_addr(
 			b->config, "pbtn-address", 0x21);
 
-	b->gpio = gpioex_init(i2c_bus, i2c_address, GPIO_PBTN_I_MASK,
-			      GPIO_PBTN_O_MASK);
+	b->gpio = gpioex_init_at(gpio_mem, i2c_bus, i2c_address,
+				 GPIO_PBTN_I_MASK, GPIO_PBTN_O_MASK);
 
 	if (b->gpio == NULL) {
 		LOG("failed to initialise GPIO expander");
-		goto err_free_plconfig;
+		plhw_config_put(b->config);
+		return NULL;
 	}
 
 	b->btns = 0;
 	b->poll_sleep_us = PBTN_DEF_POLL_SLEEP_US;
+	b->abort = NULL;
 
 	return b;
+}
+
+int pbtn_add_setup(struct pbtn *b, struct i2cdev_txn **t)
+{
+	assert(b != NULL);
+
+	return gpioex_add_setup(b->gpio, t);
+}
 
-err_free_plconfig:
-	plconfig_free(b->config);
-err_free_pbtn:
-	free(b);
+int pbtn_setup(struct pbtn *b)
+{
+	assert(b != NULL);
 
-	return NULL;
+	return gpioex_setup(b->gpio);
 }
 
 void pbtn_free(struct pbtn *b)
@@ -86,8 +127,17 @@ void pbtn_free(struct pbtn *b)
 	assert(b != NULL);
 
 	gpioex_free(b->gpio);
-	plconfig_free(b->config);
-	free(b);
+	plhw_config_put(b->config);
+
+	if (!b->in_place)
+		free(b);
+}
+
+struct i2cdev *pbtn_get_i2c(struct pbtn *b)
+{
+	assert(b != NULL);
+
+	return gpioex_get_i2c(b->gpio);
 }
 
 int pbtn_probe(struct pbtn *b, enum pbtn_id mask)
@@ -0,0 +1,363 @@
+/*
+  Plastic Logic hardware library - plhw_config
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "plhw_config.h"
+#include <libplhw.h>
+#include <plsdk/plconfig.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_TAG "plhw_config"
+#include <plsdk/log.h>
+
+#define PROFILE_ENV "PLHW_PROFILE"
+#define PROFILE_MAGIC "PLHW"
+#define PROFILE_VERSION 1
+#define PROFILE_KEY_SIZE 32
+#define PROFILE_VALUE_SIZE 96
+
+struct profile_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t n_entries;
+};
+
+struct profile_entry {
+	char key[PROFILE_KEY_SIZE];
+	char value[PROFILE_VALUE_SIZE];
+};
+
+struct plhw_config {
+	unsigned refcount;
+	struct plconfig *plconfig;
+	void *profile;
+	size_t profile_size;
+	const struct profile_entry *entries;
+	size_t n_entries;
+};
+
+/* All the configuration keys used in libplhw, saved in board profiles */
+static const struct {
+	const char *key;
+	int is_addr;
+} plhw_config_keys[] = {
+	{ "i2c-bus",              0 },
+	{ "CPLD-address",         1 },
+	{ "MAX17135-address",     1 },
+	{ "MAX17135-pok-gpio",    0 },
+	{ "TPS65185-address",     1 },
+	{ "MAX5820-address",      1 },
+	{ "MAX116xx-address",     1 },
+	{ "pbtn-address",         1 },
+	{ "eeprom-mode",          0 },
+	{ "lazy-init",            0 },
+	{ "id-cache",             0 },
+	{ "i2c-trace",            0 },
+	{ "i2c-reg-stats",        0 },
+	{ "i2c-record",           0 },
+	{ "i2c-replay-speed",     0 },
+	{ "i2c-sim-khz",          0 },
+	{ "i2c-sim-pok-us",       0 },
+	{ "i2c-sim-eeprom",       0 },
+	{ "i2c-retries",          0 },
+	{ "i2c-retry-backoff-us", 0 },
+	{ "i2c-retry-max-backoff-us", 0 },
+	{ "i2c-breaker-threshold", 0 },
+	{ "i2c-breaker-cooldown-ms", 0 },
+	{ "i2c-timeout-ms",       0 },
+	{ "i2c-adapter-retries",  0 },
+	{ "i2c-bulk-rate",        0 },
+	{ "i2c-bulk-burst",       0 },
+	{ NULL, 0 }
+};
+
+static struct plhw_config *plhw_config = NULL;
+static pthread_mutex_t plhw_config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int map_profile(struct plhw_config *c, const char *path);
+static const char *find_entry(struct plhw_config *c, const char *key);
+
+struct plhw_config *plhw_config_get(void)
+{
+	struct plhw_config *c;
+	const char *profile;
+
+	pthread_mutex_lock(&plhw_config_lock);
+
+	if (plhw_config != NULL) {
+		c = plhw_config;
+		++c->refcount;
+		goto exit_unlock;
+	}
+
+	c = malloc(sizeof (struct plhw_config));
+
+	if (c == NULL)
+		goto exit_unlock;
+
+	c->plconfig = NULL;
+	c->profile = NULL;
+	c->profile_size = 0;
+	c->entries = NULL;
+	c->n_entries = 0;
+	profile = getenv(PROFILE_ENV);
+
+	if ((profile == NULL) || map_profile(c, profile)) {
+		c->plconfig = plconfig_init(NULL, "libplhw");
+
+		if (c->plconfig == NULL) {
+			free(c);
+			c = NULL;
+			goto exit_unlock;
+		}
+	}
+
+	c->refcount = 1;
+	plhw_config = c;
+
+exit_unlock:
+	pthread_mutex_unlock(&plhw_config_lock);
+
+	return c;
+}
+
+void plhw_config_put(struct plhw_config *c)
+{
+	assert(c != NULL);
+
+	pthread_mutex_lock(&plhw_config_lock);
+	assert(c == plhw_config);
+	assert(c->refcount);
+
+	if (--c->refcount) {
+		pthread_mutex_unlock(&plhw_config_lock);
+		return;
+	}
+
+	plhw_config = NULL;
+	pthread_mutex_unlock(&plhw_config_lock);
+
+	if (c->plconfig != NULL)
+		plconfig_free(c->plconfig);
+
+	if (c->profile != NULL)
+		munmap(c->profile, c->profile_size);
+
+	free(c);
+}
+
+const char *plhw_config_get_str(struct plhw_config *c, const char *key,
+				const char *def)
+{
+	const char *value;
+
+	assert(c != NULL);
+	assert(key != NULL);
+
+	if (c->plconfig != NULL)
+		return plconfig_get_str(c->plconfig, key, def);
+
+	value = find_entry(c, key);
+
+	return (value == NULL) ? def : value;
+}
+
+int plhw_config_get_i2c_addr(struct plhw_config *c, const char *key, int def)
+{
+	const char *value;
+
+	assert(c != NULL);
+	assert(key != NULL);
+
+	if (c->plconfig != NULL)
+		return plconfig_get_i2c_addr(c->plconfig, key, def);
+
+	value = find_entry(c, key);
+
+	return (value == NULL) ? def : strtol(value, NULL, 0);
+}
+
+long plhw_config_get_int(struct plhw_config *c, const char *key, long def)
+{
+	const char *value;
+
+	assert(c != NULL);
+	assert(key != NULL);
+
+	value = plhw_config_get_str(c, key, NULL);
+
+	return (value == NULL) ? def : strtol(value, NULL, 0);
+}
+
+int plhw_save_profile(const char *path)
+{
+	struct plhw_config *c;
+	struct profile_header header;
+	struct profile_entry entry;
+	unsigned i;
+	FILE *f;
+	int ret = -1;
+
+	assert(path != NULL);
+
+	c = plhw_config_get();
+
+	if (c == NULL)
+		return -1;
+
+	f = fopen(path, "wb");
+
+	if (f == NULL) {
+		LOG("failed to open profile file (%s)", path);
+		goto exit_put_config;
+	}
+
+	memcpy(header.magic, PROFILE_MAGIC, sizeof header.magic);
+	header.version = PROFILE_VERSION;
+	header.n_entries = 0;
+
+	if (fwrite(&header, sizeof header, 1, f) != 1)
+		goto exit_close_file;
+
+	for (i = 0; plhw_config_keys[i].key != NULL; ++i) {
+		const char *key = plhw_config_keys[i].key;
+
+		memset(&entry, 0, sizeof entry);
+		strncpy(entry.key, key, (sizeof entry.key - 1));
+
+		if (plhw_config_keys[i].is_addr) {
+			const int addr = plhw_config_get_i2c_addr(
+				c, key, PLHW_NO_I2C_ADDR);
+
+			if (addr == PLHW_NO_I2C_ADDR)
+				continue;
+
+			snprintf(entry.value, sizeof entry.value, "0x%02X",
+				 addr);
+		} else {
+			const char *value = plhw_config_get_str(c, key, NULL);
+
+			if (value == NULL)
+				continue;
+
+			if (strlen(value) >= sizeof entry.value) {
+				LOG("value too long for %s", key);
+				goto exit_close_file;
+			}
+
+			strcpy(entry.value, value);
+		}
+
+		if (fwrite(&entry, sizeof entry, 1, f) != 1)
+			goto exit_close_file;
+
+		++header.n_entries;
+	}
+
+	if (fseek(f, 0, SEEK_SET) ||
+	    (fwrite(&header, sizeof header, 1, f) != 1))
+		goto exit_close_file;
+
+	ret = 0;
+
+exit_close_file:
+	if (fclose(f))
+		ret = -1;
+exit_put_config:
+	plhw_config_put(c);
+
+	if (ret)
+		LOG("failed to save profile (%s)", path);
+
+	return ret;
+}
+
+/* ----------------------------------------------------------------------------
+ * static functions
+ */
+
+static int map_profile(struct plhw_config *c, const char *path)
+{
+	const struct profile_header *header;
+	struct stat st;
+	void *profile;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		LOG("failed to open profile (%s)", path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) || (st.st_size < sizeof (struct profile_header))) {
+		LOG("invalid profile size (%s)", path);
+		close(fd);
+		return -1;
+	}
+
+	profile = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (profile == MAP_FAILED) {
+		LOG("failed to map profile (%s)", path);
+		return -1;
+	}
+
+	header = profile;
+
+	if (memcmp(header->magic, PROFILE_MAGIC, sizeof header->magic) ||
+	    (header->version != PROFILE_VERSION) ||
+	    (header->n_entries > ((st.st_size - sizeof *header)
+				  / sizeof (struct profile_entry)))) {
+		LOG("invalid profile (%s)", path);
+		munmap(profile, st.st_size);
+		return -1;
+	}
+
+	c->profile = profile;
+	c->profile_size = st.st_size;
+	c->entries = (const struct profile_entry *) &header[1];
+	c->n_entries = header->n_entries;
+
+	return 0;
+}
+
+static const char *find_entry(struct plhw_config *c, const char *key)
+{
+	const struct profile_entry *it;
+	const struct profile_entry *end;
+
+	end = &c->entries[c->n_entries];
+
+	for (it = c->entries; it != end; ++it)
+		if (!strncmp(it->key, key, sizeof it->key))
+			return (it->value[sizeof it->value - 1] == '\0') ?
+				it->value : NULL;
+
+	return NULL;
+}
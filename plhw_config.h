@@ -0,0 +1,42 @@
+/*
+  Plastic Logic hardware library - plhw_config
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INCLUDE_PLHW_CONFIG_H
+#define INCLUDE_PLHW_CONFIG_H 1
+
+/* Process-wide configuration shared by all the libplhw modules.  It is
+ * created on first use and freed when the last reference is put.  If the
+ * PLHW_PROFILE environment variable points to a binary board profile (see
+ * plhw_save_profile), it is mapped in memory instead of parsing the
+ * configuration file.  */
+struct plhw_config;
+
+extern struct plhw_config *plhw_config_get(void);
+extern void plhw_config_put(struct plhw_config *config);
+
+extern const char *plhw_config_get_str(struct plhw_config *config,
+				       const char *key, const char *def);
+extern int plhw_config_get_i2c_addr(struct plhw_config *config,
+				    const char *key, int def);
+extern long plhw_config_get_int(struct plhw_config *config, const char *key,
+				long def);
+
+#endif /* INCLUDE_PLHW_CONFIG_H */
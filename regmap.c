@@ -0,0 +1,336 @@
+/*
+  Plastic Logic hardware library - regmap
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "regmap.h"
+#include "i2cdev.h"
+#include "util.h"
+#include <assert.h>
+#include <string.h>
+
+#define LOG_TAG "regmap"
+#include <plsdk/log.h>
+
+#define REGMAP_NB_REGS 256
+
+struct regmap {
+	struct i2cdev *i2c;
+	int in_place;
+	uint8_t type[REGMAP_NB_REGS];
+	uint8_t cache[REGMAP_NB_REGS];
+	uint8_t valid[REGMAP_NB_REGS / 8];
+};
+
+static int read_cached(struct regmap *map, uint8_t reg, uint8_t *value);
+static int read_block(struct regmap *map, uint8_t reg, uint8_t *values,
+		      size_t n);
+static int is_valid(const struct regmap *map, uint8_t reg);
+static void set_valid(struct regmap *map, uint8_t reg, int valid);
+static int read_reg(struct regmap *map, uint8_t reg, uint8_t *value);
+static int write_reg(struct regmap *map, uint8_t reg, uint8_t value);
+
+struct regmap *regmap_init(struct i2cdev *i2c, const struct regmap_reg *regs,
+			   size_t n_regs)
+{
+	struct regmap *map;
+
+	map = malloc(sizeof (struct regmap));
+
+	if (map == NULL)
+		return NULL;
+
+	regmap_init_at(map, i2c, regs, n_regs);
+	map->in_place = 0;
+
+	return map;
+}
+
+size_t regmap_size(void)
+{
+	return PLHW_ALIGN(sizeof (struct regmap));
+}
+
+struct regmap *regmap_init_at(void *mem, struct i2cdev *i2c,
+			      const struct regmap_reg *regs, size_t n_regs)
+{
+	struct regmap *map = mem;
+	const struct regmap_reg *it;
+
+	assert(mem != NULL);
+	assert(i2c != NULL);
+	assert(regs != NULL);
+
+	map->i2c = i2c;
+	map->in_place = 1;
+	memset(map->type, REGMAP_VOLATILE, sizeof map->type);
+	memset(map->valid, 0, sizeof map->valid);
+
+	for (it = regs; it != &regs[n_regs]; ++it)
+		map->type[it->reg] = it->type;
+
+	return map;
+}
+
+void regmap_free(struct regmap *map)
+{
+	assert(map != NULL);
+
+	if (!map->in_place)
+		free(map);
+}
+
+int regmap_read(struct regmap *map, uint8_t reg, uint8_t *value)
+{
+	int ret;
+
+	assert(map != NULL);
+	assert(value != NULL);
+
+	i2cdev_lock(map->i2c);
+	ret = read_cached(map, reg, value);
+	i2cdev_unlock(map->i2c);
+
+	return ret;
+}
+
+int regmap_write(struct regmap *map, uint8_t reg, uint8_t value)
+{
+	int ret;
+
+	assert(map != NULL);
+
+	i2cdev_lock(map->i2c);
+	ret = write_reg(map, reg, value);
+	i2cdev_unlock(map->i2c);
+
+	return ret;
+}
+
+int regmap_read_block(struct regmap *map, uint8_t reg, uint8_t *values,
+		      size_t n)
+{
+	int ret;
+
+	assert(map != NULL);
+	assert(values != NULL);
+	assert((reg + n) <= REGMAP_NB_REGS);
+
+	i2cdev_lock(map->i2c);
+	ret = read_block(map, reg, values, n);
+	i2cdev_unlock(map->i2c);
+
+	return ret;
+}
+
+int regmap_update_bits(struct regmap *map, uint8_t reg, uint8_t mask,
+		       uint8_t value)
+{
+	uint8_t old;
+	uint8_t new;
+	int ret;
+
+	assert(map != NULL);
+
+	i2cdev_lock(map->i2c);
+	ret = read_cached(map, reg, &old);
+
+	if (!ret) {
+		new = (old & ~mask) | (value & mask);
+
+		if ((new != old) || (map->type[reg] == REGMAP_VOLATILE))
+			ret = write_reg(map, reg, new);
+	}
+
+	i2cdev_unlock(map->i2c);
+
+	return ret;
+}
+
+int regmap_add_update_bits(struct regmap *map, struct i2cdev_txn *t,
+			   uint8_t reg, uint8_t mask, uint8_t value)
+{
+	uint8_t old;
+	uint8_t new;
+	int ret;
+
+	assert(map != NULL);
+	assert(t != NULL);
+
+	i2cdev_lock(map->i2c);
+	ret = read_cached(map, reg, &old);
+
+	if (!ret) {
+		new = (old & ~mask) | (value & mask);
+
+		if ((new == old) && (map->type[reg] != REGMAP_VOLATILE))
+			goto exit_unlock;
+
+		if (i2cdev_txn_add_write_reg8(t, map->i2c, reg, &new, 1) < 0) {
+			ret = -1;
+			goto exit_unlock;
+		}
+
+		map->cache[reg] = new;
+		set_valid(map, reg, (map->type[reg] != REGMAP_VOLATILE));
+	}
+
+exit_unlock:
+	i2cdev_unlock(map->i2c);
+
+	return ret;
+}
+
+int regmap_refresh(struct regmap *map, uint8_t reg, uint8_t *value)
+{
+	int ret;
+
+	assert(map != NULL);
+	assert(value != NULL);
+	assert(map->type[reg] != REGMAP_WRITE_ONLY);
+
+	i2cdev_lock(map->i2c);
+	ret = read_reg(map, reg, value);
+	i2cdev_unlock(map->i2c);
+
+	return ret;
+}
+
+void regmap_invalidate(struct regmap *map)
+{
+	assert(map != NULL);
+
+	i2cdev_lock(map->i2c);
+	memset(map->valid, 0, sizeof map->valid);
+	i2cdev_unlock(map->i2c);
+}
+
+/* ----------------------------------------------------------------------------
+ * static functions
+ */
+
+static int read_cached(struct regmap *map, uint8_t reg, uint8_t *value)
+{
+	switch (map->type[reg]) {
+	case REGMAP_CACHED:
+		if (is_valid(map, reg))
+			break;
+
+		return read_reg(map, reg, value);
+
+	case REGMAP_WRITE_ONLY:
+		if (is_valid(map, reg))
+			break;
+
+		LOG("write-only register not written yet: 0x%02X", reg);
+		return -1;
+
+	default:
+		return read_reg(map, reg, value);
+	}
+
+	*value = map->cache[reg];
+
+	return 0;
+}
+
+static int read_block(struct regmap *map, uint8_t reg, uint8_t *values,
+		      size_t n)
+{
+	size_t i;
+	int bus = 0;
+
+	for (i = 0; i < n; ++i) {
+		const uint8_t r = reg + i;
+
+		/* write-only registers can't be part of a burst */
+		if (map->type[r] == REGMAP_WRITE_ONLY)
+			goto read_each;
+
+		if (!is_valid(map, r))
+			bus = 1;
+	}
+
+	if (!bus) {
+		memcpy(values, &map->cache[reg], n);
+		return 0;
+	}
+
+	if (i2cdev_read_reg8(map->i2c, reg, values, n)) {
+		for (i = 0; i < n; ++i)
+			set_valid(map, (reg + i), 0);
+
+		return -1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		const uint8_t r = reg + i;
+
+		map->cache[r] = values[i];
+		set_valid(map, r, (map->type[r] == REGMAP_CACHED));
+	}
+
+	return 0;
+
+read_each:
+	for (i = 0; i < n; ++i)
+		if (read_cached(map, (reg + i), &values[i]))
+			return -1;
+
+	return 0;
+}
+
+static int is_valid(const struct regmap *map, uint8_t reg)
+{
+	return (map->valid[reg / 8] & (1 << (reg % 8))) ? 1 : 0;
+}
+
+static void set_valid(struct regmap *map, uint8_t reg, int valid)
+{
+	if (valid)
+		map->valid[reg / 8] |= (1 << (reg % 8));
+	else
+		map->valid[reg / 8] &= ~(1 << (reg % 8));
+}
+
+static int read_reg(struct regmap *map, uint8_t reg, uint8_t *value)
+{
+	if (i2cdev_read_reg8(map->i2c, reg, value, 1)) {
+		set_valid(map, reg, 0);
+		return -1;
+	}
+
+	map->cache[reg] = *value;
+	set_valid(map, reg, (map->type[reg] == REGMAP_CACHED));
+
+	return 0;
+}
+
+static int write_reg(struct regmap *map, uint8_t reg, uint8_t value)
+{
+	if (i2cdev_write_reg8(map->i2c, reg, &value, 1)) {
+		set_valid(map, reg, 0);
+		return -1;
+	}
+
+	map->cache[reg] = value;
+	set_valid(map, reg, (map->type[reg] != REGMAP_VOLATILE));
+
+	return 0;
+}
@@ -0,0 +1,72 @@
+/*
+  Plastic Logic hardware library - regmap
+
+  Copyright (C) 2013 Plastic Logic Limited
+
+      Guillaume Tucker <guillaume.tucker@plasticlogic.com>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at your
+  option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+  License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INCLUDE_REGMAP_H
+#define INCLUDE_REGMAP_H 1
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct i2cdev;
+struct i2cdev_txn;
+struct regmap;
+
+/* Registers not listed in the map are volatile. */
+enum regmap_reg_type {
+	REGMAP_VOLATILE = 0,         /* always accessed on the bus */
+	REGMAP_CACHED,               /* read once, then served from cache */
+	REGMAP_WRITE_ONLY,           /* never read, cache has last value */
+};
+
+struct regmap_reg {
+	uint8_t reg;
+	enum regmap_reg_type type;
+};
+
+extern struct regmap *regmap_init(struct i2cdev *i2c,
+				  const struct regmap_reg *regs,
+				  size_t n_regs);
+extern void regmap_free(struct regmap *map);
+
+/* In-place initialisation in regmap_size bytes owned by the caller. */
+extern size_t regmap_size(void);
+extern struct regmap *regmap_init_at(void *mem, struct i2cdev *i2c,
+				     const struct regmap_reg *regs,
+				     size_t n_regs);
+
+extern int regmap_read(struct regmap *map, uint8_t reg, uint8_t *value);
+extern int regmap_write(struct regmap *map, uint8_t reg, uint8_t value);
+
+/* Read n contiguous registers, with a single burst when any of them has to
+ * be read on the bus. */
+extern int regmap_read_block(struct regmap *map, uint8_t reg, uint8_t *values,
+			     size_t n);
+extern int regmap_update_bits(struct regmap *map, uint8_t reg, uint8_t mask,
+			      uint8_t value);
+/* Queue the update to a transaction, nothing if the value is unchanged.  The
+ * cache has the new value right away so call regmap_invalidate if the
+ * transaction fails. */
+extern int regmap_add_update_bits(struct regmap *map, struct i2cdev_txn *t,
+				  uint8_t reg, uint8_t mask, uint8_t value);
+extern int regmap_refresh(struct regmap *map, uint8_t reg, uint8_t *value);
+extern void regmap_invalidate(struct regmap *map);
+
+#endif /* INCLUDE_REGMAP_H */
@@ -20,10 +20,14 @@
 */
 
 #include "tps65185.h"
+#include "board.h"
 #include "i2cdev.h"
+#include "regmap.h"
+#include "plhw_config.h"
+#include "util.h"
 #include <libplhw.h>
-#include <plsdk/plconfig.h>
 #include <assert.h>
+#include <string.h>
 #include <unistd.h>
 
 #define LOG_TAG "tps65185"
@@ -31,8 +35,11 @@
 
 struct tps65185 {
 	struct i2cdev *i2c;
-	struct plconfig *config;
+	struct regmap *map;
+	struct plhw_config *config;
 	struct tps65185_version version;
+	int in_place;
+	int ready;
 };
 
 struct regval {
@@ -40,55 +47,158 @@ struct regval {
 	uint8_t val;
 };
 
+/* The ACTIVE and STANDBY bits in the ENABLE register clear themselves and
+ * the chip turns the rails off on a fault, so it is never cached. */
+static const struct regmap_reg tps65185_regs[] = {
+	{ TPS65185_REG_ENABLE,     REGMAP_VOLATILE },
+	{ TPS65185_REG_VADJ,       REGMAP_CACHED   },
+	{ TPS65185_REG_VCOM1,      REGMAP_CACHED   },
+	{ TPS65185_REG_VCOM2,      REGMAP_CACHED   },
+	{ TPS65185_REG_INT_EN1,    REGMAP_CACHED   },
+	{ TPS65185_REG_INT_EN2,    REGMAP_CACHED   },
+	{ TPS65185_REG_UPSEQ0,     REGMAP_CACHED   },
+	{ TPS65185_REG_UPSEQ1,     REGMAP_CACHED   },
+	{ TPS65185_REG_DWNSEQ0,    REGMAP_CACHED   },
+	{ TPS65185_REG_DWNSEQ1,    REGMAP_CACHED   },
+	{ TPS65185_REG_TMST2,      REGMAP_CACHED   },
+	{ TPS65185_REG_REV_ID,     REGMAP_CACHED   },
+};
+
+static int check_ready(struct tps65185 *p);
+static int setup_cb(void *ctx);
+
 struct tps65185 *tps65185_init(const char *i2c_bus, char i2c_address)
 {
 	struct tps65185 *p;
 
-	p = malloc(sizeof(struct tps65185));
+	p = malloc(tps65185_size());
 
 	if (p == NULL)
 		return NULL;
 
-	p->config = plconfig_init(NULL, "libplhw");
+	if (tps65185_init_at(p, i2c_bus, i2c_address) == NULL)
+		goto err_free_tps65185;
+
+	p->in_place = 0;
+
+	if (!plhw_config_get_int(p->config, "lazy-init", 0)
+	    && tps65185_setup(p)) {
+		tps65185_free(p);
+		return NULL;
+	}
+
+	return p;
+
+err_free_tps65185:
+	free(p);
+
+	return NULL;
+}
+
+size_t tps65185_size(void)
+{
+	return PLHW_ALIGN(sizeof (struct tps65185)) + i2cdev_size()
+		+ regmap_size();
+}
+
+struct tps65185 *tps65185_init_at(void *mem, const char *i2c_bus,
+				  char i2c_address)
+{
+	struct tps65185 *p = mem;
+	char *i2c_mem = (char *) mem + PLHW_ALIGN(sizeof (struct tps65185));
+
+	assert(mem != NULL);
+
+	p->config = plhw_config_get();
 
 	if (p->config == NULL)
-		goto err_free_tps65185;
+		return NULL;
 
-	if (i2c_address == PLHW_NO_I2C_ADDR)
-		i2c_address = plconfig_get_i2c_addr(
+	if ((unsigned char) i2c_address == PLHW_NO_I2C_ADDR)
+		i2c_address = plhw_config_get_i2c_addr(
 			p->config, "TPS65185-address", 0x68);
 
-	p->i2c = i2cdev_init(i2c_bus, i2c_address);
+	p->i2c = i2cdev_init_at(i2c_mem, i2c_bus, i2c_address);
 
 	if (p->i2c == NULL) {
 		LOG("failed to initialise I2C");
-		goto err_free_plconfig;
+		plhw_config_put(p->config);
+		return NULL;
 	}
 
-	if (i2cdev_read_reg8(p->i2c, TPS65185_REG_REV_ID, &p->version, 1)) {
+	p->map = regmap_init_at((i2c_mem + i2cdev_size()), p->i2c,
+				tps65185_regs,
+				sizeof tps65185_regs / sizeof tps65185_regs[0]);
+	p->in_place = 1;
+	lazy_set_ready(&p->ready, 0);
+
+	return p;
+}
+
+int tps65185_add_setup(struct tps65185 *p, struct i2cdev_txn **t)
+{
+	assert(p != NULL);
+	assert(t != NULL);
+
+	if ((*t == NULL) && ((*t = i2cdev_txn_begin(p->i2c)) == NULL))
+		return -1;
+
+	if (i2cdev_txn_add_read_reg8(*t, p->i2c, TPS65185_REG_REV_ID,
+				     &p->version, 1) < 0)
+		return -1;
+
+	lazy_set_ready(&p->ready, 1);
+
+	return 0;
+}
+
+int tps65185_setup(struct tps65185 *p)
+{
+	assert(p != NULL);
+
+	if (regmap_read(p->map, TPS65185_REG_REV_ID, (uint8_t *) &p->version)) {
 		LOG("failed to read version register");
-		goto err_free_i2cdev;
+		lazy_set_ready(&p->ready, 0);
+		return -1;
 	}
 
-	return p;
+	lazy_set_ready(&p->ready, 1);
 
-err_free_i2cdev:
-	i2cdev_free(p->i2c);
-err_free_plconfig:
-	plconfig_free(p->config);
-err_free_tps65185:
-	free(p);
+	return 0;
+}
 
-	return NULL;
+int tps65185_get_rev_id(const struct tps65185 *p)
+{
+	assert(p != NULL);
+
+	return lazy_is_ready(&p->ready) ? *(const uint8_t *) &p->version : -1;
+}
+
+void tps65185_set_rev_id(struct tps65185 *p, int rev_id)
+{
+	assert(p != NULL);
+
+	*(uint8_t *) &p->version = rev_id;
+	lazy_set_ready(&p->ready, 1);
 }
 
 void tps65185_free(struct tps65185 *p)
 {
 	assert(p != NULL);
 
+	regmap_free(p->map);
 	i2cdev_free(p->i2c);
-	plconfig_free(p->config);
-	free(p);
+	plhw_config_put(p->config);
+
+	if (!p->in_place)
+		free(p);
+}
+
+struct i2cdev *tps65185_get_i2c(struct tps65185 *p)
+{
+	assert(p != NULL);
+
+	return p->i2c;
 }
 
 void tps65185_get_info(struct tps65185 *p, struct tps65185_info *info)
@@ -96,6 +206,11 @@ void tps65185_get_info(struct tps65185 *p, struct tps65185_info *info)
 	assert(p != NULL);
 	assert(info != NULL);
 
+	if (check_ready(p)) {
+		memset(info, 0, sizeof *info);
+		return;
+	}
+
 	info->version = p->version.version;
 	info->major = p->version.major;
 	info->minor = p->version.minor;
@@ -104,21 +219,13 @@ void tps65185_get_info(struct tps65185 *p, struct tps65185_info *info)
 int tps65185_set_vcom(struct tps65185 *p, uint16_t value)
 {
 	const uint8_t val1 = value & 0xFF;
-	uint8_t val2;
+	const uint8_t val2 = (value >> 8) & 0x01;
 
 	assert(p != NULL);
 	assert(value < 0x200);
 
-	if (i2cdev_read_reg8(p->i2c, TPS65185_REG_VCOM2, &val2, 1)) {
-		LOG("failed to read VCOM2 register");
-		return -1;
-	}
-
-	val2 &= 0xFE;
-	val2 |= (value >> 8) & 0x01;
-
-	if (i2cdev_write_reg8(p->i2c, TPS65185_REG_VCOM1, &val1, 1) ||
-	    i2cdev_write_reg8(p->i2c, TPS65185_REG_VCOM2, &val2, 1)) {
+	if (regmap_write(p->map, TPS65185_REG_VCOM1, val1) ||
+	    regmap_update_bits(p->map, TPS65185_REG_VCOM2, 0x01, val2)) {
 		LOG("failed to write to the VCOM registers");
 		return -1;
 	}
@@ -134,8 +241,8 @@ int tps65185_get_vcom(struct tps65185 *p, uint16_t *value)
 	assert(p != NULL);
 	assert(value != NULL);
 
-	if (i2cdev_read_reg8(p->i2c, TPS65185_REG_VCOM1, &val1, 1) ||
-	    i2cdev_read_reg8(p->i2c, TPS65185_REG_VCOM2, &val2, 1)) {
+	if (regmap_read(p->map, TPS65185_REG_VCOM1, &val1) ||
+	    regmap_read(p->map, TPS65185_REG_VCOM2, &val2)) {
 		LOG("failed to read the VCOM registers");
 		return -1;
 	}
@@ -148,38 +255,45 @@ int tps65185_get_vcom(struct tps65185 *p, uint16_t *value)
 int tps65185_set_seq(struct tps65185 *p, const struct tps65185_seq *seq,
 		     int up)
 {
-	uint8_t reg_val;
+	uint8_t reg_val[2];
 	uint8_t reg_addr;
+	int ret;
 
 	assert(p != NULL);
 	assert(seq != NULL);
 
-	reg_val = seq->vddh;
-	reg_val |= seq->vpos << 2;
-	reg_val |= seq->vee << 4;
-	reg_val |= seq->vneg << 6;
+	reg_val[0] = seq->vddh;
+	reg_val[0] |= seq->vpos << 2;
+	reg_val[0] |= seq->vee << 4;
+	reg_val[0] |= seq->vneg << 6;
+
+	reg_val[1] = seq->strobe1;
+	reg_val[1] |= seq->strobe2 << 2;
+	reg_val[1] |= seq->strobe3 << 4;
+	reg_val[1] |= seq->strobe4 << 6;
 
+	/* SEQ0 and SEQ1 are adjacent, send them in one burst */
 	reg_addr = up ? TPS65185_REG_UPSEQ0 : TPS65185_REG_DWNSEQ0;
 
-	if (i2cdev_write_reg8(p->i2c, reg_addr, &reg_val, 1))
+	if (i2cdev_wc_begin(p->i2c))
 		return -1;
 
-	reg_val = seq->strobe1;
-	reg_val |= seq->strobe2 << 2;
-	reg_val |= seq->strobe3 << 4;
-	reg_val |= seq->strobe4 << 6;
+	ret = regmap_write(p->map, reg_addr, reg_val[0]);
 
-	reg_addr = up ? TPS65185_REG_UPSEQ1 : TPS65185_REG_DWNSEQ1;
+	if (!ret)
+		ret = regmap_write(p->map, (reg_addr + 1), reg_val[1]);
 
-	if (i2cdev_write_reg8(p->i2c, reg_addr, &reg_val, 1))
-		return -1;
+	if (i2cdev_wc_flush(p->i2c)) {
+		regmap_invalidate(p->map);
+		ret = -1;
+	}
 
-	return 0;
+	return ret ? -1 : 0;
 }
 
 int tps65185_get_seq(struct tps65185 *p, struct tps65185_seq *seq, int up)
 {
-	uint8_t reg_val;
+	uint8_t reg_val[2];
 	uint8_t reg_addr;
 
 	assert(p != NULL);
@@ -187,23 +301,18 @@ int tps65185_get_seq(struct tps65185 *p, struct tps65185_seq *seq, int up)
 
 	reg_addr = up ? TPS65185_REG_UPSEQ0 : TPS65185_REG_DWNSEQ0;
 
-	if (i2cdev_read_reg8(p->i2c, reg_addr, &reg_val, 1))
+	if (regmap_read_block(p->map, reg_addr, reg_val, 2))
 		return -1;
 
-	seq->vddh = reg_val & 0x3;
-	seq->vpos = (reg_val >> 2) & 0x3;
-	seq->vee = (reg_val >> 4) & 0x3;
-	seq->vneg = (reg_val >> 6) & 0x3;
-
-	reg_addr = up ? TPS65185_REG_UPSEQ1 : TPS65185_REG_DWNSEQ1;
-
-	if (i2cdev_read_reg8(p->i2c, reg_addr, &reg_val, 1))
-		return -1;
+	seq->vddh = reg_val[0] & 0x3;
+	seq->vpos = (reg_val[0] >> 2) & 0x3;
+	seq->vee = (reg_val[0] >> 4) & 0x3;
+	seq->vneg = (reg_val[0] >> 6) & 0x3;
 
-	seq->strobe1 = reg_val & 0x3;
-	seq->strobe2 = (reg_val >> 2) & 0x3;
-	seq->strobe3 = (reg_val >> 4) & 0x3;
-	seq->strobe4 = (reg_val >> 6) & 0x3;
+	seq->strobe1 = reg_val[1] & 0x3;
+	seq->strobe2 = (reg_val[1] >> 2) & 0x3;
+	seq->strobe3 = (reg_val[1] >> 4) & 0x3;
+	seq->strobe4 = (reg_val[1] >> 6) & 0x3;
 
 	return 0;
 }
@@ -219,19 +328,28 @@ int tps65185_set_power(struct tps65185 *p, enum tps65185_power power)
 	assert(p != NULL);
 	assert((power == TPS65185_ACTIVE) || (power == TPS65185_STANDBY));
 
-	if (i2cdev_read_reg8(p->i2c, TPS65185_REG_ENABLE, &val, 1))
-		return -1;
-
 	flag = 1 << power;
-	val |= flag;
+	i2cdev_lock_prio(p->i2c, I2CDEV_PRIO_HV);
 
-	if (i2cdev_write_reg8(p->i2c, TPS65185_REG_ENABLE, &val, 1))
+	if (regmap_read(p->map, TPS65185_REG_ENABLE, &val) ||
+	    regmap_write(p->map, TPS65185_REG_ENABLE, (val | flag))) {
+		i2cdev_unlock(p->i2c);
 		return -1;
+	}
+
+	i2cdev_unlock(p->i2c);
+	val |= flag;
 
 	loop = POLL_LOOPS;
 
 	while (val & flag) {
-		if (i2cdev_read_reg8(p->i2c, TPS65185_REG_ENABLE, &val, 1))
+		int ret;
+
+		i2cdev_lock_prio(p->i2c, I2CDEV_PRIO_HV);
+		ret = regmap_refresh(p->map, TPS65185_REG_ENABLE, &val);
+		i2cdev_unlock(p->i2c);
+
+		if (ret)
 			return -1;
 
 		if (!loop--) {
@@ -247,23 +365,19 @@ int tps65185_set_power(struct tps65185 *p, enum tps65185_power power)
 
 int tps65185_set_en(struct tps65185 *p, enum tps65185_en_id id, int on)
 {
-	uint8_t val;
 	uint8_t flag;
+	int ret;
 
 	assert(p != NULL);
 	assert((id >= 0) && (id < 6));
 
-	if (i2cdev_read_reg8(p->i2c, TPS65185_REG_ENABLE, &val, 1))
-		return -1;
-
 	flag = 1 << id;
+	i2cdev_lock_prio(p->i2c, I2CDEV_PRIO_HV);
+	ret = regmap_update_bits(p->map, TPS65185_REG_ENABLE, flag,
+				 on ? flag : 0);
+	i2cdev_unlock(p->i2c);
 
-	if (on)
-		val |= flag;
-	else
-		val &= ~flag;
-
-	return i2cdev_write_reg8(p->i2c, TPS65185_REG_ENABLE, &val, 1);
+	return ret;
 }
 
 int tps65185_get_en(struct tps65185 *p, enum tps65185_en_id id)
@@ -274,7 +388,7 @@ int tps65185_get_en(struct tps65185 *p, enum tps65185_en_id id)
 	assert(p != NULL);
 	assert((id >= 0) && (id < 6));
 
-	if (i2cdev_read_reg8(p->i2c, TPS65185_REG_ENABLE, &val, 1))
+	if (regmap_read(p->map, TPS65185_REG_ENABLE, &val))
 		return -1;
 
 	flag = 1 << id;
@@ -286,6 +400,17 @@ int tps65185_get_en(struct tps65185 *p, enum tps65185_en_id id)
  * static functions
  */
 
+/* With lazy-init, REV_ID is only read on first use */
+static int check_ready(struct tps65185 *p)
+{
+	return lazy_setup(&p->ready, p->i2c, setup_cb, p);
+}
+
+static int setup_cb(void *ctx)
+{
+	return tps65185_setup(ctx);
+}
+
 #if 0
 		{ TPS65185_REG_ENABLE,     0x00 },
 		{ TPS65185_REG_VADJ,       0x03 },
@@ -44,6 +44,10 @@ enum tps65185_register {
 	TPS65185_REG_REV_ID     = 0x10,
 };
 
+/* values of the version field in REV_ID */
+#define TPS65185_VERSION 0x5
+#define TPS65186_VERSION 0x6
+
 struct tps65185_version {
 	uint8_t version:4;
 	uint8_t minor:2;
@@ -20,6 +20,7 @@
 */
 
 #include "util.h"
+#include "i2cdev.h"
 #include <assert.h>
 #include <unistd.h>
 
@@ -66,3 +67,38 @@ int wait_cmd(void *ctx, int cmd, int set_value, int get_value,
 
 	return 0;
 }
+
+int lazy_setup(int *ready, struct i2cdev *i2c, setup_func_t setup, void *ctx)
+{
+	int ret = 0;
+
+	assert(ready != NULL);
+	assert(i2c != NULL);
+	assert(setup != NULL);
+
+	if (lazy_is_ready(ready))
+		return 0;
+
+	i2cdev_lock(i2c);
+
+	if (!lazy_is_ready(ready))
+		ret = setup(ctx);
+
+	i2cdev_unlock(i2c);
+
+	return ret;
+}
+
+int lazy_is_ready(const int *ready)
+{
+	assert(ready != NULL);
+
+	return __atomic_load_n(ready, __ATOMIC_ACQUIRE);
+}
+
+void lazy_set_ready(int *ready, int value)
+{
+	assert(ready != NULL);
+
+	__atomic_store_n(ready, value, __ATOMIC_RELEASE);
+}
@@ -22,6 +22,11 @@
 #ifndef INCLUDE_UTIL_H
 #define INCLUDE_UTIL_H 1
 
+struct i2cdev;
+
+/* Size rounded up so that the next object in an arena is aligned */
+#define PLHW_ALIGN(size) (((size) + 7) & ~((size_t) 7))
+
 typedef int (*cmd_func_t)(void *ctx, int cmd_id);
 typedef int (*cmd_set_func_t)(void *ctx, int cmd_id, int on);
 
@@ -29,4 +34,15 @@ extern int wait_cmd(void *ctx, int cmd, int set_value, int get_value,
 		    unsigned poll_us, unsigned timeout,
 		    cmd_func_t read, cmd_func_t get, cmd_set_func_t set);
 
+/* Lazy set-up of a part.  The ready flag gets read without any lock, so it
+ * is an int of its own only accessed with lazy_is_ready and lazy_set_ready.
+ * lazy_setup runs setup(ctx) if the part is not ready yet, with the lock of
+ * its I2C device held.  setup is expected to set the flag on success.  */
+typedef int (*setup_func_t)(void *ctx);
+
+extern int lazy_setup(int *ready, struct i2cdev *i2c, setup_func_t setup,
+		      void *ctx);
+extern int lazy_is_ready(const int *ready);
+extern void lazy_set_ready(int *ready, int value);
+
 #endif /* INCLUDE_UTIL_H */